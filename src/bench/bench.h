@@ -0,0 +1,15 @@
+#pragma once
+
+#include <chrono>
+
+/* Helpers shared by the benchmarks */
+
+static inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the same sequence on every run and platform, unlike rand()
+static inline unsigned next_random(unsigned *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
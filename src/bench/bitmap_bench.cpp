@@ -0,0 +1,96 @@
+/* bitmap_bench.cpp: block allocator microbenchmark */
+
+#include "bitmap.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+/* Macros */
+
+#define BLOCK_BITS  (4096 * 8)
+
+/* Baseline allocator: one byte per block, linear scan from block 0 */
+
+struct ByteMap {
+    bool*  used;
+    size_t blocks;
+
+    ssize_t alloc() {
+        for(size_t i = 0; i < blocks; ++i) {
+            if(!used[i]) {
+                used[i] = true;
+                return (ssize_t)i;
+            }
+        }
+        return -1;
+    }
+};
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    size_t blocks = 1000000;
+    double fill   = 0.90;
+    if (argc > 1) blocks = strtoul(argv[1], NULL, 10);
+    if (argc > 2) fill   = atof(argv[2]);
+
+    // allocate the tail of an image that is already `fill` used
+    size_t prefill = (size_t)(blocks * fill);
+    size_t count   = blocks - prefill;
+    if (count > 20000) count = 20000;
+
+    printf("%lu blocks, %.1f%% used, %lu allocations\n", blocks, fill * 100, count);
+
+    ByteMap bytes;
+    bytes.blocks = blocks;
+    bytes.used   = (bool*)calloc(blocks, sizeof(bool));
+    memset(bytes.used, 1, prefill);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (bytes.alloc() < 0) {
+            fprintf(stderr, "byte map ran out of blocks\n");
+            return EXIT_FAILURE;
+        }
+    }
+    double byte_secs = seconds_since(start);
+    printf("  byte map:   %10.1f ns/alloc  %8lu KB\n", byte_secs * 1e9 / count, blocks / 1024);
+    free(bytes.used);
+
+    Bitmap words;
+    if (!words.init(blocks, BLOCK_BITS)) {
+        fprintf(stderr, "failed to allocate bitmap\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < prefill; ++i) {
+        words.set(i);
+    }
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (words.alloc() < 0) {
+            fprintf(stderr, "bitmap ran out of blocks\n");
+            return EXIT_FAILURE;
+        }
+    }
+    double word_secs = seconds_since(start);
+    printf("  word map:   %10.1f ns/alloc  %8lu KB\n", word_secs * 1e9 / count, blocks / 8 / 1024);
+    printf("  speedup:    %10.1fx\n", byte_secs / word_secs);
+
+    // a bitmap that fills its last word exactly has no padding bits, a run
+    // reaching the end must stop there
+    Bitmap exact;
+    size_t got = 0;
+    if (!exact.init(BLOCK_BITS, BLOCK_BITS)) {
+        fprintf(stderr, "failed to allocate bitmap\n");
+        return EXIT_FAILURE;
+    }
+    exact.setRange(0, BLOCK_BITS - 10);
+    ssize_t run = exact.allocRun(100, BLOCK_BITS - 10, &got);
+    if (run != BLOCK_BITS - 10 || got != 10 || exact.used() != BLOCK_BITS) {
+        fprintf(stderr, "run at the end of the bitmap: %ld, %lu bits\n", run, got);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
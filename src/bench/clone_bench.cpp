@@ -0,0 +1,137 @@
+/* clone_bench.cpp: blocks written and used for copies of a large file, copied through read and write, with and without dedup, or cloned */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define FILE_BYTES      (4 * 1024 * 1024)       /* size of the original */
+#define CHUNK_BYTES     (16 * Disk::BLOCK_SIZE) /* transfer size */
+#define EDIT_BLOCKS     4                       /* blocks rewritten in every copy */
+
+static void fill(char *buffer, size_t length, unsigned seed) {
+    for (size_t n = 0; n < length; ++n) {
+        buffer[n] = (char)next_random(&seed);
+    }
+}
+
+// copy i rewrites EDIT_BLOCKS blocks spread over the file, like a new version of an image
+static bool edit(FileSystem& fs, size_t inode, std::vector<char>& expected, unsigned i) {
+    std::vector<char> block(Disk::BLOCK_SIZE);
+    for (size_t e = 0; e < EDIT_BLOCKS; ++e) {
+        size_t offset = ((i * EDIT_BLOCKS + e) * 997 % (FILE_BYTES / Disk::BLOCK_SIZE)) * Disk::BLOCK_SIZE;
+        fill(block.data(), Disk::BLOCK_SIZE, i * EDIT_BLOCKS + e + 1);
+        if (fs.write(inode, block.data(), Disk::BLOCK_SIZE, offset) != (ssize_t)Disk::BLOCK_SIZE) {
+            return false;
+        }
+        memcpy(expected.data() + offset, block.data(), Disk::BLOCK_SIZE);
+    }
+    return true;
+}
+
+static bool run(const char *path, size_t copies, const char *label, int flags, bool clone) {
+    // format() gives 10% of the blocks to inodes
+    size_t blocks = (copies + 1) * (FILE_BYTES / Disk::BLOCK_SIZE + 16) * 5 / 4 + 1024;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return false;
+    }
+
+    std::vector<char> original(FILE_BYTES), buffer(FILE_BYTES);
+    std::vector<std::vector<char> > expected(copies);
+    std::vector<ssize_t> inodes(copies);
+    fill(original.data(), FILE_BYTES, 0);
+    ssize_t source = fs.create();
+    for (size_t offset = 0; source >= 0 && offset < FILE_BYTES; offset += CHUNK_BYTES) {
+        if (fs.write(source, original.data() + offset, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+            source = -1;
+        }
+    }
+    if (source < 0 || !fs.sync()) {
+        fprintf(stderr, "%s: unable to write the original\n", label);
+        return false;
+    }
+
+    size_t writes = disk.blockWrites();
+    size_t reads  = disk.blockReads();
+    fs.stats().reset();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < copies; ++i) {
+        if (clone) {
+            inodes[i] = fs.clone(source);
+        } else {
+            inodes[i] = fs.create();
+            for (size_t offset = 0; inodes[i] >= 0 && offset < FILE_BYTES; offset += CHUNK_BYTES) {
+                if (fs.read(source, buffer.data(), CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES ||
+                    fs.write(inodes[i], buffer.data(), CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                    inodes[i] = -1;
+                }
+            }
+        }
+        expected[i] = original;
+        if (inodes[i] < 0 || !edit(fs, inodes[i], expected[i], (unsigned)i)) {
+            fprintf(stderr, "%s: unable to make copy %lu\n", label, i);
+            return false;
+        }
+    }
+    fs.sync();
+    double secs = seconds_since(start);
+    writes = disk.blockWrites() - writes;
+    reads  = disk.blockReads() - reads;
+    size_t used = fs.stats().blocksAllocated() - fs.stats().blocksFreed();
+    fs.unmount();
+    disk.close(true);
+
+    // every copy reads back with its own edits after a remount
+    if (!disk.open(path, blocks) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", path);
+        return false;
+    }
+    for (size_t i = 0; i < copies; ++i) {
+        if (fs.read(inodes[i], buffer.data(), FILE_BYTES, 0) != (ssize_t)FILE_BYTES ||
+            memcmp(buffer.data(), expected[i].data(), FILE_BYTES) != 0) {
+            fprintf(stderr, "%s: copy %lu reads back wrong\n", label, i);
+            return false;
+        }
+    }
+    if (fs.read(source, buffer.data(), FILE_BYTES, 0) != (ssize_t)FILE_BYTES ||
+        memcmp(buffer.data(), original.data(), FILE_BYTES) != 0) {
+        fprintf(stderr, "%s: the original reads back wrong\n", label);
+        return false;
+    }
+
+    printf("%-11s %7lu blocks used  %7lu block writes  %7lu block reads  %9.2f ms per copy\n",
+           label, used, writes, reads, secs * 1000 / copies);
+    fflush(stdout);
+    fs.unmount();
+    disk.close(true);
+    unlink(path);
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "clone_bench.img";
+    size_t copies = 16;
+    if (argc > 1) path   = argv[1];
+    if (argc > 2) copies = strtoul(argv[2], NULL, 10);
+
+    printf("%lu copies of a %d MB file, %d blocks rewritten in each\n", copies, FILE_BYTES / (1024 * 1024), EDIT_BLOCKS);
+    if (!run(path, copies, "copied", FileSystem::FORMAT_QUICK, false) ||
+        !run(path, copies, "dedup", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_DEDUP, false) ||
+        !run(path, copies, "cloned", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_DEDUP, true)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
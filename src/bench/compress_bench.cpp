@@ -0,0 +1,121 @@
+/* compress_bench.cpp: blocks written and read for text-like files, with and without compression */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define FILE_BYTES      (64 * 1024)             /* size of every file */
+#define CHUNK_BYTES     (16 * Disk::BLOCK_SIZE) /* transfer size */
+
+// lines of words from a small vocabulary, like logs or source code
+static void fill(char *buffer, size_t length, unsigned seed) {
+    static const char *words[] = {
+        "the", "block", "inode", "return", "size_t", "if", "else", "for", "while", "data",
+        "pointer", "error", "read", "write", "file", "system", "disk", "offset", "length", "count",
+        "static", "const", "char", "buffer", "free", "lock", "mount", "sync", "cache", "journal",
+    };
+    size_t n = 0, column = 0;
+    while (n < length) {
+        const char *word = words[next_random(&seed) % (sizeof(words) / sizeof(words[0]))];
+        for (const char *c = word; *c && n < length; ++c, ++column) {
+            buffer[n++] = *c;
+        }
+        if (n < length) {
+            buffer[n++] = (column > 60) ? '\n' : ' ';
+            column = (column > 60) ? 0 : column + 1;
+        }
+    }
+}
+
+static bool run(const char *path, size_t files, const char *label, int flags) {
+    // format() gives 10% of the blocks to inodes
+    size_t blocks = files * (FILE_BYTES / Disk::BLOCK_SIZE + 1) * 5 / 4 + 1024;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return false;
+    }
+
+    std::vector<char> buffer(FILE_BYTES), check(FILE_BYTES);
+    std::vector<ssize_t> inodes(files);
+    size_t writes = disk.blockWrites();
+    fs.stats().reset();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; ++i) {
+        fill(buffer.data(), FILE_BYTES, (unsigned)i);
+        inodes[i] = fs.create();
+        for (size_t offset = 0; inodes[i] >= 0 && offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.write(inodes[i], buffer.data() + offset, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                inodes[i] = -1;
+            }
+        }
+        if (inodes[i] < 0) {
+            fprintf(stderr, "%s: unable to write file %lu\n", label, i);
+            return false;
+        }
+    }
+    fs.sync();
+    double write_secs = seconds_since(start);
+    writes = disk.blockWrites() - writes;
+    size_t used = fs.stats().blocksAllocated() - fs.stats().blocksFreed();
+    fs.unmount();
+    disk.close(true);
+
+    // read everything back from a cold cache
+    if (!disk.open(path, blocks) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", path);
+        return false;
+    }
+    size_t reads = disk.blockReads();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; ++i) {
+        fill(check.data(), FILE_BYTES, (unsigned)i);
+        for (size_t offset = 0; offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.read(inodes[i], buffer.data() + offset, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                fprintf(stderr, "%s: unable to read file %lu\n", label, i);
+                return false;
+            }
+        }
+        if (memcmp(buffer.data(), check.data(), FILE_BYTES) != 0) {
+            fprintf(stderr, "%s: file %lu reads back wrong\n", label, i);
+            return false;
+        }
+    }
+    double read_secs = seconds_since(start);
+    reads = disk.blockReads() - reads;
+
+    double megabytes = (double)files * FILE_BYTES / (1024 * 1024);
+    printf("%-11s %7lu blocks used  %7lu block writes  %7lu block reads  %7.1f MB/s write  %7.1f MB/s read\n",
+           label, used, writes, reads, megabytes / write_secs, megabytes / read_secs);
+    fflush(stdout);
+    fs.unmount();
+    disk.close(true);
+    unlink(path);
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "compress_bench.img";
+    size_t files = 256;
+    if (argc > 1) path  = argv[1];
+    if (argc > 2) files = strtoul(argv[2], NULL, 10);
+
+    printf("%lu text files of %d KB\n", files, FILE_BYTES / 1024);
+    if (!run(path, files, "blocks", FileSystem::FORMAT_QUICK) ||
+        !run(path, files, "compressed", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_COMPRESSED)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/* dedup_bench.cpp: blocks written and read for files that are mostly copies, with and without dedup */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define FILE_BYTES      (64 * 1024)             /* size of every file */
+#define CHUNK_BYTES     (16 * Disk::BLOCK_SIZE) /* transfer size */
+#define ORIGINALS       16                      /* distinct files the others are versions of */
+
+// file i is a version of original i % ORIGINALS: the same blocks but for
+// one, like backups or checked out trees
+static void fill(char *buffer, size_t length, unsigned i) {
+    unsigned seed = i % ORIGINALS;
+    for (size_t n = 0; n < length; ++n) {
+        buffer[n] = (char)next_random(&seed);
+    }
+    size_t changed = (i / ORIGINALS) % (length / Disk::BLOCK_SIZE);
+    seed = i;
+    for (size_t n = changed * Disk::BLOCK_SIZE; n < (changed + 1) * Disk::BLOCK_SIZE; ++n) {
+        buffer[n] = (char)next_random(&seed);
+    }
+}
+
+static bool run(const char *path, size_t files, const char *label, int flags) {
+    // format() gives 10% of the blocks to inodes
+    size_t blocks = files * (FILE_BYTES / Disk::BLOCK_SIZE + 1) * 5 / 4 + 1024;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return false;
+    }
+
+    std::vector<char> buffer(FILE_BYTES), check(FILE_BYTES);
+    std::vector<ssize_t> inodes(files);
+    size_t writes = disk.blockWrites();
+    fs.stats().reset();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; ++i) {
+        fill(buffer.data(), FILE_BYTES, (unsigned)i);
+        inodes[i] = fs.create();
+        for (size_t offset = 0; inodes[i] >= 0 && offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.write(inodes[i], buffer.data() + offset, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                inodes[i] = -1;
+            }
+        }
+        if (inodes[i] < 0) {
+            fprintf(stderr, "%s: unable to write file %lu\n", label, i);
+            return false;
+        }
+    }
+    fs.sync();
+    double write_secs = seconds_since(start);
+    writes = disk.blockWrites() - writes;
+    size_t used = fs.stats().blocksAllocated() - fs.stats().blocksFreed();
+    fs.unmount();
+    disk.close(true);
+
+    // read everything back from a cold cache
+    if (!disk.open(path, blocks) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", path);
+        return false;
+    }
+    size_t reads = disk.blockReads();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; ++i) {
+        fill(check.data(), FILE_BYTES, (unsigned)i);
+        for (size_t offset = 0; offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.read(inodes[i], buffer.data() + offset, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                fprintf(stderr, "%s: unable to read file %lu\n", label, i);
+                return false;
+            }
+        }
+        if (memcmp(buffer.data(), check.data(), FILE_BYTES) != 0) {
+            fprintf(stderr, "%s: file %lu reads back wrong\n", label, i);
+            return false;
+        }
+    }
+    double read_secs = seconds_since(start);
+    reads = disk.blockReads() - reads;
+
+    double megabytes = (double)files * FILE_BYTES / (1024 * 1024);
+    printf("%-11s %7lu blocks used  %7lu block writes  %7lu block reads  %7.1f MB/s write  %7.1f MB/s read\n",
+           label, used, writes, reads, megabytes / write_secs, megabytes / read_secs);
+    fflush(stdout);
+    fs.unmount();
+    disk.close(true);
+    unlink(path);
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "dedup_bench.img";
+    size_t files = 256;
+    if (argc > 1) path  = argv[1];
+    if (argc > 2) files = strtoul(argv[2], NULL, 10);
+
+    printf("%lu files of %d KB, versions of %d originals\n", files, FILE_BYTES / 1024, ORIGINALS);
+    if (!run(path, files, "blocks", FileSystem::FORMAT_QUICK) ||
+        !run(path, files, "dedup", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_DEDUP)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
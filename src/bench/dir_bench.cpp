@@ -0,0 +1,103 @@
+/* dir_bench.cpp: name create, lookup and unlink in one huge directory */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static void name_of(size_t i, char *path, size_t size) {
+    snprintf(path, size, "/big/file-%07lu", i);
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "dir_bench.img";
+    size_t names = 100000;
+    size_t cache = Disk::DEFAULT_CACHE_BLOCKS;
+    if (argc > 1) path  = argv[1];
+    if (argc > 2) names = strtoul(argv[2], NULL, 10);
+    if (argc > 3) cache = strtoul(argv[3], NULL, 10);
+
+    // format() gives 10% of the blocks to inodes
+    size_t blocks = (names + 1024) * 10;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks, cache) ||
+        !fs.format(disk, FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS) || !fs.mount(disk) ||
+        fs.mkdir("/big") < 0) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return EXIT_FAILURE;
+    }
+    printf("%lu names in one directory, %lu cache blocks\n", names, cache);
+
+    char name[64];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < names; ++i) {
+        name_of(i, name, sizeof(name));
+        if (fs.mkfile(name) < 0) {
+            fprintf(stderr, "create %s failed\n", name);
+            return EXIT_FAILURE;
+        }
+    }
+    fs.sync();
+    double create_secs = seconds_since(start);
+
+    // remount, every lookup starts with an empty dentry cache
+    fs.unmount();
+    fs.mount(disk);
+    unsigned seed = 1;
+    size_t reads = disk.blockReads();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < names; ++i) {
+        name_of(((size_t)next_random(&seed) << 15 | next_random(&seed)) % names, name, sizeof(name));
+        if (fs.lookup(name) < 0) {
+            fprintf(stderr, "lookup %s failed\n", name);
+            return EXIT_FAILURE;
+        }
+    }
+    double cold_secs = seconds_since(start);
+    double cold_reads = (double)(disk.blockReads() - reads) / names;
+
+    // the same names again, now all in the dentry cache
+    seed = 1;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < names; ++i) {
+        name_of(((size_t)next_random(&seed) << 15 | next_random(&seed)) % names, name, sizeof(name));
+        fs.lookup(name);
+    }
+    double warm_secs = seconds_since(start);
+
+    std::vector<FileSystem::Name> listed;
+    start = std::chrono::steady_clock::now();
+    fs.list("/big", listed);
+    double list_secs = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < names; ++i) {
+        name_of(i, name, sizeof(name));
+        if (!fs.unlink(name)) {
+            fprintf(stderr, "unlink %s failed\n", name);
+            return EXIT_FAILURE;
+        }
+    }
+    fs.sync();
+    double unlink_secs = seconds_since(start);
+
+    printf("create      %10.0f names/s\n", names / create_secs);
+    printf("lookup      %10.0f names/s  %.2f disk block reads each (cold dentry cache)\n",
+           names / cold_secs, cold_reads);
+    printf("lookup      %10.0f names/s  (warm dentry cache)\n", names / warm_secs);
+    printf("list        %10.0f names/s  %lu names\n", listed.size() / list_secs, listed.size());
+    printf("unlink      %10.0f names/s\n", names / unlink_secs);
+    fflush(stdout);
+    fs.unmount();
+    disk.close();
+    unlink(path);
+    return listed.size() == names ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,99 @@
+/* io_bench.cpp: buffered vs O_DIRECT copyin/copyout benchmark */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define FILE_BYTES  (1024 * Disk::BLOCK_SIZE)   /* close to the largest file an inode maps */
+#define CHUNK_BYTES (16 * Disk::BLOCK_SIZE)     /* copyin/copyout transfer size */
+
+/* Write `files` files in CHUNK_BYTES pieces, remount, read them back */
+
+static bool run(const char *path, size_t blocks, size_t files, size_t cache_blocks, int flags,
+                const char *label) {
+    unlink(path);
+    Disk disk;
+    if (!disk.open(path, blocks, cache_blocks, flags)) {
+        return false;
+    }
+    if ((flags & Disk::OPEN_DIRECT) && !disk.direct()) {
+        disk.close();
+        return false;
+    }
+
+    FileSystem fs;
+    if (!fs.format(disk) || !fs.mount(disk)) {
+        fprintf(stderr, "%s: unable to format %s\n", label, path);
+        return false;
+    }
+
+    alignas(Disk::BLOCK_SIZE) static char buffer[CHUNK_BYTES];
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        buffer[i] = (char)(i * 131 + 7);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < files; ++f) {
+        ssize_t inode = fs.create();
+        for (size_t offset = 0; inode >= 0 && offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.write(inode, buffer, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                fprintf(stderr, "%s: write failed\n", label);
+                return false;
+            }
+        }
+    }
+    fs.unmount();
+    double write_secs = seconds_since(start);
+
+    // remount so the reads cannot be served from the in-process cache
+    start = std::chrono::steady_clock::now();
+    fs.mount(disk);
+    for (size_t f = 1; f <= files; ++f) {
+        for (size_t offset = 0; offset < FILE_BYTES; offset += CHUNK_BYTES) {
+            if (fs.read(f, buffer, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+                fprintf(stderr, "%s: read failed\n", label);
+                return false;
+            }
+        }
+    }
+    fs.unmount();
+    double read_secs = seconds_since(start);
+
+    double mb = (double)files * FILE_BYTES / (1024 * 1024);
+    printf("%-9s copyin %8.1f MB/s  copyout %8.1f MB/s\n", label, mb / write_secs, mb / read_secs);
+    fflush(stdout);
+    disk.close();
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "io_bench.img";
+    size_t files     = 16;
+    size_t cache     = Disk::DEFAULT_CACHE_BLOCKS;
+    if (argc > 1) path  = argv[1];
+    if (argc > 2) files = strtoul(argv[2], NULL, 10);
+    if (argc > 3) cache = strtoul(argv[3], NULL, 10);
+
+    // room for the data, its indirect blocks and the inode table/bitmap
+    size_t blocks = files * (FILE_BYTES / Disk::BLOCK_SIZE + 1) + files + 64;
+    printf("%lu files of %lu KB on %lu blocks, %lu KB transfers\n",
+           files, FILE_BYTES / 1024, blocks, CHUNK_BYTES / 1024);
+
+    if (!run(path, blocks, files, cache, 0, "buffered")) {
+        return EXIT_FAILURE;
+    }
+    if (!run(path, blocks, files, cache, Disk::OPEN_DIRECT, "direct")) {
+        fprintf(stderr, "direct run skipped\n");
+    }
+    unlink(path);
+    return EXIT_SUCCESS;
+}
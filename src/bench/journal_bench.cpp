@@ -0,0 +1,105 @@
+/* journal_bench.cpp: durable small-file creates, with and without the metadata journal */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define FILE_BYTES  (2 * Disk::BLOCK_SIZE)      /* data written to every new file */
+
+struct Worker {
+    FileSystem *fs;
+    Disk       *disk;
+    size_t      files;
+    bool        journal;
+    bool        failed;
+};
+
+/* Create, write and make durable one file after the other */
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    char buffer[FILE_BYTES];
+    memset(buffer, 'j', sizeof(buffer));
+    for (size_t i = 0; i < w->files; ++i) {
+        ssize_t inode = w->fs->create();
+        if (inode < 0 || w->fs->write(inode, buffer, sizeof(buffer), 0) != (ssize_t)sizeof(buffer)) {
+            w->failed = true;
+            return NULL;
+        }
+        // without a journal the only way to durability is a sync of the
+        // image after the write back, and nothing orders the two
+        bool ok = w->fs->sync() && (w->journal || w->disk->sync());
+        if (!ok) {
+            w->failed = true;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static bool run(const char *path, size_t files, size_t threads, bool journal) {
+    // format() gives 10% of the blocks to inodes, one inode per file
+    size_t blocks = (files * threads + 1024) * 10;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    int flags = FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS;
+    if (journal) {
+        flags |= FileSystem::FORMAT_JOURNAL;
+    }
+    if (!disk.open(path, blocks) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return false;
+    }
+
+    Worker workers[threads];
+    pthread_t tids[threads];
+    size_t syncs = disk.syncs();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        workers[t] = (Worker){&fs, &disk, files, journal, false};
+        pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+    }
+    bool failed = false;
+    for (size_t t = 0; t < threads; ++t) {
+        pthread_join(tids[t], NULL);
+        failed = failed || workers[t].failed;
+    }
+    double secs = seconds_since(start);
+    size_t ops = files * threads;
+    syncs = disk.syncs() - syncs;
+
+    printf("%-8s %2lu threads %8.0f durable creates/s  %.2f disk syncs each\n", journal ? "journal" : "plain",
+           threads, ops / secs, (double)syncs / ops);
+    fflush(stdout);
+    fs.unmount();
+    disk.close();
+    unlink(path);
+    return !failed;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "journal_bench.img";
+    size_t files   = 500;
+    size_t threads = 8;
+    if (argc > 1) path    = argv[1];
+    if (argc > 2) files   = strtoul(argv[2], NULL, 10);
+    if (argc > 3) threads = strtoul(argv[3], NULL, 10);
+
+    printf("%lu files of %lu KB per thread, sync after each\n", files, FILE_BYTES / 1024);
+    if (!run(path, files, 1, false) || !run(path, files, 1, true) ||
+        !run(path, files, threads, false) || !run(path, files, threads, true)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
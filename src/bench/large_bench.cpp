@@ -0,0 +1,98 @@
+/* large_bench.cpp: single large file throughput, indirect blocks vs extents */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Macros */
+
+#define CHUNK_BYTES     (16 * Disk::BLOCK_SIZE)     /* sequential transfer size */
+#define RANDOM_READS    20000                       /* 4 KB reads at random offsets */
+
+/* Write one file, remount, read it sequentially and at random */
+
+static bool run(const char *path, size_t megabytes, size_t cache, int flags, const char *label) {
+    size_t file_bytes  = megabytes * 1024 * 1024;
+    size_t file_blocks = file_bytes / Disk::BLOCK_SIZE;
+    // data, pointer blocks, and the 10% format() gives the inode table
+    size_t blocks = file_blocks + file_blocks / 1000 + 16;
+    blocks += blocks / 8;
+
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks, cache) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "%s: unable to format %s\n", label, path);
+        return false;
+    }
+
+    alignas(Disk::BLOCK_SIZE) static char buffer[CHUNK_BYTES];
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        buffer[i] = (char)(i * 131 + 7);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ssize_t inode = fs.create();
+    for (size_t offset = 0; inode >= 0 && offset < file_bytes; offset += CHUNK_BYTES) {
+        if (fs.write(inode, buffer, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+            fprintf(stderr, "%s: write failed at %lu\n", label, offset);
+            return false;
+        }
+    }
+    fs.unmount();
+    double write_secs = seconds_since(start);
+
+    // remount so the reads cannot be served from buffered writes
+    start = std::chrono::steady_clock::now();
+    fs.mount(disk);
+    for (size_t offset = 0; offset < file_bytes; offset += CHUNK_BYTES) {
+        if (fs.read(inode, buffer, CHUNK_BYTES, offset) != (ssize_t)CHUNK_BYTES) {
+            fprintf(stderr, "%s: read failed at %lu\n", label, offset);
+            return false;
+        }
+    }
+    double read_secs = seconds_since(start);
+
+    // every random read looks its block up from the top
+    unsigned seed = 1;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < RANDOM_READS; ++i) {
+        size_t block = ((size_t)next_random(&seed) << 15 | next_random(&seed)) % file_blocks;
+        if (fs.read(inode, buffer, Disk::BLOCK_SIZE, block * Disk::BLOCK_SIZE) != (ssize_t)Disk::BLOCK_SIZE) {
+            fprintf(stderr, "%s: random read failed at block %lu\n", label, block);
+            return false;
+        }
+    }
+    double random_secs = seconds_since(start);
+    fs.unmount();
+
+    printf("%-8s write %8.1f MB/s  read %8.1f MB/s  random 4 KB read %8.0f reads/s\n", label,
+           megabytes / write_secs, megabytes / read_secs, RANDOM_READS / random_secs);
+    fflush(stdout);
+    disk.close();
+    unlink(path);
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "large_bench.img";
+    size_t megabytes = 256;
+    size_t cache     = Disk::DEFAULT_CACHE_BLOCKS;
+    if (argc > 1) path      = argv[1];
+    if (argc > 2) megabytes = strtoul(argv[2], NULL, 10);
+    if (argc > 3) cache     = strtoul(argv[3], NULL, 10);
+
+    printf("one %lu MB file, %lu KB transfers, %lu cache blocks\n", megabytes, CHUNK_BYTES / 1024, cache);
+    if (!run(path, megabytes, cache, FileSystem::FORMAT_LARGE, "indirect") ||
+        !run(path, megabytes, cache, FileSystem::FORMAT_EXTENTS, "extents")) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/* scale_bench.cpp: FileSystem read/write throughput versus thread count */
+
+#include "disk.h"
+#include "fs.h"
+
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define CHUNK_BYTES     (4 * Disk::BLOCK_SIZE)  /* bytes per read/write call, like copyin/copyout */
+
+/* Shared state */
+
+struct Phase {
+    FileSystem*             fs;
+    bool                    write;
+    std::vector<size_t>     files;              /* Files to read, or one per thread to write */
+    std::atomic<bool>       stop;
+};
+
+struct Worker {
+    Phase*                  phase;
+    size_t                  id;
+    size_t                  ops;
+    size_t                  bytes;
+};
+
+static void *worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    Phase  *p = w->phase;
+    char buffer[CHUNK_BYTES];
+    memset(buffer, (int)w->id, sizeof(buffer));
+
+    size_t k = w->id;
+    size_t offset = 0;
+    while (!p->stop.load(std::memory_order_relaxed)) {
+        ssize_t result;
+        if (p->write) {
+            // every thread rewrites its own file
+            result = p->fs->write(p->files[w->id], buffer, sizeof(buffer), 0);
+        } else {
+            // readers walk all files, each starting at a different one
+            size_t inode = p->files[k % p->files.size()];
+            result = p->fs->read(inode, buffer, sizeof(buffer), offset);
+            if (result > 0) {
+                offset += result;
+            } else {
+                offset = 0;
+                k++;
+            }
+        }
+        if (result < 0) {
+            fprintf(stderr, "thread %lu: I/O failed\n", w->id);
+            break;
+        }
+        w->ops++;
+        w->bytes += result;
+    }
+    return NULL;
+}
+
+/* Run one phase with nthreads threads for seconds, returns MB/s */
+
+static double run(Phase *phase, size_t nthreads, double seconds, size_t *ops) {
+    std::vector<Worker>    workers(nthreads);
+    std::vector<pthread_t> threads(nthreads);
+    phase->stop = false;
+    for (size_t t = 0; t < nthreads; ++t) {
+        workers[t].phase = phase;
+        workers[t].id    = t;
+        workers[t].ops   = 0;
+        workers[t].bytes = 0;
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    usleep((useconds_t)(seconds * 1e6));
+    phase->stop = true;
+    size_t bytes = 0;
+    *ops = 0;
+    for (size_t t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+        bytes += workers[t].bytes;
+        *ops  += workers[t].ops;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return bytes / elapsed / (1024 * 1024);
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <diskfile> <nblocks> [max_threads] [seconds] [cache_blocks]\n", argv[0]);
+        fprintf(stderr, "    the image is written to, run it on a copy\n");
+        return EXIT_FAILURE;
+    }
+    size_t blocks      = strtoul(argv[2], NULL, 10);
+    size_t max_threads = (argc > 3) ? strtoul(argv[3], NULL, 10) : 8;
+    double seconds     = (argc > 4) ? atof(argv[4]) : 1.0;
+    size_t cache       = (argc > 5) ? strtoul(argv[5], NULL, 10) : Disk::DEFAULT_CACHE_BLOCKS;
+
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(argv[1], blocks, cache) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Phase reads;
+    reads.fs    = &fs;
+    reads.write = false;
+    // format() never creates more inodes than this
+    for (size_t inode = 0; inode < blocks / 10 + 128; ++inode) {
+        if (fs.stat(inode) > 0) {
+            reads.files.push_back(inode);
+        }
+    }
+
+    Phase writes;
+    writes.fs    = &fs;
+    writes.write = true;
+    for (size_t t = 0; t < max_threads; ++t) {
+        ssize_t inode = fs.create();
+        if (inode < 0) {
+            fprintf(stderr, "create failed\n");
+            return EXIT_FAILURE;
+        }
+        writes.files.push_back(inode);
+    }
+
+    printf("%lu files to read, %lu KB per call, %.1f s per run\n",
+           reads.files.size(), CHUNK_BYTES / 1024, seconds);
+    printf("threads      read MB/s   speedup     write MB/s   speedup\n");
+    double read_base = 0, write_base = 0;
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        size_t ops;
+        double read_mb = reads.files.empty() ? 0 : run(&reads, n, seconds, &ops);
+        double write_mb = run(&writes, n, seconds, &ops);
+        if (n == 1) {
+            read_base  = read_mb;
+            write_base = write_mb;
+        }
+        printf("%7lu %14.1f %9.2fx %14.1f %9.2fx\n", n,
+               read_mb, read_base > 0 ? read_mb / read_base : 0,
+               write_mb, write_base > 0 ? write_mb / write_base : 0);
+        fflush(stdout);
+    }
+
+    for (size_t t = 0; t < writes.files.size(); ++t) {
+        fs.remove(writes.files[t]);
+    }
+    fs.unmount();
+    return EXIT_SUCCESS;
+}
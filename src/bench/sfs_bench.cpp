@@ -0,0 +1,526 @@
+/* sfs_bench.cpp: throughput, latency percentiles and I/O amplification of every operation */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define SMALL_BYTES (4 * Disk::BLOCK_SIZE)      /* largest small file, sizes cycle up to it */
+#define LARGE_FILES 4                           /* large files share large_bytes */
+#define COPY_BYTES  (4 * BUFSIZ)                /* copyin/copyout transfer size, as in sfssh */
+#define LEGACY_MAX  ((5 + 1024) * Disk::BLOCK_SIZE) /* largest file an old inode maps */
+
+typedef std::chrono::steady_clock Clock;
+
+/* Settings */
+
+struct Config {
+    size_t      ops;            /* Operations per metadata and 4 KB workload */
+    size_t      large_bytes;    /* Size of the sequential file, and of all large copies together */
+    size_t      cache_blocks;   /* Disk cache */
+    int         disk_flags;     /* Disk::OPEN_* */
+    const char *json;           /* Machine-readable output, nullptr for none */
+};
+
+/* One measured workload on one image */
+
+struct Result {
+    std::string         image;
+    std::string         op;
+    size_t              ops;        /* Operations completed */
+    size_t              bytes;      /* Logical bytes read or written */
+    size_t              reads;      /* Disk blocks read */
+    size_t              writes;     /* Disk blocks written */
+    double              seconds;    /* Wall time, including the closing sync */
+    std::vector<double> latency;    /* Seconds per operation */
+};
+
+static std::vector<Result> results;
+
+/* Run state of the image being measured */
+
+struct Bench {
+    const Config *config;
+    std::string   label;        /* Image name in the report */
+    std::string   path;         /* Image file */
+    size_t        blocks;
+    Disk          disk;
+    FileSystem    fs;
+};
+
+/* Unmount and close, then open and mount again, so reads start cold */
+
+static bool remount(Bench& b) {
+    b.fs.unmount();
+    b.disk.close(true);
+    return b.disk.open(b.path.c_str(), b.blocks, b.config->cache_blocks, b.config->disk_flags) &&
+           b.fs.mount(b.disk);
+}
+
+/* A workload times every operation between begin() and end() */
+
+struct Timer {
+    Bench            *bench;
+    Result            result;
+    Clock::time_point start;
+    Clock::time_point op_start;
+};
+
+static void begin(Timer& t, Bench& b, const char *op) {
+    t.bench = &b;
+    t.result.image = b.label;
+    t.result.op = op;
+    t.result.ops = 0;
+    t.result.bytes = 0;
+    t.result.latency.clear();
+    t.result.reads = b.disk.blockReads();
+    t.result.writes = b.disk.blockWrites();
+    t.start = Clock::now();
+}
+
+static void op_begin(Timer& t) {
+    t.op_start = Clock::now();
+}
+
+static void op_end(Timer& t, size_t bytes) {
+    t.result.latency.push_back(seconds_since(t.op_start));
+    t.result.ops++;
+    t.result.bytes += bytes;
+}
+
+// writes count once they reached the image
+static void end(Timer& t, bool sync) {
+    if (sync) {
+        t.bench->fs.sync();
+    }
+    t.result.seconds = seconds_since(t.start);
+    t.result.reads = t.bench->disk.blockReads() - t.result.reads;
+    t.result.writes = t.bench->disk.blockWrites() - t.result.writes;
+    if (t.result.ops > 0) {
+        results.push_back(t.result);
+    }
+}
+
+/* Workloads */
+
+static void fill(char *buffer, size_t length, size_t seed) {
+    for (size_t i = 0; i < length; ++i) {
+        buffer[i] = (char)(i * 131 + seed);
+    }
+}
+
+static void run_metadata(Bench& b, std::vector<ssize_t>& inodes) {
+    Timer t;
+    begin(t, b, "create");
+    for (size_t i = 0; i < b.config->ops; ++i) {
+        op_begin(t);
+        ssize_t inode = b.fs.create();
+        if (inode < 0) {
+            break;
+        }
+        op_end(t, 0);
+        inodes.push_back(inode);
+    }
+    end(t, true);
+
+    begin(t, b, "stat");
+    for (size_t i = 0; i < inodes.size(); ++i) {
+        op_begin(t);
+        b.fs.stat(inodes[i]);
+        op_end(t, 0);
+    }
+    end(t, false);
+
+    begin(t, b, "remove");
+    for (size_t i = 0; i < inodes.size(); ++i) {
+        op_begin(t);
+        if (!b.fs.remove(inodes[i])) {
+            break;
+        }
+        op_end(t, 0);
+    }
+    end(t, true);
+    inodes.clear();
+}
+
+// 4 KB at a time through one file of large_bytes, then at random offsets
+static void run_blocks(Bench& b) {
+    alignas(Disk::BLOCK_SIZE) static char buffer[Disk::BLOCK_SIZE];
+    fill(buffer, sizeof(buffer), 7);
+    ssize_t inode = b.fs.create();
+    if (inode < 0) {
+        return;
+    }
+
+    Timer t;
+    begin(t, b, "seq_write");
+    for (size_t offset = 0; offset < b.config->large_bytes; offset += sizeof(buffer)) {
+        op_begin(t);
+        if (b.fs.write(inode, buffer, sizeof(buffer), offset) != (ssize_t)sizeof(buffer)) {
+            break;
+        }
+        op_end(t, sizeof(buffer));
+    }
+    end(t, true);
+    size_t file_blocks = t.result.ops;
+    if (file_blocks == 0 || !remount(b)) {
+        return;
+    }
+
+    begin(t, b, "seq_read");
+    for (size_t block = 0; block < file_blocks; ++block) {
+        op_begin(t);
+        if (b.fs.read(inode, buffer, sizeof(buffer), block * sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+            break;
+        }
+        op_end(t, sizeof(buffer));
+    }
+    end(t, false);
+    if (!remount(b)) {
+        return;
+    }
+
+    unsigned seed = 1;
+    begin(t, b, "rand_read");
+    for (size_t i = 0; i < b.config->ops; ++i) {
+        size_t block = ((size_t)next_random(&seed) << 15 | next_random(&seed)) % file_blocks;
+        op_begin(t);
+        if (b.fs.read(inode, buffer, sizeof(buffer), block * sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+            break;
+        }
+        op_end(t, sizeof(buffer));
+    }
+    end(t, false);
+
+    begin(t, b, "rand_write");
+    for (size_t i = 0; i < b.config->ops; ++i) {
+        size_t block = ((size_t)next_random(&seed) << 15 | next_random(&seed)) % file_blocks;
+        op_begin(t);
+        if (b.fs.write(inode, buffer, sizeof(buffer), block * sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+            break;
+        }
+        op_end(t, sizeof(buffer));
+    }
+    end(t, true);
+    b.fs.remove(inode);
+    b.fs.sync();
+}
+
+// whole files in COPY_BYTES pieces, the way sfssh copies them
+static bool copy_in(FileSystem& fs, ssize_t inode, char *buffer, size_t size) {
+    for (size_t offset = 0; offset < size; offset += COPY_BYTES) {
+        size_t length = std::min((size_t)COPY_BYTES, size - offset);
+        if (fs.write(inode, buffer, length, offset) != (ssize_t)length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool copy_out(FileSystem& fs, ssize_t inode, char *buffer, size_t size) {
+    for (size_t offset = 0; offset < size; offset += COPY_BYTES) {
+        size_t length = std::min((size_t)COPY_BYTES, size - offset);
+        if (fs.read(inode, buffer, length, offset) != (ssize_t)length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void run_copies(Bench& b, const char *in_op, const char *out_op, size_t files, size_t size_max,
+                       bool vary) {
+    alignas(Disk::BLOCK_SIZE) static char buffer[COPY_BYTES];
+    fill(buffer, sizeof(buffer), 3);
+    std::vector<ssize_t> inodes;
+    std::vector<size_t>  sizes;
+
+    Timer t;
+    begin(t, b, in_op);
+    for (size_t i = 0; i < files; ++i) {
+        // varied sizes cycle up to size_max in four steps, most not block aligned
+        size_t size = vary ? size_max / 4 * (i % 4 + 1) - i % 3 : size_max;
+        op_begin(t);
+        ssize_t inode = b.fs.create();
+        if (inode < 0) {
+            break;
+        }
+        inodes.push_back(inode);
+        if (!copy_in(b.fs, inode, buffer, size)) {
+            break;
+        }
+        sizes.push_back(size);
+        op_end(t, size);
+    }
+    end(t, true);
+    if (!remount(b)) {
+        return;
+    }
+
+    begin(t, b, out_op);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        op_begin(t);
+        if (!copy_out(b.fs, inodes[i], buffer, sizes[i])) {
+            break;
+        }
+        op_end(t, sizes[i]);
+    }
+    end(t, false);
+    for (size_t i = 0; i < inodes.size(); ++i) {
+        b.fs.remove(inodes[i]);
+    }
+    b.fs.sync();
+}
+
+// what an existing image already holds: stat every inode, read every file
+static void run_existing(Bench& b, size_t inodes) {
+    alignas(Disk::BLOCK_SIZE) static char buffer[COPY_BYTES];
+    std::vector<std::pair<size_t, size_t> > files;
+    Timer t;
+    begin(t, b, "stat");
+    for (size_t i = 0; i < inodes; ++i) {
+        op_begin(t);
+        ssize_t size = b.fs.stat(i);
+        op_end(t, 0);
+        if (size > 0) {
+            files.push_back(std::make_pair(i, (size_t)size));
+        }
+    }
+    end(t, false);
+
+    begin(t, b, "copyout");
+    for (size_t i = 0; i < files.size(); ++i) {
+        op_begin(t);
+        if (!copy_out(b.fs, files[i].first, buffer, files[i].second)) {
+            break;
+        }
+        op_end(t, files[i].second);
+    }
+    end(t, false);
+}
+
+/* Images */
+
+static bool run_synthetic(const Config& config, const char *label, int format_flags) {
+    Bench b;
+    b.config = &config;
+    b.label = std::string("synthetic:") + label;
+    b.path = "sfs_bench.img";
+    // format() gives 10% of the blocks to inodes
+    size_t large_blocks = config.large_bytes / Disk::BLOCK_SIZE;
+    b.blocks = (config.ops + 1024) * 10 + large_blocks * 2 + config.ops * SMALL_BYTES / Disk::BLOCK_SIZE;
+    unlink(b.path.c_str());
+    if (!b.disk.open(b.path.c_str(), b.blocks, config.cache_blocks, config.disk_flags) ||
+        !b.fs.format(b.disk, format_flags) || !b.fs.mount(b.disk)) {
+        fprintf(stderr, "%s: unable to format %s\n", label, b.path.c_str());
+        return false;
+    }
+
+    Config capped = config;
+    if (!(format_flags & (FileSystem::FORMAT_LARGE | FileSystem::FORMAT_EXTENTS))) {
+        capped.large_bytes = std::min(capped.large_bytes, (size_t)LEGACY_MAX);
+    }
+    b.config = &capped;
+
+    std::vector<ssize_t> inodes;
+    run_metadata(b, inodes);
+    run_blocks(b);
+    run_copies(b, "small_copyin", "small_copyout", capped.ops, SMALL_BYTES, true);
+    run_copies(b, "large_copyin", "large_copyout", LARGE_FILES, capped.large_bytes / LARGE_FILES, false);
+    b.fs.unmount();
+    b.disk.close(true);
+    unlink(b.path.c_str());
+    return true;
+}
+
+// work on a copy, the images under data/ are what the tests compare against
+static bool run_image(const Config& config, const char *image) {
+    Bench b;
+    b.config = &config;
+    b.label = image;
+    b.path = "sfs_bench.copy";
+    FILE *in  = fopen(image, "rb");
+    FILE *out = fopen(b.path.c_str(), "wb");
+    if (!in || !out) {
+        fprintf(stderr, "unable to copy %s\n", image);
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return false;
+    }
+    char buffer[BUFSIZ];
+    size_t bytes = 0;
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), in)) > 0; bytes += n) {
+        fwrite(buffer, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+
+    b.blocks = bytes / Disk::BLOCK_SIZE;
+    if (!b.disk.open(b.path.c_str(), b.blocks, config.cache_blocks, config.disk_flags) || !b.fs.mount(b.disk)) {
+        fprintf(stderr, "unable to mount %s\n", image);
+        unlink(b.path.c_str());
+        return false;
+    }
+
+    // a tenth of the image at most is inode table, stat() fails past its end
+    run_existing(b, (b.blocks + 9) / 10 * Disk::BLOCK_SIZE / 32);
+    // these stop at the first operation the image has no room for
+    Config capped = config;
+    capped.large_bytes = std::min(capped.large_bytes, b.blocks * Disk::BLOCK_SIZE / 2);
+    b.config = &capped;
+    std::vector<ssize_t> inodes;
+    run_metadata(b, inodes);
+    run_blocks(b);
+    run_copies(b, "small_copyin", "small_copyout", capped.ops, SMALL_BYTES, true);
+    b.fs.unmount();
+    b.disk.close(true);
+    unlink(b.path.c_str());
+    return true;
+}
+
+/* Report */
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// disk bytes per logical byte, or disk blocks per operation without payload
+static double amplification(size_t blocks, const Result& r) {
+    if (r.bytes == 0) {
+        return (double)blocks / r.ops;
+    }
+    return (double)blocks * Disk::BLOCK_SIZE / r.bytes;
+}
+
+static void report(const Config& config) {
+    printf("%-22s %-14s %8s %11s %9s %9s %9s %9s %8s %8s\n", "image", "op", "ops", "ops/s",
+           "p50 us", "p90 us", "p99 us", "max us", "read amp", "write amp");
+    for (size_t i = 0; i < results.size(); ++i) {
+        Result& r = results[i];
+        std::sort(r.latency.begin(), r.latency.end());
+        printf("%-22s %-14s %8lu %11.0f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n", r.image.c_str(), r.op.c_str(),
+               r.ops, r.ops / r.seconds, percentile(r.latency, 0.5) * 1e6, percentile(r.latency, 0.9) * 1e6,
+               percentile(r.latency, 0.99) * 1e6, r.latency.back() * 1e6, amplification(r.reads, r),
+               amplification(r.writes, r));
+    }
+    printf("amplification is disk bytes per byte moved, or disk blocks per operation that moves none\n");
+
+    if (!config.json) {
+        return;
+    }
+    FILE *json = fopen(config.json, "w");
+    if (!json) {
+        fprintf(stderr, "unable to open %s\n", config.json);
+        return;
+    }
+    fprintf(json, "{\n  \"config\": {\"ops\": %lu, \"large_bytes\": %lu, \"cache_blocks\": %lu, \"disk_flags\": %d},\n",
+            config.ops, config.large_bytes, config.cache_blocks, config.disk_flags);
+    fprintf(json, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        fprintf(json, "    {\"image\": \"%s\", \"op\": \"%s\", \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                "\"bytes\": %lu, \"block_reads\": %lu, \"block_writes\": %lu, "
+                "\"read_amplification\": %.4f, \"write_amplification\": %.4f, "
+                "\"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}%s\n",
+                r.image.c_str(), r.op.c_str(), r.ops, r.seconds, r.ops / r.seconds, r.bytes, r.reads, r.writes,
+                amplification(r.reads, r), amplification(r.writes, r),
+                percentile(r.latency, 0.5) * 1e6, percentile(r.latency, 0.9) * 1e6,
+                percentile(r.latency, 0.99) * 1e6, percentile(r.latency, 0.999) * 1e6, r.latency.back() * 1e6,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+    fclose(json);
+}
+
+/* Main Execution */
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m|-u|-d] [-n ops] [-s large_mb] [-c cache_blocks] [-o json] [image ...]\n", program);
+    fprintf(stderr, "    -m    map the disk images instead of using read/write\n");
+    fprintf(stderr, "    -u    submit multi-block I/O through io_uring\n");
+    fprintf(stderr, "    -d    open the disk images with O_DIRECT\n");
+    fprintf(stderr, "    -n    operations per metadata and 4 KB workload (default 2000)\n");
+    fprintf(stderr, "    -s    size of the sequential file and of the large copies in MB (default 16)\n");
+    fprintf(stderr, "    -o    also write the results as JSON to this file\n");
+    fprintf(stderr, "Without images, data/image.* are measured after the synthetic images.\n");
+}
+
+int main(int argc, char *argv[]) {
+    Config config = {2000, 16 * 1024 * 1024, Disk::DEFAULT_CACHE_BLOCKS, 0, nullptr};
+    int opt;
+    while ((opt = getopt(argc, argv, "mudn:s:c:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            config.disk_flags |= Disk::OPEN_MMAP;
+            break;
+        case 'u':
+            config.disk_flags |= Disk::OPEN_URING;
+            break;
+        case 'd':
+            config.disk_flags |= Disk::OPEN_DIRECT;
+            break;
+        case 'n':
+            config.ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.large_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'c':
+            config.cache_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            config.json = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.ops == 0 || config.large_bytes < Disk::BLOCK_SIZE) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> images;
+    for (int i = optind; i < argc; ++i) {
+        images.push_back(argv[i]);
+    }
+    if (images.empty()) {
+        if (!run_synthetic(config, "legacy", FileSystem::FORMAT_QUICK) ||
+            !run_synthetic(config, "large", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_LARGE) ||
+            !run_synthetic(config, "extents", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS) ||
+            !run_synthetic(config, "journal", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS |
+                                              FileSystem::FORMAT_JOURNAL) ||
+            !run_synthetic(config, "packed", FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS |
+                                             FileSystem::FORMAT_PACKED)) {
+            return EXIT_FAILURE;
+        }
+        glob_t found;
+        if (glob("data/image.*", 0, NULL, &found) == 0) {
+            for (size_t i = 0; i < found.gl_pathc; ++i) {
+                images.push_back(found.gl_pathv[i]);
+            }
+            globfree(&found);
+        }
+    }
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (!run_image(config, images[i].c_str())) {
+            return EXIT_FAILURE;
+        }
+    }
+    report(config);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,309 @@
+/* sfs_replay.cpp: run a recorded trace (sfssh -t, FileSystem::setTrace) against a fresh image */
+
+#include "disk.h"
+#include "fs.h"
+#include "trace.h"
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+/* Replay state */
+
+struct Replay {
+    Disk                        disk;
+    FileSystem                  fs;
+    std::map<uint64_t, size_t>  inodes;     /* Recorded inode number -> inode in this image */
+    std::map<size_t, std::vector<FileSystem::Handle*> > handles;   /* Open handles per inode */
+    std::vector<char>           buffer;     /* Source and target of reads and writes */
+    size_t                      divergent;  /* Calls whose result differs from the recording */
+};
+
+// inodes the trace did not create itself are taken as they are
+static size_t inode_of(Replay& r, uint64_t recorded) {
+    std::map<uint64_t, size_t>::iterator it = r.inodes.find(recorded);
+    return it == r.inodes.end() ? (size_t)recorded : it->second;
+}
+
+static void remember(Replay& r, const Trace::Record& record, ssize_t inode) {
+    if (record.result >= 0 && inode >= 0) {
+        r.inodes[(uint64_t)record.result] = (size_t)inode;
+    }
+}
+
+static char *buffer_of(Replay& r, size_t length) {
+    if (r.buffer.size() < length) {
+        r.buffer.resize(length, 'r');
+    }
+    return r.buffer.data();
+}
+
+/* Issue one recorded call, returns its result */
+
+static ssize_t issue(Replay& r, const Trace::Record& record) {
+    size_t inode = inode_of(r, record.inode);
+    ssize_t result = 0;
+    switch (record.op) {
+    case Trace::OP_FORMAT:
+        result = r.fs.format(r.disk, (int)record.inode) ? 0 : -1;
+        break;
+    case Trace::OP_MOUNT:
+        result = r.fs.mount(r.disk) ? 0 : -1;
+        break;
+    case Trace::OP_UNMOUNT:
+        r.fs.unmount();
+        r.handles.clear();
+        break;
+    case Trace::OP_SYNC:
+        result = r.fs.sync() ? 0 : -1;
+        break;
+    case Trace::OP_CREATE:
+        result = r.fs.create();
+        remember(r, record, result);
+        break;
+    case Trace::OP_REMOVE:
+        result = r.fs.remove(inode) ? 0 : -1;
+        break;
+    case Trace::OP_STAT:
+        result = r.fs.stat(inode);
+        break;
+    case Trace::OP_READ:
+        result = r.fs.read(inode, buffer_of(r, record.length), record.length, record.offset);
+        break;
+    case Trace::OP_WRITE:
+        result = r.fs.write(inode, buffer_of(r, record.length), record.length, record.offset);
+        break;
+    case Trace::OP_VIEW: {
+        // recorded on a mapped image but replayed on one that is not,
+        // the bytes have to be copied instead
+        std::vector<FileSystem::Span> spans;
+        result = r.fs.view(inode, record.length, record.offset, spans);
+        if (result < 0 && record.result >= 0 && !r.disk.mapped()) {
+            result = r.fs.read(inode, buffer_of(r, record.length), record.length, record.offset);
+        }
+        break;
+    }
+    case Trace::OP_OPEN: {
+        FileSystem::Handle *handle = r.fs.open(inode);
+        if (handle) {
+            r.handles[inode].push_back(handle);
+        }
+        result = handle ? 0 : -1;
+        break;
+    }
+    case Trace::OP_CLOSE:
+        if (!r.handles[inode].empty()) {
+            r.fs.close(r.handles[inode].back());
+            r.handles[inode].pop_back();
+        }
+        break;
+    case Trace::OP_LOOKUP:
+        result = r.fs.lookup(record.path.c_str());
+        remember(r, record, result);
+        break;
+    case Trace::OP_MKFILE:
+        result = r.fs.mkfile(record.path.c_str());
+        remember(r, record, result);
+        break;
+    case Trace::OP_MKDIR:
+        result = r.fs.mkdir(record.path.c_str());
+        remember(r, record, result);
+        break;
+    case Trace::OP_UNLINK:
+        result = r.fs.unlink(record.path.c_str()) ? 0 : -1;
+        break;
+    case Trace::OP_LIST: {
+        std::vector<FileSystem::Name> names;
+        result = r.fs.list(record.path.c_str(), names) ? (ssize_t)names.size() : -1;
+        break;
+    }
+    case Trace::OP_CLONE:
+        result = record.path.empty() ? r.fs.clone(inode) : r.fs.clone(inode, record.path.c_str());
+        remember(r, record, result);
+        break;
+    }
+    return result;
+}
+
+// inode numbers may differ from the recording, only their success counts
+static bool same_result(const Trace::Record& record, ssize_t result) {
+    switch (record.op) {
+    case Trace::OP_CREATE:
+    case Trace::OP_LOOKUP:
+    case Trace::OP_MKFILE:
+    case Trace::OP_MKDIR:
+    case Trace::OP_CLONE:
+        return (record.result >= 0) == (result >= 0);
+    default:
+        return record.result == result;
+    }
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+/* Main Execution */
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m|-u|-d] [-p] [-b nblocks] [-c cache_blocks] [-o json] <trace> <diskfile>\n", program);
+    fprintf(stderr, "    -m    map the disk image instead of using read/write\n");
+    fprintf(stderr, "    -u    submit multi-block I/O through io_uring\n");
+    fprintf(stderr, "    -d    open the disk image with O_DIRECT\n");
+    fprintf(stderr, "    -p    keep the recorded pacing instead of replaying as fast as possible\n");
+    fprintf(stderr, "    -b    image size, taken from the trace's first format or mount by default\n");
+    fprintf(stderr, "    -o    also write the results as JSON to this file\n");
+    fprintf(stderr, "diskfile is created anew and formatted like the recorded image unless the\n");
+    fprintf(stderr, "trace starts with a format.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int flags = 0;
+    bool paced = false;
+    size_t blocks = 0;
+    size_t cache_blocks = Disk::DEFAULT_CACHE_BLOCKS;
+    const char *json = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "mudpb:c:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            flags |= Disk::OPEN_MMAP;
+            break;
+        case 'u':
+            flags |= Disk::OPEN_URING;
+            break;
+        case 'd':
+            flags |= Disk::OPEN_DIRECT;
+            break;
+        case 'p':
+            paced = true;
+            break;
+        case 'b':
+            blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            json = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *trace_path = argv[optind];
+    const char *image = argv[optind + 1];
+
+    // the whole trace is read up front, so reading it is not measured
+    std::vector<Trace::Record> records;
+    TraceReader reader;
+    if (!reader.open(trace_path)) {
+        return EXIT_FAILURE;
+    }
+    Trace::Record record;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    reader.close();
+
+    // the first format or mount tells the geometry and, for a mount,
+    // how the image had been formatted
+    bool format_first = false;
+    int format_flags = 0;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (records[i].op == Trace::OP_FORMAT || records[i].op == Trace::OP_MOUNT) {
+            format_first = records[i].op == Trace::OP_FORMAT;
+            format_flags = (int)records[i].inode;
+            if (blocks == 0) {
+                blocks = records[i].length;
+            }
+            break;
+        }
+    }
+    if (blocks == 0) {
+        fprintf(stderr, "%s never formats or mounts, give the image size with -b\n", trace_path);
+        return EXIT_FAILURE;
+    }
+
+    Replay r;
+    r.divergent = 0;
+    unlink(image);
+    if (!r.disk.open(image, blocks, cache_blocks, flags)) {
+        return EXIT_FAILURE;
+    }
+    if (!format_first && !r.fs.format(r.disk, format_flags | FileSystem::FORMAT_QUICK)) {
+        fprintf(stderr, "unable to format %s\n", image);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<double> latency[Trace::OP_COUNT];
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < records.size(); ++i) {
+        const Trace::Record& rec = records[i];
+        if (paced) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(rec.time_ns));
+        }
+        Clock::time_point op_start = Clock::now();
+        ssize_t result = issue(r, rec);
+        latency[rec.op].push_back(seconds_since(op_start));
+        if (!same_result(rec, result)) {
+            r.divergent++;
+        }
+    }
+    double secs = seconds_since(start);
+
+    printf("%lu calls in %.3f s, %.0f calls/s, %lu results differ from the recording\n", records.size(), secs,
+           records.size() / secs, r.divergent);
+    printf("%-8s %9s %11s %9s %9s %9s %9s\n", "op", "calls", "calls/s", "p50 us", "p90 us", "p99 us", "max us");
+    FILE *out = json ? fopen(json, "w") : nullptr;
+    if (json && !out) {
+        fprintf(stderr, "unable to open %s\n", json);
+    }
+    if (out) {
+        fprintf(out, "{\"calls\": %lu, \"seconds\": %.6f, \"calls_per_sec\": %.1f, \"divergent\": %lu, \"ops\": {",
+                records.size(), secs, records.size() / secs, r.divergent);
+    }
+    bool first = true;
+    for (int op = 1; op < Trace::OP_COUNT; ++op) {
+        std::vector<double>& l = latency[op];
+        if (l.empty()) {
+            continue;
+        }
+        double total = 0;
+        for (size_t i = 0; i < l.size(); ++i) {
+            total += l[i];
+        }
+        std::sort(l.begin(), l.end());
+        printf("%-8s %9lu %11.0f %9.1f %9.1f %9.1f %9.1f\n", Trace::name(op), l.size(), l.size() / total,
+               percentile(l, 0.5) * 1e6, percentile(l, 0.9) * 1e6, percentile(l, 0.99) * 1e6, l.back() * 1e6);
+        if (out) {
+            fprintf(out, "%s\"%s\": {\"calls\": %lu, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+                    "\"max_us\": %.2f}", first ? "" : ", ", Trace::name(op), l.size(), percentile(l, 0.5) * 1e6,
+                    percentile(l, 0.9) * 1e6, percentile(l, 0.99) * 1e6, l.back() * 1e6);
+        }
+        first = false;
+    }
+    if (out) {
+        fprintf(out, "}}\n");
+        fclose(out);
+    }
+    fflush(stdout);
+
+    r.fs.unmount();
+    r.disk.close();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/* sfs_stress.cpp: multi-threaded FileSystem consistency check */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* Macros */
+
+#define MAX_FILE_BYTES  (6 * Disk::BLOCK_SIZE)  /* reaches into the indirect block */
+
+/* Shared state */
+
+struct Shared {
+    FileSystem*             fs;
+    size_t                  iterations;
+    std::vector<size_t>     inodes;             /* Files present before the run */
+    std::vector<std::string> contents;          /* ... and what they hold */
+};
+
+struct Worker {
+    Shared*                 shared;
+    unsigned                seed;
+    ssize_t                 inode;              /* File owned by this thread */
+    std::string             model;              /* Expected content of inode */
+    size_t                  errors;
+};
+
+static bool read_file(FileSystem *fs, size_t inode, std::string& out) {
+    ssize_t size = fs->stat(inode);
+    if (size < 0) {
+        return false;
+    }
+    out.assign(size, '\0');
+    size_t offset = 0;
+    while (offset < (size_t)size) {
+        size_t chunk = (size_t)size - offset;
+        if (chunk > 3 * Disk::BLOCK_SIZE + 100) chunk = 3 * Disk::BLOCK_SIZE + 100;
+        ssize_t got = fs->read(inode, &out[offset], chunk, offset);
+        if (got <= 0) {
+            return false;
+        }
+        offset += got;
+    }
+    return true;
+}
+
+static bool check_file(FileSystem *fs, size_t inode, const std::string& expect, const char *what) {
+    std::string got;
+    if (!read_file(fs, inode, got) || got != expect) {
+        fprintf(stderr, "%s inode %lu: content mismatch (%lu bytes expected)\n", what, inode, expect.size());
+        return false;
+    }
+    return true;
+}
+
+/* Worker Thread */
+
+static void *worker(void *arg) {
+    Worker *w  = (Worker *)arg;
+    Shared *sh = w->shared;
+    FileSystem *fs = sh->fs;
+    char buffer[MAX_FILE_BYTES];
+
+    for (size_t i = 0; i < sh->iterations; ++i) {
+        unsigned op = next_random(&w->seed) % 16;
+        if (op < 8) {
+            // write a random range of the own file
+            size_t offset = next_random(&w->seed) % MAX_FILE_BYTES;
+            size_t length = 1 + next_random(&w->seed) % (MAX_FILE_BYTES - offset);
+            for (size_t j = 0; j < length; ++j) {
+                buffer[j] = (char)next_random(&w->seed);
+            }
+            ssize_t wrote = fs->write(w->inode, buffer, length, offset);
+            if (wrote < 0) {
+                // out of space, nothing was written
+                continue;
+            }
+            if (w->model.size() < offset + wrote) {
+                w->model.resize(offset + wrote, '\0');
+            }
+            memcpy(&w->model[offset], buffer, wrote);
+        } else if (op < 12) {
+            if (!check_file(fs, w->inode, w->model, "own")) {
+                w->errors++;
+            }
+        } else if (op < 15) {
+            // everybody reads the files that were there before
+            if (!sh->inodes.empty()) {
+                size_t k = next_random(&w->seed) % sh->inodes.size();
+                if (!check_file(fs, sh->inodes[k], sh->contents[k], "shared")) {
+                    w->errors++;
+                }
+            }
+        } else {
+            // give the inode back and take a new one
+            if (!fs->remove(w->inode)) {
+                fprintf(stderr, "remove of inode %ld failed\n", w->inode);
+                w->errors++;
+            }
+            w->inode = fs->create();
+            w->model.clear();
+            if (w->inode < 0) {
+                fprintf(stderr, "create failed\n");
+                w->errors++;
+                return NULL;
+            }
+        }
+        if (w->seed % 97 == 0) {
+            fs->sync();
+        }
+    }
+    return NULL;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <diskfile> <nblocks> [threads] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t blocks     = strtoul(argv[2], NULL, 10);
+    size_t nthreads   = (argc > 3) ? strtoul(argv[3], NULL, 10) : 4;
+    size_t iterations = (argc > 4) ? strtoul(argv[4], NULL, 10) : 2000;
+
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(argv[1], blocks) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Shared shared;
+    shared.fs = &fs;
+    shared.iterations = iterations;
+    // format() never creates more inodes than this
+    for (size_t inode = 0; inode < blocks / 10 + 128; ++inode) {
+        std::string content;
+        if (fs.stat(inode) > 0 && read_file(&fs, inode, content)) {
+            shared.inodes.push_back(inode);
+            shared.contents.push_back(content);
+        }
+    }
+
+    std::vector<Worker>    workers(nthreads);
+    std::vector<pthread_t> threads(nthreads);
+    for (size_t t = 0; t < nthreads; ++t) {
+        workers[t].shared = &shared;
+        workers[t].seed   = 1 + t;
+        workers[t].inode  = fs.create();
+        workers[t].errors = 0;
+        if (workers[t].inode < 0) {
+            fprintf(stderr, "create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t t = 0; t < nthreads; ++t) {
+        pthread_create(&threads[t], NULL, worker, &workers[t]);
+    }
+    size_t errors = 0;
+    for (size_t t = 0; t < nthreads; ++t) {
+        pthread_join(threads[t], NULL);
+        errors += workers[t].errors;
+    }
+
+    // everything has to survive a remount
+    fs.unmount();
+    if (!fs.mount(disk)) {
+        fprintf(stderr, "remount failed\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t t = 0; t < nthreads; ++t) {
+        if (workers[t].inode >= 0 && !check_file(&fs, workers[t].inode, workers[t].model, "remounted")) {
+            errors++;
+        }
+    }
+    for (size_t k = 0; k < shared.inodes.size(); ++k) {
+        if (!check_file(&fs, shared.inodes[k], shared.contents[k], "remounted shared")) {
+            errors++;
+        }
+    }
+    fs.unmount();
+
+    printf("%lu threads, %lu iterations each: %lu errors\n", nthreads, iterations, errors);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+/* small_bench.cpp: space and block reads of many small files, with and without packing */
+
+#include "disk.h"
+#include "fs.h"
+#include "bench.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+/* Macros */
+
+#define MAX_FILE_BYTES  4000                    /* largest file, about the size of the poems in data/image.5 */
+
+// a few hundred bytes to a few KB, one file in eight below 48 bytes
+static size_t file_size(size_t i) {
+    unsigned x = (unsigned)i * 2654435761u;
+    if (i % 8 == 0) {
+        return 1 + x % 48;
+    }
+    return 100 + x % (MAX_FILE_BYTES - 100);
+}
+
+static void fill(char *buffer, size_t length, size_t i) {
+    for (size_t j = 0; j < length; ++j) {
+        buffer[j] = (char)('a' + (i + j) % 26);
+    }
+}
+
+static bool run(const char *path, size_t files, const char *label, int flags) {
+    // format() gives 10% of the blocks to inodes, one inode per file
+    size_t blocks = (files + 1024) * 10;
+    unlink(path);
+    Disk disk;
+    FileSystem fs;
+    if (!disk.open(path, blocks) || !fs.format(disk, flags) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to format %s\n", path);
+        return false;
+    }
+
+    char buffer[MAX_FILE_BYTES], check[MAX_FILE_BYTES];
+    std::vector<ssize_t> inodes(files);
+    size_t bytes = 0;
+    for (size_t i = 0; i < files; ++i) {
+        size_t length = file_size(i);
+        fill(buffer, length, i);
+        inodes[i] = fs.create();
+        if (inodes[i] < 0 || fs.write(inodes[i], buffer, length, 0) != (ssize_t)length) {
+            fprintf(stderr, "%s: unable to write file %lu\n", label, i);
+            return false;
+        }
+        bytes += length;
+    }
+    fs.unmount();
+    size_t used = fs.stats().blocksAllocated() - fs.stats().blocksFreed();
+    disk.close(true);
+
+    // read everything back from a cold cache
+    if (!disk.open(path, blocks) || !fs.mount(disk)) {
+        fprintf(stderr, "unable to mount %s\n", path);
+        return false;
+    }
+    size_t reads = disk.blockReads();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < files; ++i) {
+        size_t length = file_size(i);
+        fill(check, length, i);
+        if (fs.read(inodes[i], buffer, sizeof(buffer), 0) != (ssize_t)length || memcmp(buffer, check, length) != 0) {
+            fprintf(stderr, "%s: file %lu reads back wrong\n", label, i);
+            return false;
+        }
+    }
+    double secs = seconds_since(start);
+    reads = disk.blockReads() - reads;
+
+    printf("%-8s %7.2f blocks per file  %6.1f%% space overhead  %5.2f block reads per file  %8.0f files read/s\n",
+           label, (double)used / files, 100.0 * ((double)used * Disk::BLOCK_SIZE - bytes) / bytes,
+           (double)reads / files, files / secs);
+    fflush(stdout);
+    fs.unmount();
+    disk.close(true);
+    unlink(path);
+    return true;
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = "small_bench.img";
+    size_t files = 5000;
+    if (argc > 1) path  = argv[1];
+    if (argc > 2) files = strtoul(argv[2], NULL, 10);
+
+    printf("%lu files of 1 to %d bytes\n", files, MAX_FILE_BYTES);
+    int flags = FileSystem::FORMAT_QUICK | FileSystem::FORMAT_EXTENTS;
+    if (!run(path, files, "extents", flags) || !run(path, files, "packed", flags | FileSystem::FORMAT_PACKED)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/**
+ * Bitmap packed into 64-bit words, bit n set means block n is used.
+ * A second level keeps one bit per word that is completely used, so a
+ * search skips 64 full words (4096 blocks) per summary word, and a
+ * rotating next-fit cursor keeps appends from rescanning the used prefix.
+ * The word array is laid out exactly as the on-disk bitmap region and is
+ * split into chunks of chunk_bits bits whose modifications are tracked.
+ **/
+class Bitmap {
+public:
+    Bitmap();
+    ~Bitmap();
+
+    bool init(size_t nbits, size_t chunk_bits);
+    void release();
+    size_t size() { return nbits_; }
+    size_t used() { return used_; }
+
+    bool test(size_t bit) { return (words_[bit / 64] >> (bit % 64)) & 1; }
+    void set(size_t bit);
+    void clear(size_t bit);
+    ssize_t alloc();                        /* Claim a free bit at or after the cursor, -1 when full */
+    ssize_t allocRun(size_t count, ssize_t hint, size_t* got);  /* Claim up to count contiguous bits */
+    void   setRange(size_t bit, size_t count);
+    void   clearRange(size_t bit, size_t count);
+    ssize_t findFree(size_t from);          /* First free bit at or after from, -1 if none */
+    void   reset();                         /* Mark everything free */
+    void   seal();                          /* Recompute summary and counters after words were loaded */
+
+    size_t  chunks() { return nchunks_; }
+    char*   chunk(size_t idx) { return (char*)words_ + idx * (chunk_bits_ / 8); }
+    bool    chunkDirty(size_t idx) { return dirty_[idx]; }
+    void    chunkClean(size_t idx) { dirty_[idx] = false; }
+
+private:
+    void updateSummary(size_t word);
+    ssize_t scan(size_t first_word, size_t last_word);
+    size_t runLength(size_t bit, size_t max);
+
+    uint64_t*   words_;                     /* Bits, padded to whole chunks */
+    uint64_t*   full_;                      /* Bit w set when words_[w] has no free bit */
+    bool*       dirty_;                     /* Chunks modified since last chunkClean */
+    size_t      nbits_;                     /* Number of usable bits */
+    size_t      nwords_;                    /* Number of words including padding */
+    size_t      chunk_bits_;                /* Bits per chunk */
+    size_t      nchunks_;                   /* Number of chunks */
+    size_t      used_;                      /* Number of set bits */
+    size_t      cursor_;                    /* Word where the next alloc() starts */
+};
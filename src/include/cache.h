@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdlib.h>
+#include <unordered_map>
+
+/**
+ * Fixed-size LRU pool of block frames.
+ * BlockCache only manages frames and recency; the owner (Disk) decides
+ * when frames are filled from or written back to the image.
+ */
+class BlockCache {
+public:
+    struct Frame {
+        size_t  block;                  /* Block number held by this frame */
+        bool    used;                   /* Whether or not frame holds a block */
+        bool    dirty;                  /* Frame differs from the image */
+        bool    prefetched;             /* Filled by readahead, not requested yet */
+        char*   data;                   /* BLOCK_SIZE bytes, block aligned */
+        Frame*  prev;                   /* Towards most recently used */
+        Frame*  next;                   /* Towards least recently used */
+    };
+public:
+    BlockCache();
+    ~BlockCache();
+
+    bool init(size_t capacity, size_t block_size);
+    void release();
+    size_t capacity() { return capacity_; }
+
+    Frame* lookup(size_t block);        /* Hit moves frame to MRU, miss returns nullptr */
+    bool   contains(size_t block) { return map_.count(block) > 0; }
+    Frame* victim();                    /* Frame the next insert() will reuse */
+    Frame* insert(size_t block);        /* Bind victim() to block and make it MRU */
+    void   invalidate(size_t block);    /* Drop block without writing it back */
+    Frame* frame(size_t idx) { return &frames_[idx]; }
+
+private:
+    void unlink(Frame* f);
+    void pushFront(Frame* f);
+
+    Frame*  frames_;                    /* All frames */
+    char*   data_;                      /* Backing memory of all frames */
+    size_t  capacity_;                  /* Number of frames */
+    Frame*  head_;                      /* Most recently used */
+    Frame*  tail_;                      /* Least recently used */
+    std::unordered_map<size_t, Frame*> map_;   /* Block number -> frame */
+};
@@ -1,27 +1,90 @@
 #pragma once
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <atomic>
+#include "cache.h"
+#include "uring.h"
+#include <vector>
 
+/**
+ * Disk is safe to use from several threads. The block cache is guarded by
+ * one mutex; uncached multi-block I/O runs outside of it with positional
+ * reads and writes, so threads working on different blocks overlap.
+ **/
 class Disk {
 public:
     // number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
+    // default number of cached blocks (1 MB)
+    const static size_t DEFAULT_CACHE_BLOCKS = 256;
+    // open flags
+    const static int OPEN_MMAP  = 0x1;  /* map the image, the page cache replaces the block cache */
+    const static int OPEN_URING = 0x2;  /* batch multi-block requests through io_uring */
+    const static int OPEN_DIRECT = 0x4; /* bypass the host page cache with O_DIRECT */
+    // io_uring submission queue depth
+    const static unsigned URING_ENTRIES = 64;
 public:
     Disk();
     ~Disk();
 
-    bool open(const char* path, size_t nblocks);
+    bool open(const char* path, size_t nblocks, size_t cache_blocks = DEFAULT_CACHE_BLOCKS, int flags = 0);
     ssize_t read(size_t block, char *data);
     ssize_t write(size_t block, char *data);
-    void close();
+    ssize_t readBlocks(size_t start, size_t count, char *data);
+    ssize_t writeBlocks(size_t start, size_t count, char *data);
+    ssize_t readv(const size_t *blocks, char *const *data, size_t count);
+    ssize_t writev(const size_t *blocks, char *const *data, size_t count);
+    const char* view(size_t block);
+    bool mapped() { return map_ != nullptr; }
+    bool direct() { return direct_; }
+    static bool isAligned(const void *data) { return ((size_t)data & (BLOCK_SIZE - 1)) == 0; }
+    bool flush();
+    bool sync();
+    bool discard(size_t start, size_t count);
+    bool prefetch(const size_t *blocks, size_t count);
+    size_t cacheBlocks() { return cache_.capacity(); }
+    void close(bool quiet = false);         /* Counters go to stdout unless quiet */
     bool disk_sanity_check(size_t block, const char *data);
     size_t getBlockNum() { return blocks_; }
+    size_t blockReads() { return reads_; }
+    size_t blockWrites() { return writes_; }
+    size_t syncs() { return syncs_; }
+    size_t cacheHits() { return hits_; }
+    size_t cacheMisses() { return misses_; }
+    size_t cacheEvictions() { return evictions_; }
 
+private:
+    ssize_t readBlock(size_t block, char *data);
+    ssize_t writeBlock(size_t block, char *data);
+    ssize_t readRun(size_t start, size_t count, char *const *data);
+    ssize_t writeRun(size_t start, size_t count, char *const *data);
+    BlockCache::Frame* cacheFrame(size_t block, bool fill);
+    BlockCache::Frame* claimFrame(size_t block);
 
+    struct IoRun {
+        size_t  start;          /* First block of run */
+        size_t  count;          /* Number of consecutive blocks */
+        size_t  first;          /* Index of the first buffer of run */
+    };
+    bool doRuns(bool write, const std::vector<IoRun>& runs, char *const *data);
+    size_t bounced(char *const *data, size_t count);
+    char* bounceBuffers(char *const *data, size_t count);
 
-private:
     int	    file_descriptor_;	/* File descriptor of disk image	*/
     size_t  blocks_;            /* Number of blocks in disk image	*/
-    size_t  reads_;             /* Number of reads to disk image	*/
-    size_t  writes_;            /* Number of writes to disk image	*/
-};
\ No newline at end of file
+    std::atomic<size_t> reads_;     /* Number of reads to disk image	*/
+    std::atomic<size_t> writes_;    /* Number of writes to disk image	*/
+    std::atomic<size_t> hits_;      /* Number of block requests served by cache */
+    std::atomic<size_t> misses_;    /* Number of block requests missing cache */
+    std::atomic<size_t> evictions_; /* Number of blocks evicted from cache */
+    std::atomic<size_t> readahead_; /* Number of blocks prefetched into cache */
+    std::atomic<size_t> readahead_hits_;    /* Prefetched blocks later requested */
+    std::atomic<size_t> syncs_;     /* Number of sync() calls reaching the image */
+
+    pthread_mutex_t lock_;      /* Guards cache_ */
+    BlockCache cache_;          /* Write-back LRU block cache */
+    char*   map_;               /* Whole image when opened with OPEN_MMAP */
+    Ring    ring_;              /* io_uring instance when opened with OPEN_URING */
+    bool    direct_;            /* Image opened with O_DIRECT, I/O memory must be aligned */
+};
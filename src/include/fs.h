@@ -1,51 +1,485 @@
 #pragma once
 
 #include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "disk.h"
+#include "bitmap.h"
+#include "stats.h"
+#include "trace.h"
 
+/**
+ * File operations (create, remove, stat, read, write, view) may be called
+ * from several threads at once. Each inode has a reader/writer lock, so
+ * readers of one file share it and work on different files runs in
+ * parallel; the block allocator has its own mutex. sync() excludes all
+ * file operations while it writes metadata back. format, mount and
+ * unmount must not race with anything else.
+ *
+ * Writes are buffered per inode and get their blocks only when they are
+ * flushed: by sync(), by the last close() of the inode, or once too much
+ * data is waiting. Space is still checked when write() is called.
+ *
+ * On an image formatted with FORMAT_JOURNAL, metadata blocks (inode
+ * table, bitmap, pointer and extent blocks) are not written in place
+ * until they have been logged. Changes collect in memory and every
+ * sync() commits all of them as one transaction with a single fsync of
+ * the image; mount() replays what was committed but not yet written
+ * home. Blocks a file gives up stay allocated until the commit that
+ * records it.
+ *
+ * On an image formatted with FORMAT_PACKED, a file of up to TAIL_MAX
+ * bytes gets no block of its own when it is flushed. Up to INLINE_BYTES
+ * are kept in the inode in place of its block map, anything larger in a
+ * run of TAIL_SLOT byte slots of a tail block shared with other small
+ * files (see pack.cpp). Reading such a file costs one block read at most.
+ *
+ * On an image formatted with FORMAT_COMPRESSED, every data block that
+ * compresses to fewer than TAIL_SLOTS slots is stored in tail slots as
+ * well, and its block pointer names the slots instead of a block (see
+ * compress.cpp).
+ *
+ * On an image formatted with FORMAT_DEDUP, a data block whose content is
+ * on disk already is not written again: the file points at the existing
+ * block, which counts the pointers to it and is only freed with the last
+ * (see dedup.cpp). The same counts let clone() make a copy of a file that
+ * shares all of its blocks until either file is written.
+ *
+ * Names live in directories, which are ordinary inodes holding a hashed
+ * index, rooted at inode 0 (see dir.cpp). Paths are resolved from the
+ * root and every component costs a fixed number of block reads; resolved
+ * components are remembered in a dentry cache.
+ *
+ * Every public operation is timed into stats(), which survives unmount
+ * and counts until reset. With setTrace(), calls are also recorded for
+ * sfs_replay.
+ **/
 class FileSystem {
+public:
+    struct Span {
+        const char* data;                           /* First byte, inside the mapped image */
+        size_t      length;                         /* Number of bytes */
+    };
+    struct Handle;                                  /* Open inode, see open() */
+    struct Name {
+        std::string name;                           /* Name inside its directory */
+        size_t      inode_number;                   /* Inode it refers to */
+        bool        directory;                      /* Whether the inode is a directory */
+    };
+public:
+    // format flags
+    const static int FORMAT_QUICK = 0x1;    /* discard the image instead of zeroing it, lazy inode table */
+    const static int FORMAT_LARGE = 0x2;    /* 64 byte inodes with double/triple indirect blocks */
+    const static int FORMAT_EXTENTS = 0x4;  /* 64 byte inodes mapping files by extents */
+    const static int FORMAT_JOURNAL = 0x8;  /* log metadata updates, see sync() */
+    const static int FORMAT_PACKED = 0x10;  /* 64 byte inodes, small files inline or in shared tail blocks */
+    const static int FORMAT_COMPRESSED = 0x20;  /* LZ compress data blocks into tail slots, not with extents */
+    const static int FORMAT_DEDUP = 0x40;   /* share data blocks of equal content, not with extents or compression */
 public:
     FileSystem();
     ~FileSystem();
     void debug(Disk& disk);
-    bool format(Disk& disk);
+    bool format(Disk& disk, int flags = 0);
     bool mount(Disk& disk);
     void unmount();
+    bool sync();
     ssize_t create();
+    ssize_t clone(size_t inode_number);
+    ssize_t clone(size_t inode_number, const char* path);
     bool remove(size_t inode_number);
     ssize_t stat(size_t inode_number);
     ssize_t read(size_t inode_number, char *data, size_t length, size_t offset);
     ssize_t write(size_t inode_number, char *data, size_t length, size_t offset);
+    ssize_t view(size_t inode_number, size_t length, size_t offset, std::vector<Span>& spans);
+    Handle* open(size_t inode_number);
+    ssize_t read(Handle* handle, char *data, size_t length, size_t offset);
+    ssize_t write(Handle* handle, char *data, size_t length, size_t offset);
+    void close(Handle* handle);
+    ssize_t lookup(const char* path);
+    ssize_t mkfile(const char* path);
+    ssize_t mkdir(const char* path);
+    bool unlink(const char* path);
+    bool list(const char* path, std::vector<Name>& names);
+    void setReadahead(size_t max_blocks) { readahead_max_ = max_blocks; }
+    Stats& stats() { return stats_; }
+    void setTrace(Trace* trace) { trace_ = trace; }
     ssize_t allocBlock();
+    ssize_t allocBlocks(size_t count, ssize_t hint, size_t* allocated);
+    void freeBlocks(size_t start, size_t count);
 
 private:
     const static uint32_t MAGIC_NUMBER       = 0xf0f03410;
-    const static uint32_t INODES_PER_BLOCK   = 128;               /* Number of inodes per block */
+    const static uint32_t LEGACY_INODES_PER_BLOCK = 128;          /* Number of inodes per block on old images */
+    const static uint32_t INODES_PER_BLOCK   = 64;                /* Number of inodes per block with FEATURE_LARGE_FILES */
     const static uint32_t POINTERS_PER_INODE = 5;                 /* Number of direct pointers per inode */
     const static uint32_t POINTERS_PER_BLOCK = 1024;              /* Number of pointers per block */
+    const static uint32_t BITS_PER_BLOCK     = Disk::BLOCK_SIZE * 8;  /* Number of bitmap bits per block */
+    const static uint32_t STATE_CLEAN        = 1;                 /* File system was unmounted cleanly */
+    const static uint32_t FEATURE_LAZY_INODES = 0x1;              /* Only inode_watermark inode blocks were ever written */
+    const static uint32_t FEATURE_LARGE_FILES = 0x2;              /* Inodes are Inode, not LegacyInode */
+    const static uint32_t FEATURE_EXTENTS    = 0x4;               /* Inodes hold an ExtentMap, needs FEATURE_LARGE_FILES */
+    const static uint32_t FEATURE_JOURNAL    = 0x8;               /* Metadata goes through the journal region */
+    const static uint32_t FEATURE_PACKED     = 0x10;              /* Small files are packed, needs FEATURE_LARGE_FILES */
+    const static uint32_t FEATURE_COMPRESSED = 0x20;              /* Block pointers may be compressed pointers, no extents */
+    const static uint32_t FEATURE_DEDUP      = 0x40;              /* Data blocks are shared, index region after the journal */
+    const static uint32_t FEATURES_KNOWN     = FEATURE_LAZY_INODES | FEATURE_LARGE_FILES | FEATURE_EXTENTS |
+                                               FEATURE_JOURNAL | FEATURE_PACKED | FEATURE_COMPRESSED | FEATURE_DEDUP;
+    const static uint32_t INODE_INLINE       = 0x1;               /* Inode flag: data is kept in the inode */
+    const static uint32_t INODE_TAIL         = 0x2;               /* Inode flag: data is kept in tail slots, see TailMap */
+    const static uint32_t INODE_SHARED       = 0x4;               /* Inode flag: pointer blocks may be shared with a clone */
+    const static uint32_t INLINE_BYTES       = 48;                /* Data an inode can hold, from direct on */
+    const static uint32_t TAIL_SLOT          = 256;               /* Bytes per tail slot */
+    const static uint32_t TAIL_SLOTS         = Disk::BLOCK_SIZE / TAIL_SLOT;  /* Slots per tail block */
+    const static uint32_t TAIL_MAX           = Disk::BLOCK_SIZE - TAIL_SLOT;  /* Largest file that is packed */
+    const static uint32_t COMPRESSED_BLOCK   = 0x80000000;        /* Pointer flag: the block is compressed, see tailPointer() */
+    const static uint32_t COMPRESSED_MAX_BLOCKS = 1u << 23;       /* Largest disk compressed pointers can address */
+    const static uint32_t INDEX_ENTRIES_PER_BLOCK = Disk::BLOCK_SIZE / 16;  /* Fingerprint index entries per block */
+    const static uint16_t MAX_REFS           = 0xffff;            /* Pointers a shared block can count */
+    const static uint32_t INLINE_EXTENTS     = 3;                 /* Extents kept in the inode itself */
+    const static uint32_t EXTENTS_PER_BLOCK  = Disk::BLOCK_SIZE / 12;  /* Extents in an extent block */
+    const static size_t   READAHEAD_MIN      = 4;                 /* First readahead window, in blocks */
+    const static size_t   READAHEAD_MAX      = 64;                /* Default largest readahead window */
+    const static size_t   WRITEBACK_BLOCKS   = 1024;              /* Buffered data blocks that force a flush */
+    const static uint32_t DIR_MAGIC          = 0xd1a5d1a5;        /* First word of a directory */
+    const static uint32_t NAME_LENGTH        = 54;                /* Longest name in a directory */
+    const static uint32_t DIR_TABLE_BLOCKS   = 64;                /* Directory blocks reserved for the bucket table */
+    const static uint32_t DIR_MAX_DEPTH      = 16;                /* log2 of the slots DIR_TABLE_BLOCKS hold */
+    const static uint32_t DIR_FIRST_BUCKET   = 1 + DIR_TABLE_BLOCKS;  /* Directory block of bucket 0 */
+    const static uint32_t ENTRIES_PER_BUCKET = 63;                /* Names per bucket block */
+    const static uint8_t  TYPE_FILE          = 1;                 /* DirEntry names a file */
+    const static uint8_t  TYPE_DIRECTORY     = 2;                 /* DirEntry names a directory */
+    const static size_t   DENTRY_CACHE_MAX   = 65536;             /* Cached path components before the cache is dropped */
+    const static uint32_t JOURNAL_MAGIC      = 0x4a524e4c;        /* First word of a transaction header */
+    const static uint32_t JOURNAL_TAGS       = (Disk::BLOCK_SIZE - 24) / 4;  /* Blocks one transaction can log */
 
     struct SuperBlock {
         uint32_t    magic_number;                   /* File system magic number */
         uint32_t    blocks;                         /* Number of blocks in file system */
         uint32_t    inode_blocks;                   /* Number of blocks reserved for inodes */
         uint32_t    inodes;                         /* Number of inodes in file system */
+        uint32_t    bitmap_blocks;                  /* Number of blocks holding the free block bitmap, 0 on old images */
+        uint32_t    state;                          /* STATE_CLEAN when the bitmap on disk is up to date */
+        uint32_t    features;                       /* FEATURE_* flags, 0 on old images */
+        uint32_t    inode_watermark;                /* With FEATURE_LAZY_INODES: inode blocks initialized so far */
+        uint32_t    journal_blocks;                 /* With FEATURE_JOURNAL: blocks after the bitmap holding the log */
+        uint32_t    index_blocks;                   /* With FEATURE_DEDUP: blocks after the journal holding the index */
+        uint32_t    index_entries;                  /* Entries stored there, only valid in STATE_CLEAN */
     };
 
-    struct Inode {
+    // on-disk inode of images without FEATURE_LARGE_FILES
+    struct LegacyInode {
         uint32_t    valid;                          /* Whether or not inode is valid */
         uint32_t    size;                           /* Size of file */
         uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
         uint32_t    indirect;                       /* Indirect pointers */
     };
 
-    union Block {
+    // in-memory inode, and on-disk inode with FEATURE_LARGE_FILES
+    struct Inode {
+        uint32_t    valid;                          /* Whether or not inode is valid */
+        uint32_t    flags;                          /* INODE_* flags, 0 without FEATURE_PACKED or FEATURE_DEDUP */
+        uint64_t    size;                           /* Size of file */
+        uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
+        uint32_t    indirect;                       /* Indirect pointers */
+        uint32_t    double_indirect;                /* Block of indirect blocks */
+        uint32_t    triple_indirect;                /* Block of double indirect blocks */
+        uint32_t    spare[4];                       /* Unused, 0 */
+    };
+
+    // blocks [start, start + length) hold file blocks from file_block on
+    struct Extent {
+        uint32_t    file_block;                     /* First file block */
+        uint32_t    start;                          /* First disk block */
+        uint32_t    length;                         /* Number of blocks */
+    };
+
+    // with FEATURE_EXTENTS, overlays Inode from direct on, see extentMap()
+    struct ExtentMap {
+        uint32_t    count;                          /* Extents in use, sorted by file_block */
+        uint32_t    block;                          /* Extent block holding them, 0 while they fit inline */
+        Extent      extents[INLINE_EXTENTS];        /* Inline extents */
+    };
+
+    // with INODE_TAIL, overlays Inode from direct on, see tailMap()
+    struct TailMap {
+        uint32_t    block;                          /* Tail block */
+        uint32_t    slot;                           /* First slot */
+        uint32_t    count;                          /* Number of slots */
+    };
+
+    // directory block 0, see dir.cpp
+    struct DirHeader {
+        uint32_t    magic;                          /* DIR_MAGIC */
+        uint32_t    depth;                          /* The table has 2^depth slots */
+        uint32_t    buckets;                        /* Bucket blocks in use */
+        uint32_t    entries;                        /* Names in the directory */
+    };
+
+    struct DirEntry {
+        uint32_t    inode;                          /* Inode the name refers to */
+        uint32_t    hash;                           /* nameHash() of name */
+        uint8_t     type;                           /* TYPE_FILE or TYPE_DIRECTORY */
+        uint8_t     length;                         /* Bytes used in name */
+        char        name[NAME_LENGTH];              /* Not terminated */
+    };
+
+    // directory block DIR_FIRST_BUCKET + n holds bucket n
+    struct DirBucket {
+        uint32_t    depth;                          /* Hash bits all names in here share */
+        uint32_t    count;                          /* Entries in use, packed at the front */
+        char        pad[sizeof(DirEntry) - 8];      /* Unused, 0 */
+        DirEntry    entries[ENTRIES_PER_BUCKET];    /* Names */
+    };
+
+    // a resolved path component
+    struct Dentry {
+        uint32_t    inode;                          /* Inode the name refers to */
+        uint8_t     type;                           /* TYPE_FILE or TYPE_DIRECTORY */
+    };
+
+    // first block of each journal half, the logged images follow it
+    struct JournalHeader {
+        uint32_t    magic;                          /* JOURNAL_MAGIC */
+        uint32_t    count;                          /* Blocks logged */
+        uint64_t    sequence;                       /* Transaction number, the higher half is newer */
+        uint64_t    checksum;                       /* journalChecksum() of header and images */
+        uint32_t    tags[JOURNAL_TAGS];             /* Home block of each image */
+    };
+
+    // fingerprint index region, see storeIndex()
+    struct IndexEntry {
+        uint64_t    fingerprint;                    /* fingerprint() of the content */
+        uint32_t    block;                          /* Data block holding it */
+        uint32_t    spare;                          /* Unused, 0 */
+    };
+
+    // block aligned so stack blocks can go to an O_DIRECT image untouched
+    union alignas(Disk::BLOCK_SIZE) Block {
         SuperBlock  super;                          /* View block as superblock */
         Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
+        LegacyInode legacy_inodes[LEGACY_INODES_PER_BLOCK]; /* View block as old inodes */
         uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+        Extent      extents[EXTENTS_PER_BLOCK];     /* View block as extents */
+        DirHeader   dir;                            /* View block as directory header */
+        DirBucket   bucket;                         /* View block as directory bucket */
+        JournalHeader journal;                      /* View block as journal header */
+        IndexEntry  index[INDEX_ENTRIES_PER_BLOCK]; /* View block as fingerprint index */
         char        data[Disk::BLOCK_SIZE];               /* View block as data */
     };
+    static_assert(sizeof(Inode) * INODES_PER_BLOCK == Disk::BLOCK_SIZE, "inodes must fill a block");
+    static_assert(sizeof(LegacyInode) * LEGACY_INODES_PER_BLOCK == Disk::BLOCK_SIZE, "inodes must fill a block");
+    static_assert(sizeof(Extent) == 12, "EXTENTS_PER_BLOCK assumes 12 byte extents");
+    static_assert(sizeof(ExtentMap) <= sizeof(Inode) - 16, "extent map must fit behind the inode size");
+    static_assert(INLINE_BYTES == sizeof(Inode) - 16, "inline data must fill the inode behind its size");
+    static_assert(TAIL_SLOTS <= 16, "tails_ keeps a slot mask of 16 bits");
+    static_assert(sizeof(DirBucket) == Disk::BLOCK_SIZE, "a bucket must fill a block");
+    static_assert(sizeof(JournalHeader) == Disk::BLOCK_SIZE, "a journal header must fill a block");
+    static_assert(sizeof(IndexEntry) * INDEX_ENTRIES_PER_BLOCK == Disk::BLOCK_SIZE, "index entries must fill a block");
+    static_assert((1u << DIR_MAX_DEPTH) == DIR_TABLE_BLOCKS * POINTERS_PER_BLOCK, "table blocks must hold every slot");
+
+    struct Run {
+        size_t      start;                          /* First block of run */
+        size_t      length;                         /* Number of blocks in run */
+    };
+
+    // a reference dropped before the commit that makes it count, see dropRef()
+    struct RetiredRef {
+        uint32_t    block;
+        uint32_t    depth;                          /* 0 for a data block, else levels of pointer blocks */
+    };
+
+    // a pointer block on the way from an inode to its data, see mapBlocks()
+    struct Level {
+        size_t      block;                          /* Block held in pointers, 0 if none */
+        uint32_t*   pointers;                       /* Its content */
+        bool        dirty;                          /* pointers changed since loaded */
+    };
+
+    struct Stream {
+        size_t      next_offset;                    /* Where a sequential reader continues */
+        size_t      ahead;                          /* First file block not prefetched yet */
+        size_t      window;                         /* Readahead window in blocks, 0 when random */
+    };
+
+    struct Prefetch {
+        size_t      inode_number;                   /* File to read ahead in */
+        size_t      first;                          /* First file block */
+        size_t      count;                          /* Number of file blocks */
+    };
+
+    ssize_t mapBlocks(size_t inode_number, size_t first, size_t count, size_t *blocks, Run *reserved,
+                      bool *indirect_pending = nullptr, uint32_t *replace = nullptr);
+    ssize_t mapExtents(size_t inode_number, size_t first, size_t count, size_t *blocks, Run *reserved,
+                       bool *block_pending);
+    bool loadExtents(Inode* inode, std::vector<Extent>& extents);
+    uint32_t cachedBlock(Inode* inode);
+    static ExtentMap* extentMap(Inode* inode) { return (ExtentMap*)inode->direct; }
+    static TailMap* tailMap(Inode* inode) { return (TailMap*)inode->direct; }
+    static char* inlineData(Inode* inode) { return (char*)inode->direct; }
+    static bool packed(const Inode* inode) { return (inode->flags & (INODE_INLINE | INODE_TAIL)) != 0; }
+    // a compressed pointer: flag, first slot (4 bits), slots (4 bits), tail block (23 bits)
+    static bool compressedPointer(uint32_t pointer) { return (pointer & COMPRESSED_BLOCK) != 0; }
+    static uint32_t tailPointer(const TailMap& tail) {
+        return COMPRESSED_BLOCK | tail.slot << 27 | tail.count << 23 | tail.block;
+    }
+    static TailMap pointerTail(uint32_t pointer) {
+        TailMap tail = {pointer & (COMPRESSED_MAX_BLOCKS - 1), (pointer >> 27) & 0xf, (pointer >> 23) & 0xf};
+        return tail;
+    }
+    bool storeLevel(Level& level);
+    bool treeBlocks(uint32_t block, size_t depth, std::vector<uint32_t>& blocks);
+    size_t maxFileBlocks() const;
+    void pointerBlocksNeeded(Handle* file, size_t idx, std::vector<uint64_t>& keys, bool copies);
+    ssize_t bufferData(size_t inode_number, char *data, size_t length, size_t offset);
+    bool flushInode(size_t inode_number);
+    bool flushAll();
+    Handle* newHandle(size_t inode_number);
+    void freeHandle(Handle* handle);
+    bool reserveBlocks(size_t count);
+    void unreserveBlocks(size_t count);
+    ssize_t takeBlock(Run& run, size_t want, ssize_t goal);
+    void releaseBlock(Run& run, size_t block, size_t depth = 0);
+
+    static uint32_t nameHash(const std::string& name);
+    bool readDirBlock(size_t dir, size_t file_block, Block& block);
+    bool writeDirBlock(size_t dir, size_t file_block, Block& block);
+    int loadDirHeader(size_t dir, Block& header, bool create);
+    bool findBucket(size_t dir, const Block& header, uint32_t hash, uint32_t* slot, uint32_t* bucket);
+    ssize_t dirLookup(size_t dir, const std::string& name, uint8_t* type);
+    bool dirInsert(size_t dir, const std::string& name, size_t inode_number, uint8_t type);
+    bool dirRemove(size_t dir, const std::string& name);
+    bool splitBucket(size_t dir, Block& header, uint32_t slot, uint32_t index, Block& bucket);
+    ssize_t resolve(const char* path, std::string* leaf, uint8_t* type);
+    ssize_t makeName(const char* path, uint8_t type, ssize_t source = -1);
+
+    bool formatDisk(Disk& disk, int flags);
+    bool mountDisk(Disk& disk);
+    ssize_t createFile();
+    ssize_t cloneFile(size_t inode_number);
+    bool removeFile(size_t inode_number);
+    ssize_t statFile(size_t inode_number);
+    ssize_t readFile(size_t inode_number, char *data, size_t length, size_t offset);
+    ssize_t writeFile(size_t inode_number, char *data, size_t length, size_t offset);
+    ssize_t viewFile(size_t inode_number, size_t length, size_t offset, std::vector<Span>& spans);
+    Handle* openFile(size_t inode_number);
+    bool unlinkName(const char* path);
+    bool listNames(const char* path, std::vector<Name>& names);
+
+    bool packable(size_t inode_number);
+    bool packInode(size_t inode_number, const char* data);
+    void unpackInode(size_t inode_number);
+    ssize_t readPacked(Inode* inode, char* data, size_t length, size_t offset);
+    bool loadPacked(size_t inode_number, char* buffer);
+    bool allocTail(uint32_t count, TailMap* tail, bool* fresh);
+    void freeTail(const TailMap& tail);
+    void retireTail(const TailMap& tail);
+    void releaseRetiredTails();
+    bool loadTails();
+    void compressBlocks(char* const* bufs, size_t count, uint32_t* pointers);
+    bool readCompressed(uint32_t pointer, char* data, Block& scratch, uint32_t* scratch_block);
+    void releasePointer(Run& run, uint32_t pointer);
+    static void printPointer(uint32_t pointer);
+    bool ownBlock(uint32_t block);
+    bool dropRef(Run& run, uint32_t block, size_t depth);
+    void releaseChildren(Run& run, uint32_t block, size_t depth);
+    bool shareBlocks(const uint32_t* blocks, size_t count);
+    void releaseRetiredRefs();
+    void dedupBlocks(char* const* bufs, size_t count, uint32_t* pointers, uint64_t* fingerprints);
+    void indexBlocks(const size_t* blocks, const uint64_t* fingerprints, size_t count);
+    void unindexBlock(uint32_t block);
+    bool countRefs(uint32_t block, size_t depth, std::vector<bool>& data_blocks);
+    bool loadRefs(bool clean);
+    bool storeIndex();
+    size_t indexStart() const { return journalStart() + meta_data_.journal_blocks; }
+
+    bool readMeta(size_t block, char* data);
+    bool writeMeta(size_t block, char* data);
+    void retireBlocks(size_t start, size_t count);
+    void releaseRetired();
+    size_t journalStart() const { return 1 + meta_data_.inode_blocks + meta_data_.bitmap_blocks; }
+    size_t journalCapacity() const;
+    size_t pendingBlocks();
+    void commitIfFull();
+    bool commitStep();
+    bool commitJournal();
+    bool replayJournal();
+    static uint64_t journalChecksum(const JournalHeader& header, char* const* images);
+
+    bool loadInodes();
+    bool storeInodes();
+    bool writeInodeBlock(uint32_t i);
+    static uint32_t inodesPerBlock(const SuperBlock& super);
+    static void expandInode(const LegacyInode& legacy, Inode* inode);
+    static uint32_t initializedInodeBlocks(const SuperBlock& super);
+    bool loadBitmap();
+    bool storeBitmap();
+    bool rebuildBitmap();
+    bool storeSuperBlock();
+    void release();
+    void readahead(size_t inode_number, size_t offset, size_t length);
+    void startReadahead();
+    void stopReadahead();
+    static void* prefetchMain(void* arg);
+    void prefetchLoop();
+    void dirtyInode(size_t inode_number) {
+        // inodes sharing a block may be dirtied by different threads
+        if(!__atomic_exchange_n(&dirty_inode_blocks_[inode_number / inodes_per_block_], true, __ATOMIC_RELAXED)) {
+            dirty_inode_count_++;
+        }
+    }
 
     Disk* disk_;                          /* Disk file system is mounted on */
-    bool* free_blocks_;                   /* Free block bitmap, true means been used*/
+    Bitmap free_blocks_;                  /* Free block bitmap, set means been used */
     SuperBlock meta_data_;  
+    Inode* inodes_;                       /* In-memory inode table, loaded at mount */
+    uint32_t inodes_per_block_;           /* Inodes per inode table block on this disk */
+    bool* dirty_inode_blocks_;            /* Inode blocks modified since last store */
+    std::atomic<size_t> dirty_inode_count_; /* Entries set in dirty_inode_blocks_ */
+
+    pthread_rwlock_t  fs_lock_;           /* Shared by file operations, exclusive for sync */
+    pthread_rwlock_t* inode_locks_;       /* One per inode, guards the inode and its blocks */
+    Handle** open_files_;                 /* Per inode, handle while it is open */
+    pthread_mutex_t   table_lock_;        /* Guards the valid flags while create() looks for a slot */
+    pthread_mutex_t   alloc_lock_;        /* Guards free_blocks_, delayed_blocks_ and the dedup state below */
+    size_t delayed_blocks_;               /* Free blocks promised to buffered writes */
+    std::atomic<size_t> buffered_blocks_; /* Data blocks waiting in handles */
+    uint32_t free_hint_;                  /* No free inode below it, guarded by table_lock_ */
+
+    pthread_rwlock_t  names_lock_;        /* Shared by lookups, exclusive while names change */
+    pthread_mutex_t   dentry_lock_;       /* Guards dentries_ */
+    std::unordered_map<std::string, Dentry> dentries_;  /* "directory inode/name" -> resolved name */
+
+    pthread_mutex_t   journal_lock_;      /* Guards staged_ */
+    std::map<size_t, char*> staged_;      /* Metadata block -> image waiting for the next commit */
+    std::vector<Run>  retired_;           /* Blocks freed since the last commit, guarded by alloc_lock_ */
+    std::atomic<size_t> retired_blocks_;  /* Blocks in retired_ */
+    uint64_t journal_sequence_;           /* Number of the next transaction */
+    std::atomic<uint64_t> commits_;       /* sync() calls that did the work, see sync() */
+    bool last_sync_ok_;                   /* Result of the latest of them */
+
+    pthread_mutex_t   tail_lock_;         /* Guards tails_, retired_tails_ and tail block updates */
+    std::map<uint32_t, uint16_t> tails_;  /* Tail block with free slots -> mask of the used ones */
+    std::vector<TailMap> retired_tails_;  /* Slots freed since the last commit */
+
+    std::vector<uint16_t> refs_;          /* With FEATURE_DEDUP: per block, pointers to it, rebuilt at mount */
+    std::vector<RetiredRef> retired_refs_;  /* Shared blocks that lost a pointer since the last commit */
+    std::unordered_map<uint64_t, uint32_t> index_;    /* Fingerprint -> data block holding it */
+    std::unordered_map<uint32_t, uint64_t> indexed_;  /* Data block -> its fingerprint in index_ */
+
+    Stream* streams_;                     /* Per inode, sequential read detection */
+    size_t readahead_max_;                /* Largest readahead window, 0 disables readahead */
+    std::deque<Prefetch> prefetch_queue_; /* Waiting for the prefetch thread */
+    pthread_mutex_t   ra_lock_;           /* Guards streams_ and prefetch_queue_ */
+    pthread_cond_t    ra_cond_;           /* Signals queued work or stop */
+    pthread_t         ra_thread_;         /* Background prefetch thread */
+    bool              ra_running_;        /* ra_thread_ was started */
+    bool              ra_stop_;           /* Asks ra_thread_ to exit */
+
+    Stats stats_;                         /* Operation counters and latencies */
+    Trace* trace_;                        /* Records every call while set, see setTrace() */
 };
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <pthread.h>
+
+/**
+ * Scoped holders for pthread locks, released when they go out of scope
+ * so early error returns cannot leak a lock.
+ **/
+class MutexLock {
+public:
+    explicit MutexLock(pthread_mutex_t* m) : m_(m) { pthread_mutex_lock(m_); }
+    ~MutexLock() { pthread_mutex_unlock(m_); }
+private:
+    MutexLock(const MutexLock&);
+    MutexLock& operator=(const MutexLock&);
+    pthread_mutex_t* m_;
+};
+
+class ReadLock {
+public:
+    explicit ReadLock(pthread_rwlock_t* l) : l_(l) { pthread_rwlock_rdlock(l_); }
+    ~ReadLock() { pthread_rwlock_unlock(l_); }
+private:
+    ReadLock(const ReadLock&);
+    ReadLock& operator=(const ReadLock&);
+    pthread_rwlock_t* l_;
+};
+
+class WriteLock {
+public:
+    explicit WriteLock(pthread_rwlock_t* l) : l_(l) { pthread_rwlock_wrlock(l_); }
+    ~WriteLock() { pthread_rwlock_unlock(l_); }
+private:
+    WriteLock(const WriteLock&);
+    WriteLock& operator=(const WriteLock&);
+    pthread_rwlock_t* l_;
+};
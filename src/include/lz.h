@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/**
+ * Byte oriented LZ77 codec for single blocks, in the LZ4 block format:
+ * a sequence is a token byte (literal count in the high nibble, match
+ * length minus MIN_MATCH in the low one, 15 meaning more length bytes
+ * follow), the literals, and a 2 byte little endian match offset. The
+ * last sequence has literals only. Matches are found by following hash
+ * chains of 4 byte prefixes a few steps back, and a match is put off by
+ * a byte when the next position has a longer one. Compression is meant
+ * for single blocks: matches reach back at most 4 KB.
+ **/
+class LZ {
+public:
+    const static size_t MIN_MATCH = 4;
+
+    // compressed size, 0 when the result would not fit in capacity
+    static size_t compress(const char* src, size_t length, char* dst, size_t capacity);
+    // decompressed size, -1 when src is damaged or does not fit in capacity
+    static ssize_t decompress(const char* src, size_t length, char* dst, size_t capacity);
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+class Disk;
+
+/**
+ * Counters and latency histograms of the FileSystem operations. Every
+ * operation keeps its call count, failures, bytes moved, total and
+ * largest latency, and a histogram with one bucket per power of two
+ * nanoseconds. Updates are relaxed atomics, so any thread may record
+ * while another one reads; a report taken meanwhile is not a snapshot
+ * but never loses an update.
+ **/
+class Stats {
+public:
+    enum Op {
+        OP_CREATE,
+        OP_REMOVE,
+        OP_STAT,
+        OP_READ,
+        OP_WRITE,
+        OP_ALLOC,                           /* allocBlock() and allocBlocks() */
+        OP_SYNC,
+        OP_COUNT
+    };
+    const static int BUCKETS = 40;          /* Bucket n holds latencies in [2^n, 2^(n+1)) ns */
+public:
+    Stats();
+
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+    void record(int op, uint64_t nanoseconds, ssize_t result, size_t bytes);
+    void allocated(size_t blocks) { blocks_allocated_.fetch_add(blocks, std::memory_order_relaxed); }
+    void freed(size_t blocks) { blocks_freed_.fetch_add(blocks, std::memory_order_relaxed); }
+    void compressed(size_t bytes, size_t stored) {
+        compress_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        compress_stored_.fetch_add(stored, std::memory_order_relaxed);
+    }
+    void decoded(size_t bytes, uint64_t nanoseconds) {
+        decode_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        decode_ns_.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+    void deduplicated(size_t blocks, size_t shared) {
+        dedup_blocks_.fetch_add(blocks, std::memory_order_relaxed);
+        dedup_shared_.fetch_add(shared, std::memory_order_relaxed);
+    }
+    void reset();
+
+    uint64_t calls(int op) const { return ops_[op].calls.load(std::memory_order_relaxed); }
+    uint64_t blocksAllocated() const { return blocks_allocated_.load(std::memory_order_relaxed); }
+    uint64_t blocksFreed() const { return blocks_freed_.load(std::memory_order_relaxed); }
+    uint64_t percentile(int op, double p) const;
+    void print(Disk* disk) const;
+    std::string json(Disk* disk) const;
+    static const char* name(int op);
+
+private:
+    struct Counters {
+        std::atomic<uint64_t> calls;        /* Operations finished */
+        std::atomic<uint64_t> errors;       /* Of them returned failure */
+        std::atomic<uint64_t> bytes;        /* Bytes read or written */
+        std::atomic<uint64_t> total_ns;     /* Sum of latencies */
+        std::atomic<uint64_t> max_ns;       /* Largest latency */
+        std::atomic<uint64_t> buckets[BUCKETS];
+    };
+    Stats(const Stats&);
+    Stats& operator=(const Stats&);
+
+    Counters ops_[OP_COUNT];
+    std::atomic<uint64_t> blocks_allocated_;    /* Blocks handed out by the bitmap */
+    std::atomic<uint64_t> blocks_freed_;        /* Blocks returned to the bitmap */
+    std::atomic<uint64_t> compress_bytes_;      /* Data written back on a compressed image */
+    std::atomic<uint64_t> compress_stored_;     /* Bytes of slots and blocks it took */
+    std::atomic<uint64_t> decode_bytes_;        /* Data decompressed by reads */
+    std::atomic<uint64_t> decode_ns_;           /* Time spent decompressing it */
+    std::atomic<uint64_t> dedup_blocks_;        /* Blocks written back on a dedup image */
+    std::atomic<uint64_t> dedup_shared_;        /* Of them found on disk already */
+};
+
+/**
+ * Times one operation from construction to destruction. done() passes
+ * the operation's result through and remembers how many bytes it moved.
+ **/
+class OpTimer {
+public:
+    OpTimer(Stats* stats, int op) : stats_(stats), op_(op), result_(0), bytes_(0), start_(Stats::now()) {}
+    ~OpTimer() { stats_->record(op_, Stats::now() - start_, result_, bytes_); }
+    ssize_t done(ssize_t result, bool moved = false) {
+        result_ = result;
+        bytes_  = moved && result > 0 ? (size_t)result : 0;
+        return result;
+    }
+private:
+    OpTimer(const OpTimer&);
+    OpTimer& operator=(const OpTimer&);
+    Stats*   stats_;
+    int      op_;
+    ssize_t  result_;
+    size_t   bytes_;
+    uint64_t start_;
+};
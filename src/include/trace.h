@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <string>
+
+/**
+ * Binary trace of FileSystem calls, for sfs_replay. The file starts with
+ * TRACE_MAGIC and a version word, then holds one record per finished
+ * call in the order the calls returned:
+ *
+ *     op          1 byte, Trace::Op
+ *     time        zigzag varint, start time minus the previous record's
+ *     duration    varint, ns
+ *     inode       varint, inode number or call specific (see Record)
+ *     length      varint
+ *     offset      varint
+ *     result      zigzag varint
+ *     path        varint length and bytes, only for the path operations
+ *                 and clone
+ *
+ * A read or write costs about 10 bytes. Data is not recorded, only its
+ * size.
+ **/
+class Trace {
+public:
+    enum Op {
+        OP_FORMAT = 1,                      /* inode: format flags, length: disk blocks */
+        OP_MOUNT,                           /* inode: format flags of the image, length: disk blocks */
+        OP_UNMOUNT,
+        OP_SYNC,
+        OP_CREATE,
+        OP_REMOVE,
+        OP_STAT,
+        OP_READ,
+        OP_WRITE,
+        OP_VIEW,
+        OP_OPEN,
+        OP_CLOSE,
+        OP_LOOKUP,
+        OP_MKFILE,
+        OP_MKDIR,
+        OP_UNLINK,
+        OP_LIST,
+        OP_CLONE,                           /* inode: the source, path: name of the clone, empty if none */
+        OP_COUNT
+    };
+    struct Record {
+        uint8_t     op;
+        uint64_t    time_ns;                /* Call start, since the trace was opened */
+        uint64_t    duration_ns;
+        uint64_t    inode;
+        uint64_t    length;
+        uint64_t    offset;
+        int64_t     result;                 /* Return value, bool calls give 0 or -1 */
+        std::string path;
+    };
+    const static uint64_t TRACE_MAGIC = 0x45434152545346ull;   /* "FSTRACE" */
+    const static uint32_t TRACE_VERSION = 1;
+public:
+    Trace();
+    ~Trace();
+
+    bool open(const char* path);            /* Start recording into path */
+    void close();
+    bool recording() { return stream_ != nullptr; }
+    uint64_t start() { return start_ns_; }
+    void record(const Record& record);
+    static bool hasPath(int op) { return op >= OP_LOOKUP && op <= OP_CLONE; }
+    static const char* name(int op);
+
+private:
+    Trace(const Trace&);
+    Trace& operator=(const Trace&);
+
+    FILE*           stream_;                /* Trace file, nullptr when not recording */
+    uint64_t        start_ns_;              /* Stats::now() at open() */
+    uint64_t        last_ns_;               /* Start time of the previous record */
+    pthread_mutex_t lock_;                  /* Guards stream_ and last_ns_ */
+};
+
+/**
+ * Sequential reader of a trace file.
+ **/
+class TraceReader {
+public:
+    TraceReader();
+    ~TraceReader();
+
+    bool open(const char* path);
+    bool next(Trace::Record& record);       /* false at the end or on a damaged record */
+    void close();
+
+private:
+    TraceReader(const TraceReader&);
+    TraceReader& operator=(const TraceReader&);
+    bool varint(uint64_t* value);
+
+    FILE*    stream_;
+    uint64_t last_ns_;
+};
+
+/**
+ * Records one call when it goes out of scope, if trace is recording.
+ * Calls made while another traced call of the same thread is running
+ * (create() inside mkfile(), sync() inside unmount()) are part of the
+ * outer call and are left out, so a replay does them only once.
+ **/
+class TraceCall {
+public:
+    TraceCall(Trace* trace, int op, uint64_t inode = 0, uint64_t length = 0, uint64_t offset = 0,
+              const char* path = nullptr);
+    ~TraceCall();
+    ssize_t done(ssize_t result) {
+        record_.result = result;
+        return result;
+    }
+    void setInode(uint64_t inode) { record_.inode = inode; }
+private:
+    TraceCall(const TraceCall&);
+    TraceCall& operator=(const TraceCall&);
+    Trace*        trace_;                   /* nullptr when not recording */
+    Trace::Record record_;
+    uint64_t      start_;
+    static thread_local int depth_;         /* Traced calls running in this thread */
+};
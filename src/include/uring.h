@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Minimal io_uring submission/completion ring on top of the raw system
+ * calls. Used by Disk to issue every run of a multi-block request at once
+ * and wait for all of them together. Concurrent submit() calls take
+ * turns on the ring.
+ **/
+class Ring {
+public:
+    struct Request {
+        bool            write;              /* Write instead of read */
+        off_t           offset;             /* Byte offset in the file */
+        struct iovec*   iov;                /* Buffers, filled in order */
+        unsigned        iovcnt;             /* Number of buffers */
+        size_t          bytes;              /* Total length of buffers */
+    };
+public:
+    Ring();
+    ~Ring();
+
+    bool init(int fd, unsigned entries);    /* false when io_uring is unavailable */
+    void release();
+    bool ready() { return __atomic_load_n(&ring_fd_, __ATOMIC_ACQUIRE) >= 0; }  /* false once a failure tore it down */
+    bool submit(Request* requests, size_t count);   /* Run all requests, true if all completed fully */
+
+private:
+    int         ring_fd_;                   /* io_uring instance */
+    int         file_fd_;                   /* File all requests go to */
+    unsigned    entries_;                   /* Submission queue size */
+    pthread_mutex_t lock_;                  /* Serializes submit() */
+
+    void*       sq_ring_;                   /* Submission ring mapping */
+    size_t      sq_ring_size_;
+    void*       cq_ring_;                   /* Completion ring mapping, may alias sq_ring_ */
+    size_t      cq_ring_size_;
+    void*       sqes_;                      /* Submission queue entries */
+    size_t      sqes_size_;
+
+    unsigned*   sq_head_;
+    unsigned*   sq_tail_;
+    unsigned*   sq_mask_;
+    unsigned*   sq_array_;
+    unsigned*   cq_head_;
+    unsigned*   cq_tail_;
+    unsigned*   cq_mask_;
+    void*       cqes_;
+};
@@ -0,0 +1,251 @@
+#include "bitmap.h"
+#include <string.h>
+
+Bitmap::Bitmap() {
+    words_      = nullptr;
+    full_       = nullptr;
+    dirty_      = nullptr;
+    nbits_      = 0;
+    nwords_     = 0;
+    chunk_bits_ = 0;
+    nchunks_    = 0;
+    used_       = 0;
+    cursor_     = 0;
+}
+
+Bitmap::~Bitmap() {
+    release();
+}
+
+bool Bitmap::init(size_t nbits, size_t chunk_bits) {
+    release();
+    if(nbits == 0 || chunk_bits == 0 || chunk_bits % 64 != 0)
+        return false;
+
+    nbits_      = nbits;
+    chunk_bits_ = chunk_bits;
+    nchunks_    = (nbits + chunk_bits - 1) / chunk_bits;
+    nwords_     = nchunks_ * (chunk_bits / 64);
+    // chunks map onto image blocks, align them for O_DIRECT writes
+    void* mem = nullptr;
+    if(posix_memalign(&mem, chunk_bits / 8, nwords_ * sizeof(uint64_t)) == 0) {
+        words_ = (uint64_t*)mem;
+        memset(words_, 0, nwords_ * sizeof(uint64_t));
+    }
+    full_  = (uint64_t*)calloc((nwords_ + 63) / 64, sizeof(uint64_t));
+    dirty_ = (bool*)calloc(nchunks_, sizeof(bool));
+    if(!words_ || !full_ || !dirty_) {
+        release();
+        return false;
+    }
+    seal();
+    return true;
+}
+
+void Bitmap::release() {
+    free(words_);
+    free(full_);
+    free(dirty_);
+    words_  = nullptr;
+    full_   = nullptr;
+    dirty_  = nullptr;
+    nbits_  = nwords_ = nchunks_ = 0;
+    used_   = 0;
+    cursor_ = 0;
+}
+
+void Bitmap::reset() {
+    memset(words_, 0, nwords_ * sizeof(uint64_t));
+    for(size_t i = 0; i < nchunks_; ++i)
+        dirty_[i] = true;
+    seal();
+}
+
+void Bitmap::seal() {
+    // padding past the last real bit reads as used so it is never handed out
+    for(size_t bit = nbits_; bit < nwords_ * 64; ++bit)
+        words_[bit / 64] |= (uint64_t)1 << (bit % 64);
+
+    used_ = 0;
+    memset(full_, 0, ((nwords_ + 63) / 64) * sizeof(uint64_t));
+    for(size_t w = 0; w < nwords_; ++w) {
+        used_ += __builtin_popcountll(words_[w]);
+        updateSummary(w);
+    }
+    used_ -= nwords_ * 64 - nbits_;
+    cursor_ = 0;
+}
+
+void Bitmap::updateSummary(size_t word) {
+    if(words_[word] == ~(uint64_t)0)
+        full_[word / 64] |= (uint64_t)1 << (word % 64);
+    else
+        full_[word / 64] &= ~((uint64_t)1 << (word % 64));
+}
+
+void Bitmap::set(size_t bit) {
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    if(bit >= nbits_ || (words_[bit / 64] & mask))
+        return;
+    words_[bit / 64] |= mask;
+    used_++;
+    dirty_[bit / chunk_bits_] = true;
+    updateSummary(bit / 64);
+}
+
+void Bitmap::clear(size_t bit) {
+    uint64_t mask = (uint64_t)1 << (bit % 64);
+    if(bit >= nbits_ || !(words_[bit / 64] & mask))
+        return;
+    words_[bit / 64] &= ~mask;
+    used_--;
+    dirty_[bit / chunk_bits_] = true;
+    updateSummary(bit / 64);
+}
+
+/**
+ * Find the first word in [first_word, last_word) with a free bit using
+ * the summary level, and return the free bit in it.
+ **/
+ssize_t Bitmap::scan(size_t first_word, size_t last_word) {
+    size_t s = first_word / 64;
+    // ignore summary bits below first_word in the first summary word
+    uint64_t candidates = ~full_[s] & (~(uint64_t)0 << (first_word % 64));
+    while(true) {
+        if(candidates) {
+            size_t word = s * 64 + __builtin_ctzll(candidates);
+            if(word >= last_word)
+                return -1;
+            return (ssize_t)(word * 64 + __builtin_ctzll(~words_[word]));
+        }
+        if(++s * 64 >= last_word)
+            return -1;
+        candidates = ~full_[s];
+    }
+}
+
+ssize_t Bitmap::findFree(size_t from) {
+    if(from >= nbits_)
+        return -1;
+    // look at the rest of the starting word first
+    uint64_t rest = ~words_[from / 64] & (~(uint64_t)0 << (from % 64));
+    if(rest)
+        return (ssize_t)((from / 64) * 64 + __builtin_ctzll(rest));
+    if(from / 64 + 1 >= nwords_)
+        return -1;
+    return scan(from / 64 + 1, nwords_);
+}
+
+ssize_t Bitmap::alloc() {
+    if(used_ >= nbits_)
+        return -1;
+    // next fit: continue after the last allocation, wrap once
+    ssize_t bit = scan(cursor_, nwords_);
+    if(bit < 0 && cursor_ > 0)
+        bit = scan(0, cursor_);
+    if(bit < 0)
+        return -1;
+    set((size_t)bit);
+    cursor_ = (size_t)bit / 64;
+    return bit;
+}
+
+/**
+ * Number of free bits starting at bit, at most max. Without padding
+ * bits the last word ends the bitmap, so stop at nbits_ rather than
+ * read past it.
+ **/
+size_t Bitmap::runLength(size_t bit, size_t max) {
+    if(max > nbits_ - bit)
+        max = nbits_ - bit;
+    size_t len = 0;
+    while(len < max) {
+        size_t pos = bit + len;
+        uint64_t rest = words_[pos / 64] >> (pos % 64);
+        // free bits up to the next used one, or to the end of the word
+        size_t span = rest ? (size_t)__builtin_ctzll(rest) : 64 - pos % 64;
+        len += span;
+        if(rest)
+            break;
+    }
+    return len < max ? len : max;
+}
+
+/**
+ * Claim a run of up to count contiguous free bits. The first run at or
+ * after hint (or the next-fit cursor when hint is negative) that is
+ * long enough wins; if there is none, the longest run seen is returned.
+ * *got receives the length of the run.
+ **/
+ssize_t Bitmap::allocRun(size_t count, ssize_t hint, size_t* got) {
+    *got = 0;
+    if(count == 0 || used_ >= nbits_)
+        return -1;
+    size_t first = (hint >= 0 && (size_t)hint < nbits_) ? (size_t)hint : cursor_ * 64;
+
+    ssize_t best = -1;
+    size_t  best_len = 0;
+    size_t  pos = first;
+    bool    wrapped = false;
+    while(true) {
+        ssize_t f = findFree(pos);
+        if(f < 0 || (wrapped && (size_t)f >= first)) {
+            if(wrapped || first == 0)
+                break;
+            wrapped = true;
+            pos = 0;
+            continue;
+        }
+        size_t len = runLength((size_t)f, count);
+        if(len > best_len) {
+            best = f;
+            best_len = len;
+            if(len == count)
+                break;
+        }
+        pos = (size_t)f + len;
+    }
+    if(best < 0)
+        return -1;
+
+    setRange((size_t)best, best_len);
+    cursor_ = ((size_t)best + best_len) / 64;
+    if(cursor_ >= nwords_)
+        cursor_ = 0;
+    *got = best_len;
+    return best;
+}
+
+void Bitmap::setRange(size_t bit, size_t count) {
+    size_t end = bit + count;
+    if(end > nbits_)
+        end = nbits_;
+    while(bit < end) {
+        size_t n = 64 - bit % 64;
+        if(n > end - bit)
+            n = end - bit;
+        uint64_t mask = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << (bit % 64);
+        used_ += n - __builtin_popcountll(words_[bit / 64] & mask);
+        words_[bit / 64] |= mask;
+        dirty_[bit / chunk_bits_] = true;
+        updateSummary(bit / 64);
+        bit += n;
+    }
+}
+
+void Bitmap::clearRange(size_t bit, size_t count) {
+    size_t end = bit + count;
+    if(end > nbits_)
+        end = nbits_;
+    while(bit < end) {
+        size_t n = 64 - bit % 64;
+        if(n > end - bit)
+            n = end - bit;
+        uint64_t mask = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << (bit % 64);
+        used_ -= __builtin_popcountll(words_[bit / 64] & mask);
+        words_[bit / 64] &= ~mask;
+        dirty_[bit / chunk_bits_] = true;
+        updateSummary(bit / 64);
+        bit += n;
+    }
+}
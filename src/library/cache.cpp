@@ -0,0 +1,122 @@
+#include "cache.h"
+#include <string.h>
+
+BlockCache::BlockCache() {
+    frames_   = nullptr;
+    data_     = nullptr;
+    capacity_ = 0;
+    head_     = nullptr;
+    tail_     = nullptr;
+}
+
+BlockCache::~BlockCache() {
+    release();
+}
+
+bool BlockCache::init(size_t capacity, size_t block_size) {
+    release();
+    if(capacity == 0)
+        return true;
+
+    // frames are block aligned so they can be handed to the image as is
+    void* mem = nullptr;
+    if(posix_memalign(&mem, block_size, capacity * block_size) != 0)
+        return false;
+    data_   = (char*)mem;
+    frames_ = (Frame*)calloc(capacity, sizeof(Frame));
+    if(!frames_) {
+        release();
+        return false;
+    }
+    capacity_ = capacity;
+    map_.reserve(capacity);
+
+    // every frame starts unused, chained in index order
+    for(size_t i = 0; i < capacity; ++i) {
+        frames_[i].data = data_ + i * block_size;
+        frames_[i].prev = (i == 0) ? nullptr : &frames_[i - 1];
+        frames_[i].next = (i + 1 == capacity) ? nullptr : &frames_[i + 1];
+    }
+    head_ = &frames_[0];
+    tail_ = &frames_[capacity - 1];
+    return true;
+}
+
+void BlockCache::release() {
+    if(frames_) {
+        free(frames_);
+        frames_ = nullptr;
+    }
+    if(data_) {
+        free(data_);
+        data_ = nullptr;
+    }
+    map_.clear();
+    capacity_ = 0;
+    head_ = tail_ = nullptr;
+}
+
+void BlockCache::unlink(Frame* f) {
+    if(f->prev) f->prev->next = f->next;
+    else        head_ = f->next;
+    if(f->next) f->next->prev = f->prev;
+    else        tail_ = f->prev;
+    f->prev = f->next = nullptr;
+}
+
+void BlockCache::pushFront(Frame* f) {
+    f->prev = nullptr;
+    f->next = head_;
+    if(head_) head_->prev = f;
+    head_ = f;
+    if(!tail_) tail_ = f;
+}
+
+BlockCache::Frame* BlockCache::lookup(size_t block) {
+    std::unordered_map<size_t, Frame*>::iterator it = map_.find(block);
+    if(it == map_.end())
+        return nullptr;
+    Frame* f = it->second;
+    if(f != head_) {
+        unlink(f);
+        pushFront(f);
+    }
+    return f;
+}
+
+BlockCache::Frame* BlockCache::victim() {
+    return tail_;
+}
+
+BlockCache::Frame* BlockCache::insert(size_t block) {
+    Frame* f = tail_;
+    if(!f)
+        return nullptr;
+    if(f->used)
+        map_.erase(f->block);
+    f->block = block;
+    f->used  = true;
+    f->dirty = false;
+    f->prefetched = false;
+    map_[block] = f;
+    unlink(f);
+    pushFront(f);
+    return f;
+}
+
+void BlockCache::invalidate(size_t block) {
+    std::unordered_map<size_t, Frame*>::iterator it = map_.find(block);
+    if(it == map_.end())
+        return;
+    Frame* f = it->second;
+    map_.erase(it);
+    f->used  = false;
+    f->dirty = false;
+    // unused frames are reused first
+    unlink(f);
+    f->prev = tail_;
+    f->next = nullptr;
+    if(tail_) tail_->next = f;
+    tail_ = f;
+    if(!head_) head_ = f;
+}
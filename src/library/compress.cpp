@@ -0,0 +1,122 @@
+#include "fs.h"
+#include "lock.h"
+#include "lz.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Data blocks on FEATURE_COMPRESSED images. When a buffered block is
+ * written back it is compressed with LZ; if the result, behind a 2 byte
+ * length, fits in fewer than TAIL_SLOTS slots it goes into tail slots
+ * (see pack.cpp) and the file's block pointer becomes a compressed
+ * pointer naming them, otherwise the block is written as it is. Reads
+ * fetch the tail block and decompress, neighbouring compressed blocks of
+ * a file usually share it.
+ *
+ * Compressed pointers sit wherever block pointers do, in the inode or in
+ * indirect blocks, and are told apart from block numbers by their top
+ * bit. That is why extents cannot be compressed and why a compressed
+ * image is limited to COMPRESSED_MAX_BLOCKS. Which slots are used is
+ * rebuilt at mount by walking every file's pointers.
+ **/
+
+/**
+ * Compress count buffered blocks into tail slots, writing each tail
+ * block once. pointers[i] gets the compressed pointer of bufs[i], or 0
+ * when the block does not compress well enough or no slots are left and
+ * it needs a block of its own.
+ **/
+void FileSystem::compressBlocks(char* const* bufs, size_t count, uint32_t* pointers) {
+    std::map<uint32_t, char*> images;           /* Tail block -> its new content */
+    char packed[TAIL_MAX];
+    MutexLock guard(&tail_lock_);
+    for(size_t i = 0; i < count; ++i) {
+        pointers[i] = 0;
+        size_t length = LZ::compress(bufs[i], Disk::BLOCK_SIZE, packed + 2, sizeof(packed) - 2);
+        TailMap tail;
+        bool fresh = false;
+        if(length == 0 || !allocTail((uint32_t)((length + 2 + TAIL_SLOT - 1) / TAIL_SLOT), &tail, &fresh)) {
+            stats_.compressed(Disk::BLOCK_SIZE, Disk::BLOCK_SIZE);
+            continue;
+        }
+        char*& image = images[tail.block];
+        if(!image) {
+            void* mem = nullptr;
+            if(posix_memalign(&mem, Disk::BLOCK_SIZE, Disk::BLOCK_SIZE) != 0) {
+                images.erase(tail.block);
+                freeTail(tail);
+                continue;
+            }
+            image = (char*)mem;
+            if(fresh) {
+                memset(image, 0, Disk::BLOCK_SIZE);
+            }else if(disk_->read(tail.block, image) != Disk::BLOCK_SIZE) {
+                free(image);
+                images.erase(tail.block);
+                freeTail(tail);
+                continue;
+            }
+        }
+        packed[0] = (char)length;
+        packed[1] = (char)(length >> 8);
+        char* slots = image + tail.slot * TAIL_SLOT;
+        memcpy(slots, packed, length + 2);
+        memset(slots + length + 2, 0, tail.count * TAIL_SLOT - length - 2);
+        pointers[i] = tailPointer(tail);
+        stats_.compressed(Disk::BLOCK_SIZE, tail.count * TAIL_SLOT);
+    }
+    // a tail block that cannot be written takes its slots with it
+    for(std::map<uint32_t, char*>::iterator it = images.begin(); it != images.end(); ++it) {
+        if(disk_->write(it->first, it->second) != Disk::BLOCK_SIZE) {
+            printf("Failed to write tail block %u\n", it->first);
+            for(size_t i = 0; i < count; ++i) {
+                if(pointers[i] != 0 && pointerTail(pointers[i]).block == it->first) {
+                    freeTail(pointerTail(pointers[i]));
+                    pointers[i] = 0;
+                }
+            }
+        }
+        free(it->second);
+    }
+}
+
+/**
+ * Decompress the block pointer names into data. scratch holds the tail
+ * block last read, *scratch_block its number (0 for none), so a run of
+ * compressed blocks reads each tail block once.
+ **/
+bool FileSystem::readCompressed(uint32_t pointer, char* data, Block& scratch, uint32_t* scratch_block) {
+    TailMap tail = pointerTail(pointer);
+    if(tail.block == 0 || tail.block >= meta_data_.blocks || tail.count == 0 ||
+       tail.slot + tail.count > TAIL_SLOTS) {
+        return false;
+    }
+    if(*scratch_block != tail.block) {
+        if(disk_->read(tail.block, scratch.data) != Disk::BLOCK_SIZE) {
+            return false;
+        }
+        *scratch_block = tail.block;
+    }
+    const unsigned char* slots = (const unsigned char*)scratch.data + tail.slot * TAIL_SLOT;
+    size_t length = slots[0] | (slots[1] << 8);
+    if(length + 2 > tail.count * TAIL_SLOT) {
+        return false;
+    }
+    uint64_t start = Stats::now();
+    ssize_t bytes = LZ::decompress((const char*)slots + 2, length, data, Disk::BLOCK_SIZE);
+    stats_.decoded(Disk::BLOCK_SIZE, Stats::now() - start);
+    return bytes == (ssize_t)Disk::BLOCK_SIZE;
+}
+
+/**
+ * Queue what a block pointer held for release: its block into run, see
+ * releaseBlock(), or its slots.
+ **/
+void FileSystem::releasePointer(Run& run, uint32_t pointer) {
+    if(!compressedPointer(pointer)) {
+        releaseBlock(run, pointer);
+        return;
+    }
+    MutexLock guard(&tail_lock_);
+    retireTail(pointerTail(pointer));
+}
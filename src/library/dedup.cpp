@@ -0,0 +1,417 @@
+#include "fs.h"
+#include "lock.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Data blocks on FEATURE_DEDUP images. When a buffered block is written
+ * back, its fingerprint is looked up in index_; if a block with the same
+ * fingerprint holds the same bytes, the file points at that block and
+ * nothing is written. Otherwise the block is written as usual and goes
+ * into the index.
+ *
+ * refs_ counts the pointers to every block, from inodes and pointer
+ * blocks. It is not stored on disk but rebuilt at mount by walking every
+ * file. A block with more than one pointer is never written in place: a
+ * write to it gets a new block and drops one reference. A clone shares
+ * pointer blocks as well; what a shared pointer block points to counts
+ * it once, however many files reach it. With a journal a
+ * dropped reference, like a freed block, only counts after the next
+ * commit, so a crash cannot leave the old metadata sharing a block that
+ * was overwritten since.
+ *
+ * The index only names blocks whose content stays as it is: a block
+ * leaves it before it is written in place and when its last reference
+ * goes. unmount() stores it in the index region and mount() loads it
+ * again if the image was unmounted cleanly; otherwise it starts empty.
+ * Either way an equal fingerprint is only a hint, the content decides.
+ **/
+
+static uint64_t fingerprint(const char* data) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+    for(size_t i = 0; i < Disk::BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/**
+ * Whether a write may change block in place. Without FEATURE_DEDUP it
+ * always may, with it only while the block has no other reference, and
+ * then the block leaves the index so nobody starts sharing it.
+ **/
+bool FileSystem::ownBlock(uint32_t block) {
+    if(!(meta_data_.features & FEATURE_DEDUP) || block == 0 || block >= meta_data_.blocks) {
+        return true;
+    }
+    MutexLock guard(&alloc_lock_);
+    if(refs_[block] > 1) {
+        return false;
+    }
+    unindexBlock(block);
+    return true;
+}
+
+/**
+ * Drop a reference to block at depth, 0 for a data block, else the levels
+ * of pointer blocks from it down (1 for an indirect block). True when it
+ * was the last one: the references a pointer block held are dropped as
+ * well and the caller frees block, see releaseBlock().
+ **/
+bool FileSystem::dropRef(Run& run, uint32_t block, size_t depth) {
+    if(block >= meta_data_.blocks) {
+        return true;
+    }
+    {
+        MutexLock guard(&alloc_lock_);
+        if(refs_[block] > 1) {
+            if(meta_data_.features & FEATURE_JOURNAL) {
+                RetiredRef retired = {block, (uint32_t)depth};
+                retired_refs_.push_back(retired);
+            }else {
+                refs_[block]--;
+            }
+            return false;
+        }
+        refs_[block] = 0;
+        unindexBlock(block);
+    }
+    if(depth > 0) {
+        releaseChildren(run, block, depth);
+    }
+    return true;
+}
+
+/**
+ * Drop the references the pointer block at depth holds.
+ **/
+void FileSystem::releaseChildren(Run& run, uint32_t block, size_t depth) {
+    Block pointer_block;
+    if(!readMeta(block, pointer_block.data)) {
+        // what it points to stays allocated until the bitmap is rebuilt
+        printf("Failed to read pointer block %u\n", block);
+        return;
+    }
+    for(uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+        if(pointer_block.pointers[i] != 0) {
+            releaseBlock(run, pointer_block.pointers[i], depth - 1);
+        }
+    }
+}
+
+/**
+ * Count the references dropped since the last commit, retiring blocks
+ * that had no other. A pointer block that goes drops what it points to,
+ * shared blocks among them come round again. Caller holds the file
+ * system lock exclusively and calls releaseRetired() next.
+ **/
+void FileSystem::releaseRetiredRefs() {
+    Run run = {0, 0};
+    for(;;) {
+        std::vector<RetiredRef> retired;
+        {
+            MutexLock guard(&alloc_lock_);
+            retired.swap(retired_refs_);
+        }
+        if(retired.empty()) {
+            break;
+        }
+        for(size_t i = 0; i < retired.size(); ++i) {
+            bool last;
+            {
+                MutexLock guard(&alloc_lock_);
+                last = refs_[retired[i].block] <= 1;
+                if(last) {
+                    refs_[retired[i].block] = 0;
+                    unindexBlock(retired[i].block);
+                }else {
+                    refs_[retired[i].block]--;
+                }
+            }
+            if(last) {
+                if(retired[i].depth > 0) {
+                    releaseChildren(run, retired[i].block, retired[i].depth);
+                }
+                retireBlocks(retired[i].block, 1);
+            }
+        }
+    }
+    releaseBlock(run, 0);
+}
+
+/**
+ * Take another reference to each of count blocks, skipping 0s, for a
+ * copy of the pointers to them. Fails, taking none, when one of them has
+ * MAX_REFS already.
+ **/
+bool FileSystem::shareBlocks(const uint32_t* blocks, size_t count) {
+    MutexLock guard(&alloc_lock_);
+    for(size_t i = 0; i < count; ++i) {
+        if(blocks[i] != 0 && blocks[i] < meta_data_.blocks && refs_[blocks[i]] >= MAX_REFS) {
+            return false;
+        }
+    }
+    for(size_t i = 0; i < count; ++i) {
+        if(blocks[i] != 0 && blocks[i] < meta_data_.blocks) {
+            refs_[blocks[i]]++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Make a new inode with the content of inode_number that shares its
+ * blocks: the direct blocks and the roots of its pointer trees gain a
+ * reference, nothing below them is read or written. Whichever file is
+ * written later copies the blocks on the way, see mapBlocks(). A packed
+ * file has no blocks and is copied.
+ **/
+ssize_t FileSystem::cloneFile(size_t inode_number) {
+    if(!disk_ || !inodes_ || inode_number >= meta_data_.inodes) {
+        return -1;
+    }
+    // legacy inodes have no flags to keep INODE_SHARED in
+    if(!(meta_data_.features & FEATURE_DEDUP) || !(meta_data_.features & FEATURE_LARGE_FILES)) {
+        printf("Clones need an image formatted with dedup.\n");
+        return -1;
+    }
+    ssize_t clone = createFile();
+    if(clone < 0) {
+        return -1;
+    }
+    // a source that is not there leaves its inode to create()
+    if((size_t)clone == inode_number) {
+        removeFile(clone);
+        return -1;
+    }
+    bool ok = false;
+    {
+        ReadLock fs_guard(&fs_lock_);
+        // inode locks are taken in inode order
+        WriteLock first_guard(&inode_locks_[std::min(inode_number, (size_t)clone)]);
+        WriteLock second_guard(&inode_locks_[std::max(inode_number, (size_t)clone)]);
+        Inode* source = &inodes_[inode_number];
+        Inode* target = &inodes_[clone];
+        // what is buffered goes to disk first, the clone shares what is there
+        if(source->valid == 1 && (!open_files_[inode_number] || flushInode(inode_number))) {
+            if(source->flags & INODE_INLINE) {
+                *target = *source;
+                ok = true;
+            }else if(source->flags & INODE_TAIL) {
+                Block block;
+                target->size = source->size;
+                ok = loadPacked(inode_number, block.data) && packInode(clone, block.data);
+            }else {
+                uint32_t roots[POINTERS_PER_INODE + 3];
+                memcpy(roots, source->direct, sizeof(source->direct));
+                roots[POINTERS_PER_INODE]     = source->indirect;
+                roots[POINTERS_PER_INODE + 1] = source->double_indirect;
+                roots[POINTERS_PER_INODE + 2] = source->triple_indirect;
+                ok = shareBlocks(roots, POINTERS_PER_INODE + 3);
+                if(ok) {
+                    source->flags  |= INODE_SHARED;
+                    target->flags   = source->flags;
+                    target->size    = source->size;
+                    memcpy(target->direct, source->direct, sizeof(source->direct));
+                    target->indirect        = source->indirect;
+                    target->double_indirect = source->double_indirect;
+                    target->triple_indirect = source->triple_indirect;
+                    dirtyInode(inode_number);
+                }else {
+                    printf("Inode %lu has too many clones.\n", inode_number);
+                }
+            }
+            dirtyInode(clone);
+        }
+    }
+    if(!ok) {
+        removeFile(clone);
+        return -1;
+    }
+    return clone;
+}
+
+/**
+ * Look count buffered blocks up in the index. pointers[i] gets a block
+ * already holding the content of bufs[i], with a reference taken for it,
+ * or 0 if it has to be written. fingerprints[i] gets its fingerprint for
+ * indexBlocks().
+ **/
+void FileSystem::dedupBlocks(char* const* bufs, size_t count, uint32_t* pointers, uint64_t* fingerprints) {
+    Block block;
+    size_t shared = 0;
+    for(size_t i = 0; i < count; ++i) {
+        pointers[i]     = 0;
+        fingerprints[i] = fingerprint(bufs[i]);
+        uint32_t candidate = 0;
+        {
+            MutexLock guard(&alloc_lock_);
+            std::unordered_map<uint64_t, uint32_t>::iterator it = index_.find(fingerprints[i]);
+            if(it != index_.end() && refs_[it->second] > 0 && refs_[it->second] < MAX_REFS) {
+                candidate = it->second;
+                refs_[candidate]++;
+            }
+        }
+        if(candidate == 0) {
+            continue;
+        }
+        // the reference keeps the block from being written in place meanwhile
+        if(disk_->read(candidate, block.data) == Disk::BLOCK_SIZE &&
+           memcmp(block.data, bufs[i], Disk::BLOCK_SIZE) == 0) {
+            pointers[i] = candidate;
+            shared++;
+            continue;
+        }
+        Run run = {0, 0};
+        releaseBlock(run, candidate);
+        releaseBlock(run, 0);
+    }
+    stats_.deduplicated(count, shared);
+}
+
+/**
+ * Enter blocks just written with the given content into the index,
+ * unless another block has it already.
+ **/
+void FileSystem::indexBlocks(const size_t* blocks, const uint64_t* fingerprints, size_t count) {
+    MutexLock guard(&alloc_lock_);
+    for(size_t i = 0; i < count; ++i) {
+        uint32_t block = (uint32_t)blocks[i];
+        if(block == 0 || block >= meta_data_.blocks || refs_[block] != 1 || index_.count(fingerprints[i])) {
+            continue;
+        }
+        unindexBlock(block);
+        index_[fingerprints[i]] = block;
+        indexed_[block] = fingerprints[i];
+    }
+}
+
+/**
+ * Take block out of the index. Caller holds alloc_lock_.
+ **/
+void FileSystem::unindexBlock(uint32_t block) {
+    std::unordered_map<uint32_t, uint64_t>::iterator it = indexed_.find(block);
+    if(it == indexed_.end()) {
+        return;
+    }
+    std::unordered_map<uint64_t, uint32_t>::iterator entry = index_.find(it->second);
+    if(entry != index_.end() && entry->second == block) {
+        index_.erase(entry);
+    }
+    indexed_.erase(it);
+}
+
+/**
+ * Count the references below a pointer at depth (0 = data block, 1 =
+ * indirect, 2 = double, 3 = triple indirect) into refs_, marking data
+ * blocks in data_blocks.
+ **/
+bool FileSystem::countRefs(uint32_t block, size_t depth, std::vector<bool>& data_blocks) {
+    if(block == 0 || block >= meta_data_.blocks) {
+        return true;
+    }
+    bool counted = refs_[block] > 0;
+    if(refs_[block] < MAX_REFS) {
+        refs_[block]++;
+    }
+    if(depth == 0) {
+        data_blocks[block] = true;
+        return true;
+    }
+    // a pointer block shared with a clone holds its references once
+    if(counted) {
+        return true;
+    }
+    Block pointer_block;
+    if(!readMeta(block, pointer_block.data)) {
+        return false;
+    }
+    for(uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+        if(!countRefs(pointer_block.pointers[i], depth - 1, data_blocks)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Rebuild refs_ from every file and, after a clean unmount, load the
+ * index stored by storeIndex(). Entries not naming a data block are
+ * dropped.
+ **/
+bool FileSystem::loadRefs(bool clean) {
+    MutexLock guard(&alloc_lock_);
+    refs_.assign(meta_data_.blocks, 0);
+    retired_refs_.clear();
+    index_.clear();
+    indexed_.clear();
+    std::vector<bool> data_blocks(meta_data_.blocks);
+    for(uint32_t n = 0; n < meta_data_.inodes; ++n) {
+        Inode* inode = &inodes_[n];
+        if(inode->valid != 1 || packed(inode)) {
+            continue;
+        }
+        for(uint32_t i = 0; i < POINTERS_PER_INODE; ++i) {
+            if(!countRefs(inode->direct[i], 0, data_blocks)) {
+                return false;
+            }
+        }
+        if(!countRefs(inode->indirect, 1, data_blocks) ||
+           !countRefs(inode->double_indirect, 2, data_blocks) ||
+           !countRefs(inode->triple_indirect, 3, data_blocks)) {
+            return false;
+        }
+    }
+
+    if(!clean || meta_data_.index_entries > meta_data_.index_blocks * INDEX_ENTRIES_PER_BLOCK) {
+        return true;
+    }
+    Block block;
+    for(uint32_t i = 0; i < meta_data_.index_entries; ++i) {
+        if(i % INDEX_ENTRIES_PER_BLOCK == 0 &&
+           disk_->read(indexStart() + i / INDEX_ENTRIES_PER_BLOCK, block.data) != Disk::BLOCK_SIZE) {
+            index_.clear();
+            indexed_.clear();
+            return true;
+        }
+        const IndexEntry& entry = block.index[i % INDEX_ENTRIES_PER_BLOCK];
+        if(entry.block < meta_data_.blocks && data_blocks[entry.block] && !index_.count(entry.fingerprint) &&
+           !indexed_.count(entry.block)) {
+            index_[entry.fingerprint] = entry.block;
+            indexed_[entry.block] = entry.fingerprint;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write the index to the index region and record how many entries it
+ * holds, for mount() after unmount() marks the image clean.
+ **/
+bool FileSystem::storeIndex() {
+    meta_data_.index_entries = 0;
+    Block block = {0};
+    uint32_t count = 0;
+    uint32_t capacity = meta_data_.index_blocks * INDEX_ENTRIES_PER_BLOCK;
+    MutexLock guard(&alloc_lock_);
+    for(std::unordered_map<uint64_t, uint32_t>::iterator it = index_.begin(); it != index_.end() && count < capacity; ++it) {
+        IndexEntry& entry = block.index[count % INDEX_ENTRIES_PER_BLOCK];
+        entry.fingerprint = it->first;
+        entry.block       = it->second;
+        entry.spare       = 0;
+        count++;
+        if(count % INDEX_ENTRIES_PER_BLOCK == 0 || count == index_.size() || count == capacity) {
+            if(disk_->write(indexStart() + (count - 1) / INDEX_ENTRIES_PER_BLOCK, block.data) != Disk::BLOCK_SIZE) {
+                printf("Failed to write index block.\n");
+                return false;
+            }
+            memset(block.data, 0, Disk::BLOCK_SIZE);
+        }
+    }
+    meta_data_.index_entries = count;
+    return true;
+}
@@ -0,0 +1,483 @@
+#include "fs.h"
+#include "lock.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * A directory is an inode whose data is an extendible hash of its names:
+ *
+ *   block 0                      DirHeader
+ *   blocks 1 .. DIR_TABLE_BLOCKS slot table, 2^depth bucket numbers
+ *   block DIR_FIRST_BUCKET + n   bucket n
+ *
+ * A name goes to the bucket its table slot, the low depth bits of its
+ * hash, points to. A full bucket is split in two on the next hash bit,
+ * doubling the table first when the bucket already uses every bit the
+ * table has. Finding, adding or removing a name therefore reads the
+ * header, one table block and one bucket however large the directory
+ * is. An empty inode is an empty directory, so the root made by
+ * format() needs nothing written until its first name.
+ *
+ * Whether a name refers to a directory is kept in its entry, the inode
+ * itself does not know, which works on every inode format. All directory
+ * I/O goes through readFile() and writeFile(), read() and write() minus
+ * the statistics, and takes the per-inode locks there; names_lock_ only
+ * keeps name changes from racing each other.
+ **/
+
+/**
+ * FNV-1a of name.
+ **/
+uint32_t FileSystem::nameHash(const std::string& name) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < name.size(); ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Read directory block file_block, a hole or a block past the end reads
+ * as zeros.
+ **/
+bool FileSystem::readDirBlock(size_t dir, size_t file_block, Block& block) {
+    ssize_t result = readFile(dir, block.data, Disk::BLOCK_SIZE, file_block * Disk::BLOCK_SIZE);
+    if(result < 0) {
+        return false;
+    }
+    memset(block.data + result, 0, Disk::BLOCK_SIZE - result);
+    return true;
+}
+
+bool FileSystem::writeDirBlock(size_t dir, size_t file_block, Block& block) {
+    return writeFile(dir, block.data, Disk::BLOCK_SIZE, file_block * Disk::BLOCK_SIZE) == (ssize_t)Disk::BLOCK_SIZE;
+}
+
+/**
+ * Read the header of dir. Returns 1 when it is there, 0 for an empty
+ * directory and -1 on error. With create an empty directory gets its
+ * header, table and first bucket and 1 is returned.
+ **/
+int FileSystem::loadDirHeader(size_t dir, Block& header, bool create) {
+    ssize_t size = statFile(dir);
+    if(size < 0) {
+        return -1;
+    }
+    if(size == 0 && !create) {
+        return 0;
+    }
+    if(size == 0) {
+        Block block = {0};
+        block.bucket.depth = 0;
+        if(!writeDirBlock(dir, DIR_FIRST_BUCKET, block)) {
+            return -1;
+        }
+        // slot 0 points to bucket 0
+        memset(block.data, 0, sizeof(block.data));
+        if(!writeDirBlock(dir, 1, block)) {
+            return -1;
+        }
+        header = (Block){0};
+        header.dir.magic   = DIR_MAGIC;
+        header.dir.buckets = 1;
+        return writeDirBlock(dir, 0, header) ? 1 : -1;
+    }
+    if(!readDirBlock(dir, 0, header)) {
+        return -1;
+    }
+    if(header.dir.magic != DIR_MAGIC || header.dir.depth > DIR_MAX_DEPTH) {
+        printf("Inode %lu is not a directory\n", dir);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Table slot of hash and the bucket it points to.
+ **/
+bool FileSystem::findBucket(size_t dir, const Block& header, uint32_t hash, uint32_t* slot, uint32_t* bucket) {
+    Block table;
+    *slot = hash & ((1u << header.dir.depth) - 1);
+    if(!readDirBlock(dir, 1 + *slot / POINTERS_PER_BLOCK, table)) {
+        return false;
+    }
+    *bucket = table.pointers[*slot % POINTERS_PER_BLOCK];
+    if(*bucket >= header.dir.buckets) {
+        printf("Directory %lu has a bad bucket table\n", dir);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Inode that name refers to in dir, -1 if there is none.
+ **/
+ssize_t FileSystem::dirLookup(size_t dir, const std::string& name, uint8_t* type) {
+    Block header;
+    if(loadDirHeader(dir, header, false) <= 0) {
+        return -1;
+    }
+    uint32_t hash = nameHash(name);
+    uint32_t slot, index;
+    Block bucket;
+    if(!findBucket(dir, header, hash, &slot, &index) ||
+       !readDirBlock(dir, DIR_FIRST_BUCKET + index, bucket)) {
+        return -1;
+    }
+    for(uint32_t i = 0; i < bucket.bucket.count && i < ENTRIES_PER_BUCKET; ++i) {
+        DirEntry* entry = &bucket.bucket.entries[i];
+        if(entry->hash == hash && entry->length == name.size() &&
+           memcmp(entry->name, name.data(), name.size()) == 0) {
+            *type = entry->type;
+            return entry->inode;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Split the full bucket index, found through slot, on its next hash bit.
+ * Names with the bit set move to a new bucket, and every slot that now
+ * selects them points there. bucket holds the content of index.
+ **/
+bool FileSystem::splitBucket(size_t dir, Block& header, uint32_t slot, uint32_t index, Block& bucket) {
+    uint32_t depth = bucket.bucket.depth;
+    if(depth == header.dir.depth) {
+        if(depth == DIR_MAX_DEPTH) {
+            printf("Directory %lu is full\n", dir);
+            return false;
+        }
+        // double the table, the upper half repeats the lower half
+        uint32_t slots = 1u << depth;
+        Block table;
+        for(uint32_t b = 0; b < (slots + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK; ++b) {
+            if(!readDirBlock(dir, 1 + b, table)) {
+                return false;
+            }
+            if(slots < POINTERS_PER_BLOCK) {
+                memcpy(&table.pointers[slots], table.pointers, slots * sizeof(uint32_t));
+                if(!writeDirBlock(dir, 1, table)) {
+                    return false;
+                }
+            } else if(!writeDirBlock(dir, 1 + b + slots / POINTERS_PER_BLOCK, table)) {
+                return false;
+            }
+        }
+        header.dir.depth++;
+    }
+
+    uint32_t bit = 1u << depth;
+    uint32_t fresh = header.dir.buckets;
+    Block moved = {0};
+    moved.bucket.depth  = depth + 1;
+    bucket.bucket.depth = depth + 1;
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < bucket.bucket.count; ++i) {
+        DirEntry& entry = bucket.bucket.entries[i];
+        if(entry.hash & bit) {
+            moved.bucket.entries[moved.bucket.count++] = entry;
+        } else {
+            bucket.bucket.entries[kept++] = entry;
+        }
+    }
+    memset(&bucket.bucket.entries[kept], 0, (bucket.bucket.count - kept) * sizeof(DirEntry));
+    bucket.bucket.count = kept;
+    if(!writeDirBlock(dir, DIR_FIRST_BUCKET + fresh, moved) ||
+       !writeDirBlock(dir, DIR_FIRST_BUCKET + index, bucket)) {
+        return false;
+    }
+
+    // slots ending in the bucket's old bits plus the new bit, one table
+    // block at a time
+    Block table;
+    size_t loaded = 0;
+    for(uint32_t s = (slot & (bit - 1)) | bit; s < (1u << header.dir.depth); s += bit << 1) {
+        size_t file_block = 1 + s / POINTERS_PER_BLOCK;
+        if(file_block != loaded) {
+            if(loaded != 0 && !writeDirBlock(dir, loaded, table)) {
+                return false;
+            }
+            if(!readDirBlock(dir, file_block, table)) {
+                return false;
+            }
+            loaded = file_block;
+        }
+        table.pointers[s % POINTERS_PER_BLOCK] = fresh;
+    }
+    if(loaded != 0 && !writeDirBlock(dir, loaded, table)) {
+        return false;
+    }
+    header.dir.buckets++;
+    return writeDirBlock(dir, 0, header);
+}
+
+/**
+ * Add name to dir, fails if it is already there.
+ **/
+bool FileSystem::dirInsert(size_t dir, const std::string& name, size_t inode_number, uint8_t type) {
+    Block header;
+    if(loadDirHeader(dir, header, true) <= 0) {
+        return false;
+    }
+    uint32_t hash = nameHash(name);
+    while(true) {
+        uint32_t slot, index;
+        Block bucket;
+        if(!findBucket(dir, header, hash, &slot, &index) ||
+           !readDirBlock(dir, DIR_FIRST_BUCKET + index, bucket)) {
+            return false;
+        }
+        for(uint32_t i = 0; i < bucket.bucket.count; ++i) {
+            DirEntry* entry = &bucket.bucket.entries[i];
+            if(entry->hash == hash && entry->length == name.size() &&
+               memcmp(entry->name, name.data(), name.size()) == 0) {
+                return false;
+            }
+        }
+        if(bucket.bucket.count < ENTRIES_PER_BUCKET) {
+            DirEntry* entry = &bucket.bucket.entries[bucket.bucket.count++];
+            memset(entry, 0, sizeof(DirEntry));
+            entry->inode  = inode_number;
+            entry->hash   = hash;
+            entry->type   = type;
+            entry->length = name.size();
+            memcpy(entry->name, name.data(), name.size());
+            header.dir.entries++;
+            return writeDirBlock(dir, DIR_FIRST_BUCKET + index, bucket) &&
+                   writeDirBlock(dir, 0, header);
+        }
+        if(!splitBucket(dir, header, slot, index, bucket)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Drop name from dir. Buckets are never merged, a directory keeps the
+ * size it once had.
+ **/
+bool FileSystem::dirRemove(size_t dir, const std::string& name) {
+    Block header;
+    if(loadDirHeader(dir, header, false) <= 0) {
+        return false;
+    }
+    uint32_t hash = nameHash(name);
+    uint32_t slot, index;
+    Block bucket;
+    if(!findBucket(dir, header, hash, &slot, &index) ||
+       !readDirBlock(dir, DIR_FIRST_BUCKET + index, bucket)) {
+        return false;
+    }
+    DirBucket* b = &bucket.bucket;
+    for(uint32_t i = 0; i < b->count && i < ENTRIES_PER_BUCKET; ++i) {
+        DirEntry* entry = &b->entries[i];
+        if(entry->hash == hash && entry->length == name.size() &&
+           memcmp(entry->name, name.data(), name.size()) == 0) {
+            // keep the entries packed, the last one fills the hole
+            *entry = b->entries[--b->count];
+            memset(&b->entries[b->count], 0, sizeof(DirEntry));
+            header.dir.entries--;
+            return writeDirBlock(dir, DIR_FIRST_BUCKET + index, bucket) &&
+                   writeDirBlock(dir, 0, header);
+        }
+    }
+    return false;
+}
+
+/**
+ * Walk path from the root. With leaf, the last component is not looked
+ * up but returned there, and the result is the directory that should
+ * hold it. Caller holds names_lock_.
+ **/
+ssize_t FileSystem::resolve(const char* path, std::string* leaf, uint8_t* type) {
+    if(!disk_ || !inodes_ || !path) {
+        return -1;
+    }
+    std::vector<std::string> parts;
+    for(const char* p = path; *p; ) {
+        const char* end = strchr(p, '/');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if(length > NAME_LENGTH) {
+            printf("Name too long in %s\n", path);
+            return -1;
+        }
+        if(length > 0) {
+            parts.push_back(std::string(p, length));
+        }
+        p += end ? length + 1 : length;
+    }
+    if(leaf) {
+        if(parts.empty()) {
+            return -1;
+        }
+        *leaf = parts.back();
+        parts.pop_back();
+    }
+
+    size_t current = 0;
+    uint8_t current_type = TYPE_DIRECTORY;
+    for(size_t i = 0; i < parts.size(); ++i) {
+        if(current_type != TYPE_DIRECTORY) {
+            return -1;
+        }
+        std::string key = std::to_string(current) + '/' + parts[i];
+        pthread_mutex_lock(&dentry_lock_);
+        std::unordered_map<std::string, Dentry>::iterator it = dentries_.find(key);
+        bool cached = it != dentries_.end();
+        if(cached) {
+            current      = it->second.inode;
+            current_type = it->second.type;
+        }
+        pthread_mutex_unlock(&dentry_lock_);
+        if(cached) {
+            continue;
+        }
+        ssize_t found = dirLookup(current, parts[i], &current_type);
+        if(found < 0) {
+            return -1;
+        }
+        current = found;
+        MutexLock guard(&dentry_lock_);
+        if(dentries_.size() >= DENTRY_CACHE_MAX) {
+            dentries_.clear();
+        }
+        dentries_[key] = (Dentry){(uint32_t)current, current_type};
+    }
+    if(leaf && current_type != TYPE_DIRECTORY) {
+        return -1;
+    }
+    if(type) {
+        *type = current_type;
+    }
+    return (ssize_t)current;
+}
+
+/**
+ * Inode that path refers to, -1 if it does not exist.
+ **/
+ssize_t FileSystem::lookup(const char* path) {
+    TraceCall call(trace_, Trace::OP_LOOKUP, 0, 0, 0, path);
+    ReadLock names_guard(&names_lock_);
+    return call.done(resolve(path, nullptr, nullptr));
+}
+
+ssize_t FileSystem::makeName(const char* path, uint8_t type, ssize_t source) {
+    WriteLock names_guard(&names_lock_);
+    std::string name;
+    ssize_t dir = resolve(path, &name, nullptr);
+    if(dir < 0) {
+        return -1;
+    }
+    uint8_t existing;
+    if(dirLookup(dir, name, &existing) >= 0) {
+        return -1;
+    }
+    ssize_t inode_number = source < 0 ? create() : clone(source);
+    if(inode_number < 0) {
+        return -1;
+    }
+    if(!dirInsert(dir, name, inode_number, type)) {
+        remove(inode_number);
+        return -1;
+    }
+    return inode_number;
+}
+
+/**
+ * Create an empty file at path, whose directory must exist.
+ **/
+ssize_t FileSystem::mkfile(const char* path) {
+    TraceCall call(trace_, Trace::OP_MKFILE, 0, 0, 0, path);
+    return call.done(makeName(path, TYPE_FILE));
+}
+
+ssize_t FileSystem::mkdir(const char* path) {
+    TraceCall call(trace_, Trace::OP_MKDIR, 0, 0, 0, path);
+    return call.done(makeName(path, TYPE_DIRECTORY));
+}
+
+/**
+ * Clone inode_number, see clone(size_t), and name the clone path.
+ **/
+ssize_t FileSystem::clone(size_t inode_number, const char* path) {
+    TraceCall call(trace_, Trace::OP_CLONE, inode_number, 0, 0, path);
+    return call.done(makeName(path, TYPE_FILE, inode_number));
+}
+
+/**
+ * Remove the file or empty directory at path together with its inode.
+ * Fails while the inode is open.
+ **/
+bool FileSystem::unlink(const char* path) {
+    TraceCall call(trace_, Trace::OP_UNLINK, 0, 0, 0, path);
+    bool ok = unlinkName(path);
+    call.done(ok ? 0 : -1);
+    return ok;
+}
+
+bool FileSystem::unlinkName(const char* path) {
+    WriteLock names_guard(&names_lock_);
+    std::string name;
+    ssize_t dir = resolve(path, &name, nullptr);
+    if(dir < 0) {
+        return false;
+    }
+    uint8_t type;
+    ssize_t inode_number = dirLookup(dir, name, &type);
+    if(inode_number < 0) {
+        return false;
+    }
+    if(type == TYPE_DIRECTORY) {
+        Block header;
+        int loaded = loadDirHeader(inode_number, header, false);
+        if(loaded < 0 || (loaded > 0 && header.dir.entries > 0)) {
+            return false;
+        }
+    }
+    // the inode goes first, an open one keeps its name too
+    if(!remove(inode_number) || !dirRemove(dir, name)) {
+        return false;
+    }
+    MutexLock guard(&dentry_lock_);
+    dentries_.erase(std::to_string(dir) + '/' + name);
+    return true;
+}
+
+/**
+ * All names in the directory at path, in hash order.
+ **/
+bool FileSystem::list(const char* path, std::vector<Name>& names) {
+    TraceCall call(trace_, Trace::OP_LIST, 0, 0, 0, path);
+    bool ok = listNames(path, names);
+    call.done(ok ? (ssize_t)names.size() : -1);
+    return ok;
+}
+
+bool FileSystem::listNames(const char* path, std::vector<Name>& names) {
+    ReadLock names_guard(&names_lock_);
+    names.clear();
+    uint8_t type;
+    ssize_t dir = resolve(path, nullptr, &type);
+    if(dir < 0 || type != TYPE_DIRECTORY) {
+        return false;
+    }
+    Block header;
+    int loaded = loadDirHeader(dir, header, false);
+    if(loaded <= 0) {
+        return loaded == 0;
+    }
+    for(uint32_t n = 0; n < header.dir.buckets; ++n) {
+        Block bucket;
+        if(!readDirBlock(dir, DIR_FIRST_BUCKET + n, bucket)) {
+            return false;
+        }
+        for(uint32_t i = 0; i < bucket.bucket.count && i < ENTRIES_PER_BUCKET; ++i) {
+            DirEntry* entry = &bucket.bucket.entries[i];
+            Name name = {std::string(entry->name, entry->length), entry->inode,
+                         entry->type == TYPE_DIRECTORY};
+            names.push_back(name);
+        }
+    }
+    return true;
+}
@@ -1,19 +1,35 @@
 #include "disk.h"
+#include "lock.h"
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <vector>
+#include <algorithm>
 
 Disk::Disk() {
     file_descriptor_ = -1;
     blocks_ = 0;           
     reads_  = 0;
     writes_ = 0;
+    hits_      = 0;
+    misses_    = 0;
+    evictions_ = 0;
+    readahead_ = 0;
+    readahead_hits_ = 0;
+    syncs_ = 0;
+    map_       = nullptr;
+    direct_    = false;
+    pthread_mutex_init(&lock_, nullptr);
 }
 
 Disk::~Disk() {
     close();
+    pthread_mutex_destroy(&lock_);
 }
 
 bool Disk::disk_sanity_check(size_t block, const char *data) {
@@ -28,11 +44,23 @@ bool Disk::disk_sanity_check(size_t block, const char *data) {
     return true;
 }
 
-bool Disk::open(const char *path, size_t blocks) {
+bool Disk::open(const char *path, size_t blocks, size_t cache_blocks, int flags) {
     if(!path || blocks == 0)
         return false;
     
-    file_descriptor_ = ::open(path, O_RDWR|O_CREAT, 0644);
+    direct_ = false;
+    if((flags & OPEN_DIRECT) && !(flags & OPEN_MMAP)) {
+        file_descriptor_ = ::open(path, O_RDWR|O_CREAT|O_DIRECT, 0644);
+        if(file_descriptor_ >= 0) {
+            direct_ = true;
+        }else if(errno == EINVAL) {
+            // file systems such as tmpfs refuse O_DIRECT
+            printf("O_DIRECT unsupported for %s, using buffered I/O\n", path);
+        }
+    }
+    if(!direct_) {
+        file_descriptor_ = ::open(path, O_RDWR|O_CREAT, 0644);
+    }
     if(file_descriptor_ < 0) {
         printf("Failed to open %s - %s\n", path, strerror(errno));
         return false;
@@ -44,36 +72,515 @@ bool Disk::open(const char *path, size_t blocks) {
         return false;
     }
 
+    if(flags & OPEN_MMAP) {
+        void* map = mmap(nullptr, blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor_, 0);
+        if(map == MAP_FAILED) {
+            printf("Failed to mmap - %s\n", strerror(errno));
+            ::close(file_descriptor_);
+            file_descriptor_ = -1;
+            return false;
+        }
+        map_ = (char*)map;
+        // the mapping is served by the page cache, a second copy is useless
+        cache_blocks = 0;
+    }else if(flags & OPEN_URING) {
+        // without io_uring multi-block requests simply stay synchronous
+        if(not ring_.init(file_descriptor_, URING_ENTRIES)) {
+            printf("io_uring unavailable, using synchronous I/O\n");
+        }
+    }
+
+    // never cache more blocks than the image has
+    if(cache_blocks > blocks)
+        cache_blocks = blocks;
+    if(not cache_.init(cache_blocks, BLOCK_SIZE)) {
+        printf("Failed to allocate block cache\n");
+        return false;
+    }
+
     blocks_ = blocks;
     reads_  = 0;
     writes_ = 0;
+    hits_      = 0;
+    misses_    = 0;
+    evictions_ = 0;
+    readahead_ = 0;
+    readahead_hits_ = 0;
+    syncs_ = 0;
 
     return true;
 }
 
-void Disk::close() {
+void Disk::close(bool quiet) {
     if(file_descriptor_ > 0) {
-        printf("%lu disk block reads\n", reads_);
-    	printf("%lu disk block writes\n", writes_);
+        flush();
+        if(!quiet) {
+            printf("%lu disk block reads\n", reads_.load());
+            printf("%lu disk block writes\n", writes_.load());
+        }
+        if(!quiet && cache_.capacity() > 0) {
+            printf("%lu cache hits, %lu cache misses, %lu cache evictions\n",
+                   hits_.load(), misses_.load(), evictions_.load());
+        }
+        if(!quiet && readahead_ > 0) {
+            printf("%lu readahead blocks, %lu readahead hits\n", readahead_.load(), readahead_hits_.load());
+        }
+        if(!quiet && syncs_ > 0) {
+            printf("%lu disk syncs\n", syncs_.load());
+        }
+        if(map_) {
+            munmap(map_, blocks_ * BLOCK_SIZE);
+            map_ = nullptr;
+        }
+        ring_.release();
     	::close(file_descriptor_);
     	file_descriptor_ = 0;
     }
+    cache_.release();
+}
+
+/**
+ * Write every dirty cached block back to the image, in block order so
+ * the write-back is as sequential as the dirty set allows.
+ **/
+bool Disk::flush() {
+    MutexLock guard(&lock_);
+    std::vector<BlockCache::Frame*> dirty;
+    for(size_t i = 0; i < cache_.capacity(); ++i) {
+        BlockCache::Frame* f = cache_.frame(i);
+        if(f->used && f->dirty)
+            dirty.push_back(f);
+    }
+    std::sort(dirty.begin(), dirty.end(),
+              [](const BlockCache::Frame* a, const BlockCache::Frame* b) { return a->block < b->block; });
+
+    bool ok = true;
+    for(size_t i = 0; i < dirty.size(); ++i) {
+        if(writeBlock(dirty[i]->block, dirty[i]->data) != BLOCK_SIZE) {
+            ok = false;
+            continue;
+        }
+        dirty[i]->dirty = false;
+    }
+    return ok;
+}
+
+/**
+ * flush() and make everything written so far durable with one
+ * fdatasync, after the mapping is synced for a mapped image.
+ **/
+bool Disk::sync() {
+    bool ok = flush();
+    if(map_ && msync(map_, blocks_ * BLOCK_SIZE, MS_SYNC) != 0) {
+        ok = false;
+    }
+    if(fdatasync(file_descriptor_) != 0) {
+        printf("Failed to sync disk image: %s\n", strerror(errno));
+        ok = false;
+    }
+    syncs_++;
+    return ok;
+}
+
+/**
+ * Make blocks [start, start + count) read back as zeroes without writing
+ * them: cached copies are dropped and the range is punched out of the
+ * image. A range that reaches the end of the image can be truncated
+ * away instead; anything else falls back to writing zero blocks.
+ **/
+bool Disk::discard(size_t start, size_t count) {
+    if(start >= blocks_ || count > blocks_ - start) {
+        printf("Invalid discard range %lu+%lu\n", start, count);
+        return false;
+    }
+    MutexLock guard(&lock_);
+    for(size_t i = 0; i < cache_.capacity(); ++i) {
+        BlockCache::Frame* f = cache_.frame(i);
+        if(f->used && f->block >= start && f->block < start + count)
+            cache_.invalidate(f->block);
+    }
+
+    off_t offset = (off_t)start * BLOCK_SIZE;
+    off_t length = (off_t)count * BLOCK_SIZE;
+    if(fallocate(file_descriptor_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return true;
+    }
+    if(start + count == blocks_ &&
+       ftruncate(file_descriptor_, offset) == 0 &&
+       ftruncate(file_descriptor_, (off_t)blocks_ * BLOCK_SIZE) == 0) {
+        return true;
+    }
+
+    const size_t batch = 64;
+    void* mem = nullptr;
+    if(posix_memalign(&mem, BLOCK_SIZE, batch * BLOCK_SIZE) != 0) {
+        return false;
+    }
+    memset(mem, 0, batch * BLOCK_SIZE);
+    char* zero[batch];
+    for(size_t i = 0; i < batch; ++i) {
+        zero[i] = (char*)mem + i * BLOCK_SIZE;
+    }
+    bool ok = true;
+    for(size_t b = start; ok && b < start + count; b += batch) {
+        size_t n = std::min(batch, start + count - b);
+        ok = writeRun(b, n, zero) == (ssize_t)(n * BLOCK_SIZE);
+    }
+    free(mem);
+    return ok;
+}
+
+/**
+ * Return the frame caching block, making room for it when it is not cached.
+ * The least recently used frame is written back first if it is dirty.
+ * With fill the block is read from the image, otherwise the frame is left
+ * for the caller to overwrite completely. Caller holds lock_.
+ **/
+BlockCache::Frame* Disk::cacheFrame(size_t block, bool fill) {
+    BlockCache::Frame* f = cache_.lookup(block);
+    if(f) {
+        hits_++;
+        if(f->prefetched) {
+            readahead_hits_++;
+            f->prefetched = false;
+        }
+        return f;
+    }
+    misses_++;
+
+    f = claimFrame(block);
+    if(!f) {
+        return nullptr;
+    }
+    if(fill && readBlock(block, f->data) != BLOCK_SIZE) {
+        cache_.invalidate(block);
+        return nullptr;
+    }
+    return f;
+}
+
+/**
+ * Reuse the least recently used frame for block, writing it back first
+ * when it is dirty. Caller holds lock_.
+ **/
+BlockCache::Frame* Disk::claimFrame(size_t block) {
+    BlockCache::Frame* v = cache_.victim();
+    if(v->used) {
+        if(v->dirty && writeBlock(v->block, v->data) != BLOCK_SIZE) {
+            return nullptr;
+        }
+        evictions_++;
+    }
+    return cache_.insert(block);
 }
 
 ssize_t Disk::read(size_t block, char *data) {
     if(not disk_sanity_check(block, data)) {
         return false;
     }
+    if(cache_.capacity() == 0) {
+        return readBlock(block, data);
+    }
+
+    MutexLock guard(&lock_);
+    BlockCache::Frame* f = cacheFrame(block, true);
+    if(!f) {
+        return -1;
+    }
+    memcpy(data, f->data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+ssize_t Disk::write(size_t block, char *data) {
+    if(not disk_sanity_check(block, data)) {
+        return false;
+    }
+    if(cache_.capacity() == 0) {
+        return writeBlock(block, data);
+    }
+
+    // whole block is overwritten, so a miss needs no read
+    MutexLock guard(&lock_);
+    BlockCache::Frame* f = cacheFrame(block, false);
+    if(!f) {
+        return -1;
+    }
+    memcpy(f->data, data, BLOCK_SIZE);
+    f->dirty = true;
+    return BLOCK_SIZE;
+}
+
+/**
+ * Read count consecutive blocks starting at start into data.
+ **/
+ssize_t Disk::readBlocks(size_t start, size_t count, char *data) {
+    std::vector<size_t> blocks(count);
+    std::vector<char*>  bufs(count);
+    for(size_t i = 0; i < count; ++i) {
+        blocks[i] = start + i;
+        bufs[i]   = data + i * BLOCK_SIZE;
+    }
+    return readv(blocks.data(), bufs.data(), count);
+}
+
+ssize_t Disk::writeBlocks(size_t start, size_t count, char *data) {
+    std::vector<size_t> blocks(count);
+    std::vector<char*>  bufs(count);
+    for(size_t i = 0; i < count; ++i) {
+        blocks[i] = start + i;
+        bufs[i]   = data + i * BLOCK_SIZE;
+    }
+    return writev(blocks.data(), bufs.data(), count);
+}
+
+/**
+ * Read blocks[i] into data[i] for every i. Cached blocks are copied from
+ * the cache; each run of consecutive uncached blocks is read with one
+ * preadv straight into the caller's buffers, without filling the cache.
+ **/
+ssize_t Disk::readv(const size_t *blocks, char *const *data, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        if(not disk_sanity_check(blocks[i], data[i])) {
+            return -1;
+        }
+    }
 
-    // Calculate the byte offset for the specified block
-    off_t offset = block * BLOCK_SIZE;
-    if(lseek(file_descriptor_, offset, SEEK_SET) < 0) {
-        printf("Error in lseek - %s\n", strerror(errno));
+    // cache hits are copied under the lock, the misses are read after
+    // dropping it
+    std::vector<IoRun> runs;
+    pthread_mutex_lock(&lock_);
+    size_t i = 0;
+    while(i < count) {
+        if(cache_.capacity() > 0) {
+            BlockCache::Frame* f = cache_.lookup(blocks[i]);
+            if(f) {
+                hits_++;
+                if(f->prefetched) {
+                    readahead_hits_++;
+                    f->prefetched = false;
+                }
+                memcpy(data[i], f->data, BLOCK_SIZE);
+                i++;
+                continue;
+            }
+        }
+        size_t n = 1;
+        while(i + n < count && n < IOV_MAX && blocks[i + n] == blocks[i] + n &&
+              !cache_.contains(blocks[i + n])) {
+            n++;
+        }
+        if(cache_.capacity() > 0) {
+            misses_ += n;
+        }
+        IoRun run = {blocks[i], n, i};
+        runs.push_back(run);
+        i += n;
+    }
+    pthread_mutex_unlock(&lock_);
+    if(not doRuns(false, runs, data)) {
         return -1;
     }
+    return (ssize_t)(count * BLOCK_SIZE);
+}
+
+/**
+ * Bring blocks into memory ahead of use. Runs of uncached blocks are read
+ * outside the lock and then inserted into the cache, unless a block got
+ * cached meanwhile. Without a block cache the host is asked to read ahead
+ * instead. The caller has to make sure nobody writes these blocks until
+ * prefetch() returns.
+ **/
+bool Disk::prefetch(const size_t *blocks, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        if(blocks[i] >= blocks_) {
+            return false;
+        }
+    }
 
+    // only what is not cached yet needs reading
+    std::vector<size_t> todo;
+    if(cache_.capacity() > 0) {
+        MutexLock guard(&lock_);
+        for(size_t i = 0; i < count; ++i) {
+            if(!cache_.contains(blocks[i]))
+                todo.push_back(blocks[i]);
+        }
+    }else {
+        todo.assign(blocks, blocks + count);
+    }
+    if(todo.empty()) {
+        return true;
+    }
+
+    std::vector<IoRun> runs;
+    for(size_t i = 0; i < todo.size(); ++i) {
+        if(!runs.empty() && todo[i] == runs.back().start + runs.back().count) {
+            runs.back().count++;
+        }else {
+            IoRun run = {todo[i], 1, i};
+            runs.push_back(run);
+        }
+    }
+
+    if(map_) {
+        for(size_t r = 0; r < runs.size(); ++r) {
+            madvise(map_ + runs[r].start * BLOCK_SIZE, runs[r].count * BLOCK_SIZE, MADV_WILLNEED);
+        }
+        return true;
+    }
+    if(cache_.capacity() == 0) {
+        for(size_t r = 0; r < runs.size() && !direct_; ++r) {
+            posix_fadvise(file_descriptor_, (off_t)runs[r].start * BLOCK_SIZE,
+                          (off_t)runs[r].count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+        }
+        return true;
+    }
+
+    void* mem = nullptr;
+    if(posix_memalign(&mem, BLOCK_SIZE, todo.size() * BLOCK_SIZE) != 0) {
+        return false;
+    }
+    char* buf = (char*)mem;
+    std::vector<char*> bufs(todo.size());
+    for(size_t i = 0; i < todo.size(); ++i) {
+        bufs[i] = buf + i * BLOCK_SIZE;
+    }
+    bool ok = true;
+    for(size_t r = 0; ok && r < runs.size(); ++r) {
+        ok = readRun(runs[r].start, runs[r].count, &bufs[runs[r].first]) == (ssize_t)(runs[r].count * BLOCK_SIZE);
+    }
+
+    MutexLock guard(&lock_);
+    for(size_t i = 0; ok && i < todo.size(); ++i) {
+        if(cache_.contains(todo[i])) {
+            continue;
+        }
+        BlockCache::Frame* f = claimFrame(todo[i]);
+        if(!f) {
+            ok = false;
+            break;
+        }
+        memcpy(f->data, bufs[i], BLOCK_SIZE);
+        f->prefetched = true;
+        readahead_++;
+    }
+    free(buf);
+    return ok;
+}
+
+/**
+ * Write data[i] to blocks[i] for every i, one pwritev per run of
+ * consecutive blocks. Cached copies are superseded and dropped.
+ **/
+ssize_t Disk::writev(const size_t *blocks, char *const *data, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        if(not disk_sanity_check(blocks[i], data[i])) {
+            return -1;
+        }
+    }
+
+    std::vector<IoRun> runs;
+    pthread_mutex_lock(&lock_);
+    size_t i = 0;
+    while(i < count) {
+        size_t n = 1;
+        while(i + n < count && n < IOV_MAX && blocks[i + n] == blocks[i] + n) {
+            n++;
+        }
+        for(size_t j = 0; j < n; ++j) {
+            cache_.invalidate(blocks[i + j]);
+        }
+        IoRun run = {blocks[i], n, i};
+        runs.push_back(run);
+        i += n;
+    }
+    pthread_mutex_unlock(&lock_);
+    if(not doRuns(true, runs, data)) {
+        return -1;
+    }
+    return (ssize_t)(count * BLOCK_SIZE);
+}
+
+/**
+ * Perform a list of runs. With io_uring every run becomes one vectored
+ * request and the whole list is submitted as one batch; otherwise, or if
+ * the ring fails, runs are done one after another with preadv/pwritev.
+ **/
+bool Disk::doRuns(bool write, const std::vector<IoRun>& runs, char *const *data) {
+    bool ring = runs.size() > 1 && ring_.ready();
+    for(size_t r = 0; ring && direct_ && r < runs.size(); ++r) {
+        for(size_t j = 0; j < runs[r].count; ++j) {
+            // unaligned buffers are bounced by the synchronous path
+            if(!isAligned(data[runs[r].first + j])) {
+                ring = false;
+                break;
+            }
+        }
+    }
+    if(ring) {
+        std::vector<Ring::Request> requests(runs.size());
+        std::vector<struct iovec>  iov;
+        size_t total = 0;
+        for(size_t r = 0; r < runs.size(); ++r) {
+            total += runs[r].count;
+        }
+        iov.resize(total);
+
+        size_t next = 0;
+        for(size_t r = 0; r < runs.size(); ++r) {
+            Ring::Request* req = &requests[r];
+            req->write  = write;
+            req->offset = (off_t)runs[r].start * BLOCK_SIZE;
+            req->iov    = &iov[next];
+            req->iovcnt = (unsigned)runs[r].count;
+            req->bytes  = runs[r].count * BLOCK_SIZE;
+            for(size_t j = 0; j < runs[r].count; ++j) {
+                iov[next].iov_base = data[runs[r].first + j];
+                iov[next].iov_len  = BLOCK_SIZE;
+                next++;
+            }
+        }
+        if(ring_.submit(requests.data(), requests.size())) {
+            if(write) writes_ += total;
+            else      reads_  += total;
+            return true;
+        }
+        // redo the batch synchronously, both directions are idempotent
+    }
+
+    for(size_t r = 0; r < runs.size(); ++r) {
+        ssize_t ret = write ? writeRun(runs[r].start, runs[r].count, data + runs[r].first)
+                            : readRun(runs[r].start, runs[r].count, data + runs[r].first);
+        if(ret < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Zero-copy access to a block of a mapped image. The pointer stays valid
+ * until close(); nullptr when the image is not mapped.
+ **/
+const char* Disk::view(size_t block) {
+    if(!map_ || block >= blocks_) {
+        return nullptr;
+    }
+    reads_++;
+    return map_ + block * BLOCK_SIZE;
+}
+
+ssize_t Disk::readBlock(size_t block, char *data) {
+    if(map_) {
+        memcpy(data, map_ + block * BLOCK_SIZE, BLOCK_SIZE);
+        reads_++;
+        return BLOCK_SIZE;
+    }
+    if(direct_ && !isAligned(data)) {
+        return readRun(block, 1, &data);
+    }
     // Reading from block to data buffer (must be BLOCK_SIZE)
-    ssize_t bytes = ::read(file_descriptor_, data, BLOCK_SIZE);
+    ssize_t bytes = ::pread(file_descriptor_, data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
     if(bytes != BLOCK_SIZE) {
         printf("Error in read - %s\n", strerror(errno));
         return -1;
@@ -82,18 +589,16 @@ ssize_t Disk::read(size_t block, char *data) {
     return bytes;
 }
 
-ssize_t Disk::write(size_t block, char *data) {
-    if(not disk_sanity_check(block, data)) {
-        return false;
+ssize_t Disk::writeBlock(size_t block, char *data) {
+    if(map_) {
+        memcpy(map_ + block * BLOCK_SIZE, data, BLOCK_SIZE);
+        writes_++;
+        return BLOCK_SIZE;
     }
-
-    off_t offset = block * BLOCK_SIZE;
-    if(lseek(file_descriptor_, offset, SEEK_SET) < 0) {
-        printf("Error in lseek - %s\n", strerror(errno));
-        return -1;
+    if(direct_ && !isAligned(data)) {
+        return writeRun(block, 1, &data);
     }
-
-    ssize_t bytes = ::write(file_descriptor_, data, BLOCK_SIZE);
+    ssize_t bytes = ::pwrite(file_descriptor_, data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
     if(bytes != BLOCK_SIZE) {
         printf("Error in write - %s\n", strerror(errno));
         return -1;
@@ -101,3 +606,114 @@ ssize_t Disk::write(size_t block, char *data) {
     writes_++;
     return bytes;
 }
+
+/**
+ * Read count consecutive blocks from start into data[0..count) with a
+ * single preadv.
+ **/
+ssize_t Disk::readRun(size_t start, size_t count, char *const *data) {
+    if(map_) {
+        for(size_t i = 0; i < count; ++i) {
+            if(readBlock(start + i, data[i]) < 0) {
+                return -1;
+            }
+        }
+        return (ssize_t)(count * BLOCK_SIZE);
+    }
+    if(count == 1 && !(direct_ && !isAligned(data[0]))) {
+        return readBlock(start, data[0]);
+    }
+    // O_DIRECT needs block aligned memory, unaligned buffers are bounced
+    std::vector<struct iovec> iov(count);
+    char* bounce = bounceBuffers(data, count);
+    if(direct_ && !bounce && bounced(data, count) > 0) {
+        return -1;
+    }
+    size_t next = 0;
+    for(size_t i = 0; i < count; ++i) {
+        iov[i].iov_base = (direct_ && !isAligned(data[i])) ? bounce + BLOCK_SIZE * next++ : data[i];
+        iov[i].iov_len  = BLOCK_SIZE;
+    }
+    ssize_t bytes = ::preadv(file_descriptor_, iov.data(), (int)count, (off_t)start * BLOCK_SIZE);
+    for(size_t i = 0; bounce && i < count; ++i) {
+        if(iov[i].iov_base != data[i]) {
+            memcpy(data[i], iov[i].iov_base, BLOCK_SIZE);
+        }
+    }
+    free(bounce);
+    if(bytes != (ssize_t)(count * BLOCK_SIZE)) {
+        printf("Error in readv - %s\n", strerror(errno));
+        return -1;
+    }
+    reads_ += count;
+    return bytes;
+}
+
+ssize_t Disk::writeRun(size_t start, size_t count, char *const *data) {
+    if(map_) {
+        for(size_t i = 0; i < count; ++i) {
+            if(writeBlock(start + i, data[i]) < 0) {
+                return -1;
+            }
+        }
+        return (ssize_t)(count * BLOCK_SIZE);
+    }
+    if(count == 1 && !(direct_ && !isAligned(data[0]))) {
+        return writeBlock(start, data[0]);
+    }
+    // O_DIRECT needs block aligned memory, unaligned buffers are bounced
+    std::vector<struct iovec> iov(count);
+    char* bounce = bounceBuffers(data, count);
+    if(direct_ && !bounce && bounced(data, count) > 0) {
+        return -1;
+    }
+    size_t next = 0;
+    for(size_t i = 0; i < count; ++i) {
+        iov[i].iov_base = data[i];
+        iov[i].iov_len  = BLOCK_SIZE;
+        if(direct_ && !isAligned(data[i])) {
+            iov[i].iov_base = bounce + BLOCK_SIZE * next++;
+            memcpy(iov[i].iov_base, data[i], BLOCK_SIZE);
+        }
+    }
+    ssize_t bytes = ::pwritev(file_descriptor_, iov.data(), (int)count, (off_t)start * BLOCK_SIZE);
+    free(bounce);
+    if(bytes != (ssize_t)(count * BLOCK_SIZE)) {
+        printf("Error in writev - %s\n", strerror(errno));
+        return -1;
+    }
+    writes_ += count;
+    return bytes;
+}
+
+/**
+ * Number of buffers that would need a bounce block under O_DIRECT.
+ **/
+size_t Disk::bounced(char *const *data, size_t count) {
+    size_t n = 0;
+    for(size_t i = 0; i < count; ++i) {
+        if(!isAligned(data[i]))
+            n++;
+    }
+    return n;
+}
+
+/**
+ * Aligned scratch memory with one block per unaligned buffer, nullptr
+ * when nothing needs bouncing (or not in O_DIRECT mode). Free with free().
+ **/
+char* Disk::bounceBuffers(char *const *data, size_t count) {
+    if(!direct_) {
+        return nullptr;
+    }
+    size_t n = bounced(data, count);
+    if(n == 0) {
+        return nullptr;
+    }
+    void* mem = nullptr;
+    if(posix_memalign(&mem, BLOCK_SIZE, n * BLOCK_SIZE) != 0) {
+        printf("Failed to allocate bounce buffer\n");
+        return nullptr;
+    }
+    return (char*)mem;
+}
@@ -1,35 +1,197 @@
 #include "fs.h"
+#include "lock.h"
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <map>
+#include <new>
+#include <set>
+#include <vector>
+
+/**
+ * In-core state of an inode being written or opened. The indirect block is
+ * read once and kept here, so reads and writes through any path resolve
+ * file blocks without going back to the disk for pointers. Written data
+ * waits in dirty until flushInode() gives it disk blocks. A handle with
+ * no open() references only lives until its data is flushed.
+ **/
+struct FileSystem::Handle {
+    uint32_t    pointers[POINTERS_PER_BLOCK];   /* Indirect pointers, all 0 without indirect block */
+    size_t      inode_number;                   /* Inode this handle belongs to */
+    uint32_t    refs;                           /* open() calls not closed yet */
+    std::map<size_t, char*> dirty;              /* File block -> buffered data block */
+    size_t      reserved;                       /* Free blocks promised to dirty, see reserveBlocks() */
+    std::set<uint64_t> reserved_pointers;       /* Pointer blocks counted in reserved */
+};
 
 FileSystem::FileSystem() {
     disk_ = nullptr;
-    free_blocks_ = nullptr;
+    inodes_ = nullptr;
+    inodes_per_block_ = LEGACY_INODES_PER_BLOCK;
+    dirty_inode_blocks_ = nullptr;
+    dirty_inode_count_ = 0;
+    inode_locks_ = nullptr;
+    open_files_ = nullptr;
+    streams_ = nullptr;
+    delayed_blocks_ = 0;
+    buffered_blocks_ = 0;
+    free_hint_ = 0;
+    trace_ = nullptr;
+    retired_blocks_ = 0;
+    journal_sequence_ = 1;
+    commits_ = 0;
+    last_sync_ok_ = true;
+    readahead_max_ = READAHEAD_MAX;
+    ra_running_ = false;
+    ra_stop_ = false;
+    pthread_rwlock_init(&fs_lock_, nullptr);
+    pthread_mutex_init(&table_lock_, nullptr);
+    pthread_mutex_init(&alloc_lock_, nullptr);
+    pthread_mutex_init(&ra_lock_, nullptr);
+    pthread_cond_init(&ra_cond_, nullptr);
+    pthread_rwlock_init(&names_lock_, nullptr);
+    pthread_mutex_init(&dentry_lock_, nullptr);
+    pthread_mutex_init(&journal_lock_, nullptr);
+    pthread_mutex_init(&tail_lock_, nullptr);
 }
 
 FileSystem::~FileSystem() {
-    if(free_blocks_) {
-        free(free_blocks_);
-        free_blocks_ = nullptr;
-    }
+    release();
+    pthread_rwlock_destroy(&fs_lock_);
+    pthread_mutex_destroy(&table_lock_);
+    pthread_mutex_destroy(&alloc_lock_);
+    pthread_mutex_destroy(&ra_lock_);
+    pthread_cond_destroy(&ra_cond_);
+    pthread_rwlock_destroy(&names_lock_);
+    pthread_mutex_destroy(&dentry_lock_);
+    pthread_mutex_destroy(&journal_lock_);
+    pthread_mutex_destroy(&tail_lock_);
 }
 
 ssize_t FileSystem::allocBlock() {
-    if(!free_blocks_)
-        return -1;
-    // find first free block
-    for(int i = 0; i < meta_data_.blocks; ++i) {
-        if(!free_blocks_[i]) {
-            free_blocks_[i] = true;
-            return (ssize_t)i;
-        }
+    OpTimer timer(&stats_, Stats::OP_ALLOC);
+    if(!inodes_)
+        return timer.done(-1);
+    MutexLock guard(&alloc_lock_);
+    ssize_t block = free_blocks_.alloc();
+    if(block >= 0)
+        stats_.allocated(1);
+    return timer.done(block);
+}
+
+/**
+ * Allocate a run of up to count physically contiguous blocks, preferably
+ * starting at hint (-1 lets the allocator pick). Returns the first block
+ * and stores the run length in *allocated, which may be short of count
+ * when the disk has no free run that long.
+ **/
+ssize_t FileSystem::allocBlocks(size_t count, ssize_t hint, size_t* allocated) {
+    OpTimer timer(&stats_, Stats::OP_ALLOC);
+    *allocated = 0;
+    if(!inodes_)
+        return timer.done(-1);
+    MutexLock guard(&alloc_lock_);
+    ssize_t start = free_blocks_.allocRun(count, hint, allocated);
+    stats_.allocated(*allocated);
+    return timer.done(start);
+}
+
+/**
+ * Release count blocks starting at start. Neighbouring free runs merge
+ * automatically in the bitmap.
+ **/
+void FileSystem::freeBlocks(size_t start, size_t count) {
+    if(!inodes_ || start == 0 || start + count > meta_data_.blocks)
+        return;
+    MutexLock guard(&alloc_lock_);
+    free_blocks_.clearRange(start, count);
+    stats_.freed(count);
+}
+
+/**
+ * Promise count free blocks to buffered writes, so that a write accepted
+ * now cannot run out of space when it is flushed later. Fails when the
+ * blocks not yet promised don't cover count.
+ **/
+bool FileSystem::reserveBlocks(size_t count) {
+    MutexLock guard(&alloc_lock_);
+    size_t free_count = free_blocks_.size() - free_blocks_.used();
+    if(free_count < delayed_blocks_ + count)
+        return false;
+    delayed_blocks_ += count;
+    return true;
+}
+
+void FileSystem::unreserveBlocks(size_t count) {
+    MutexLock guard(&alloc_lock_);
+    delayed_blocks_ -= count;
+}
+
+/**
+ * Hand out the next block of run. Once run is used up, reserve a new
+ * contiguous run of up to want blocks, starting at goal if possible.
+ **/
+ssize_t FileSystem::takeBlock(Run& run, size_t want, ssize_t goal) {
+    if(run.length == 0) {
+        size_t got = 0;
+        ssize_t start = allocBlocks(want, goal, &got);
+        if(start < 0)
+            return -1;
+        run.start  = (size_t)start;
+        run.length = got;
+    }
+    run.length--;
+    ssize_t block = (ssize_t)run.start++;
+    if(meta_data_.features & FEATURE_DEDUP) {
+        MutexLock guard(&alloc_lock_);
+        refs_[block] = 1;
+    }
+    return block;
+}
+
+/**
+ * Queue block for release, batching neighbouring blocks into one run.
+ * A block of 0 flushes the pending run. A shared block only loses a
+ * reference; depth tells a pointer block, whose references go with its
+ * last one, see dropRef().
+ **/
+void FileSystem::releaseBlock(Run& run, size_t block, size_t depth) {
+    if(block != 0 && (meta_data_.features & FEATURE_DEDUP) && !dropRef(run, (uint32_t)block, depth)) {
+        return;
+    }
+    if(block != 0 && run.length > 0 && block == run.start + run.length) {
+        run.length++;
+        return;
+    }
+    if(run.length > 0) {
+        retireBlocks(run.start, run.length);
+    }
+    run.start  = block;
+    run.length = (block != 0) ? 1 : 0;
+}
+
+// a compressed block shows as tail block:first slot
+void FileSystem::printPointer(uint32_t pointer) {
+    if(compressedPointer(pointer)) {
+        printf(" %u:%u", pointerTail(pointer).block, pointerTail(pointer).slot);
+    }else {
+        printf(" %u", pointer);
     }
-    return -1;
 }
 
 void FileSystem::debug(Disk& disk) {
     Block block;
 
+    // show in-memory inode changes as well, journaled metadata only
+    // reaches its home blocks with a commit
+    if(disk_ == &disk && (meta_data_.features & FEATURE_JOURNAL)) {
+        sync();
+    } else if(disk_ == &disk) {
+        WriteLock guard(&fs_lock_);
+        flushAll();
+        storeInodes();
+    }
+
     /* Read SuperBlock */
     disk.read(0, block.data);
 
@@ -42,18 +204,41 @@ void FileSystem::debug(Disk& disk) {
     printf("    %u blocks\n"         , block.super.blocks);
     printf("    %u inode blocks\n"   , block.super.inode_blocks);
     printf("    %u inodes\n"         , block.super.inodes);
+    if(block.super.bitmap_blocks > 0) {
+        printf("    %u bitmap blocks\n" , block.super.bitmap_blocks);
+        printf("    %s\n", block.super.state == STATE_CLEAN ? "clean" : "not clean");
+    }
+    if(block.super.features & FEATURE_LAZY_INODES) {
+        printf("    %u inode blocks initialized\n", block.super.inode_watermark);
+    }
+    if(block.super.features & FEATURE_JOURNAL) {
+        printf("    %u journal blocks\n", block.super.journal_blocks);
+    }
+    if(block.super.features & FEATURE_DEDUP) {
+        printf("    %u index blocks\n", block.super.index_blocks);
+    }
 
     /* Read Inodes */
-    size_t inodeBlocksNum = block.super.inode_blocks;
+    size_t inodeBlocksNum = initializedInodeBlocks(block.super);
+    if(inodeBlocksNum > block.super.inode_blocks) {
+        inodeBlocksNum = block.super.inode_blocks;
+    }
+    uint32_t inodesInBlock = inodesPerBlock(block.super);
     Block data_block = {0};
     for(int blockIdx = 1; blockIdx <= inodeBlocksNum; ++blockIdx) {
         if(disk.read(blockIdx, data_block.data) != Disk::BLOCK_SIZE) {
             printf("Failed to read block.\n");
             return;
         }
-        for(int inodeIdx = 0; inodeIdx < INODES_PER_BLOCK; ++inodeIdx) {
-            Inode* inode = &data_block.inodes[inodeIdx];
-            size_t total_inode_num = (blockIdx - 1) * INODES_PER_BLOCK + inodeIdx;
+        for(uint32_t inodeIdx = 0; inodeIdx < inodesInBlock; ++inodeIdx) {
+            Inode large_inode;
+            Inode* inode = &large_inode;
+            if(block.super.features & FEATURE_LARGE_FILES) {
+                inode = &data_block.inodes[inodeIdx];
+            }else {
+                expandInode(data_block.legacy_inodes[inodeIdx], inode);
+            }
+            size_t total_inode_num = (blockIdx - 1) * inodesInBlock + inodeIdx;
             if(total_inode_num >= block.super.inodes)
                 break;
             
@@ -64,7 +249,35 @@ void FileSystem::debug(Disk& disk) {
                 //     indirect block: 9
                 //     indirect data blocks: 13 14
                 printf("Inode %d:\n", inodeIdx);
-                printf("    size: %u bytes\n", inode->size);
+                printf("    size: %lu bytes\n", (unsigned long)inode->size);
+                if(inode->flags & INODE_INLINE) {
+                    printf("    inline data\n");
+                    continue;
+                }
+                if(inode->flags & INODE_TAIL) {
+                    TailMap* tail = tailMap(inode);
+                    printf("    tail block: %u, slots %u-%u\n", tail->block, tail->slot,
+                           tail->slot + tail->count - 1);
+                    continue;
+                }
+                if(block.super.features & FEATURE_EXTENTS) {
+                    ExtentMap* map = extentMap(inode);
+                    Block extent_block;
+                    Extent* extents = map->extents;
+                    if(map->block != 0) {
+                        printf("    extent block: %u\n", map->block);
+                        if(disk.read(map->block, extent_block.data) != Disk::BLOCK_SIZE) {
+                            printf("Failed to read block.\n");
+                            return;
+                        }
+                        extents = extent_block.extents;
+                    }
+                    for(uint32_t i = 0; i < map->count && i < EXTENTS_PER_BLOCK; ++i) {
+                        printf("    extent: file block %u, %u blocks at %u\n",
+                               extents[i].file_block, extents[i].length, extents[i].start);
+                    }
+                    continue;
+                }
                 int direct_num = 0;
                 for(int i = 0; i < POINTERS_PER_INODE; ++i) {
                     if(inode->direct[i] != 0)
@@ -73,7 +286,7 @@ void FileSystem::debug(Disk& disk) {
                 if(direct_num > 0) {
                     printf("    direct blocks:");
                     for(int i = 0; i < direct_num; ++i) {
-                        printf(" %u", inode->direct[i]);
+                        printPointer(inode->direct[i]);
                     }
                     printf("\n");
                 }
@@ -88,11 +301,18 @@ void FileSystem::debug(Disk& disk) {
                     printf("    indirect data blocks:");
                     for(int i = 0; i < POINTERS_PER_BLOCK; ++i) {
                         if(indirect_block.pointers[i] == 0) {
-                            printf("\n");
                             break;
                         }
-                        printf(" %u", indirect_block.pointers[i]);
+                        printPointer(indirect_block.pointers[i]);
                     }
+                    printf("\n");
+                }
+                // data behind these is too much to list
+                if(inode->double_indirect != 0) {
+                    printf("    double indirect block: %u\n", inode->double_indirect);
+                }
+                if(inode->triple_indirect != 0) {
+                    printf("    triple indirect block: %u\n", inode->triple_indirect);
                 }
             } 
         }
@@ -102,61 +322,167 @@ void FileSystem::debug(Disk& disk) {
 /**
  * Format Disk by doing the following:
  *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *     number of inode blocks, and number of inodes).
- *  2. Clear all remaining blocks.
+ *     number of inode blocks, number of inodes and number of bitmap blocks).
+ *  2. Clear the inode table and create the root inode.
+ *  3. Write the free block bitmap with all metadata blocks in use.
+ *  4. Clear all remaining blocks.
+ * With FORMAT_QUICK the image is discarded up front so every block already
+ * reads as zero, and only the super block, the first inode block and the
+ * non-empty bitmap blocks are written. The rest of the inode table is
+ * initialized as inodes get used (see storeInodes()).
+ * FORMAT_LARGE writes the 64 byte inode format, whose double and triple
+ * indirect blocks map files of up to 4 TB instead of about 4 MB.
+ * FORMAT_EXTENTS uses the same inode size but maps files by extents.
+ * FORMAT_JOURNAL reserves a journal region behind the bitmap, 1/16 of
+ * the disk up to about 8 MB.
+ * FORMAT_PACKED keeps small files in their inode or in shared tail blocks,
+ * it implies the 64 byte inode format.
+ * FORMAT_COMPRESSED stores data blocks LZ compressed where that saves
+ * space. It cannot be combined with FORMAT_EXTENTS and needs a disk of
+ * at most COMPRESSED_MAX_BLOCKS blocks.
+ * FORMAT_DEDUP reserves an index region behind the journal, one block per
+ * INDEX_ENTRIES_PER_BLOCK blocks of the disk. It cannot be combined with
+ * FORMAT_EXTENTS or FORMAT_COMPRESSED and implies the 64 byte inode
+ * format, whose flags mark the inodes clone() made.
  * Note: Do not format a mounted Disk!
  **/
-bool FileSystem::format(Disk& disk) {
+bool FileSystem::format(Disk& disk, int flags) {
+    TraceCall call(trace_, Trace::OP_FORMAT, flags, disk.getBlockNum());
+    bool ok = formatDisk(disk, flags);
+    call.done(ok ? 0 : -1);
+    return ok;
+}
+
+bool FileSystem::formatDisk(Disk& disk, int flags) {
+    if(disk_) {
+        return false;
+    }
     Block block = {0};
     //1. write super block
     size_t numBlocks   = disk.getBlockNum();
-    if(free_blocks_) {
-        free(free_blocks_);
-        free_blocks_ = nullptr;
+    size_t numInodes   = numBlocks / 10; /*use 10% of total Blocks*/
+    if(flags & (FORMAT_EXTENTS | FORMAT_PACKED | FORMAT_DEDUP)) {
+        flags |= FORMAT_LARGE;
+    }
+    if((flags & FORMAT_COMPRESSED) && (flags & FORMAT_EXTENTS)) {
+        printf("Compression needs block pointers, not extents.\n");
+        return false;
+    }
+    if((flags & FORMAT_DEDUP) && (flags & (FORMAT_EXTENTS | FORMAT_COMPRESSED))) {
+        printf("Dedup needs plain block pointers, not extents or compression.\n");
+        return false;
+    }
+    if((flags & FORMAT_COMPRESSED) && numBlocks > COMPRESSED_MAX_BLOCKS) {
+        printf("Disk too large to compress, at most %u blocks.\n", COMPRESSED_MAX_BLOCKS);
+        return false;
+    }
+    uint32_t inodesInBlock = (flags & FORMAT_LARGE) ? INODES_PER_BLOCK : LEGACY_INODES_PER_BLOCK;
+    if(numInodes < inodesInBlock) numInodes = inodesInBlock;
+    uint32_t numInodeBlocks  = (numInodes + inodesInBlock - 1) / inodesInBlock;
+    uint32_t numBitmapBlocks = (numBlocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    // two halves of a header and the blocks one transaction can log
+    uint32_t numJournalBlocks = 0;
+    if(flags & FORMAT_JOURNAL) {
+        size_t tags = std::max(numBlocks / 16, (size_t)4 * (numBitmapBlocks + 4));
+        numJournalBlocks = 2 * (1 + std::min(tags, (size_t)JOURNAL_TAGS));
+    }
+    uint32_t numIndexBlocks = 0;
+    if(flags & FORMAT_DEDUP) {
+        numIndexBlocks = (numBlocks + INDEX_ENTRIES_PER_BLOCK - 1) / INDEX_ENTRIES_PER_BLOCK;
+    }
+    if(1 + numInodeBlocks + numBitmapBlocks + numJournalBlocks + numIndexBlocks >= numBlocks) {
+        printf("Disk too small to format.\n");
+        return false;
     }
-    disk_ = &disk;
-    free_blocks_ = (bool*)calloc(numBlocks, sizeof(bool));
 
-    size_t numInodes   = numBlocks / 10; /*use 10% of total Blocks*/
-    if(numInodes < INODES_PER_BLOCK) numInodes = INODES_PER_BLOCK;
-    uint32_t numInodeBlocks = (numInodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
-    
-    meta_data_.magic_number = MAGIC_NUMBER;
-    meta_data_.blocks       = numBlocks;
-    meta_data_.inode_blocks = numInodeBlocks;
-    meta_data_.inodes       = numInodes;
+    SuperBlock super = {0};
+    super.magic_number  = MAGIC_NUMBER;
+    super.blocks        = numBlocks;
+    super.inode_blocks  = numInodeBlocks;
+    super.inodes        = numInodes;
+    super.bitmap_blocks = numBitmapBlocks;
+    super.state         = STATE_CLEAN;
+    if(flags & FORMAT_LARGE) {
+        super.features |= FEATURE_LARGE_FILES;
+    }
+    if(flags & FORMAT_EXTENTS) {
+        super.features |= FEATURE_EXTENTS;
+    }
+    if(flags & FORMAT_PACKED) {
+        super.features |= FEATURE_PACKED;
+    }
+    if(flags & FORMAT_COMPRESSED) {
+        super.features |= FEATURE_COMPRESSED;
+    }
+    if(flags & FORMAT_DEDUP) {
+        super.features    |= FEATURE_DEDUP;
+        super.index_blocks = numIndexBlocks;
+    }
+    if(flags & FORMAT_JOURNAL) {
+        super.features      |= FEATURE_JOURNAL;
+        super.journal_blocks = numJournalBlocks;
+    }
+    bool quick = (flags & FORMAT_QUICK) != 0;
+    if(quick) {
+        super.features       |= FEATURE_LAZY_INODES;
+        super.inode_watermark = 1;
+        if(not disk.discard(0, numBlocks)) {
+            printf("Failed to discard disk.\n");
+            return false;
+        }
+    }
 
-    block.super = meta_data_;
+    block.super = super;
     if(disk.write(0, block.data) != Disk::BLOCK_SIZE) {
         printf("Failed to write super block.\n");
         return false;
     }
-    free_blocks_[0] = true;
 
-    // 2. clear all inode table
-    for(int i = 0; i < numInodeBlocks; ++i) {
+    // 2. clear all inode table, root dir inode is inode 0 in block 1
+    uint32_t initInodeBlocks = initializedInodeBlocks(super);
+    for(uint32_t i = 0; i < initInodeBlocks; ++i) {
         Block iBlock = {0};
+        if(i == 0 && (super.features & FEATURE_LARGE_FILES)) {
+            iBlock.inodes[0].valid = 1;
+        }else if(i == 0) {
+            iBlock.legacy_inodes[0].valid = 1;
+            iBlock.legacy_inodes[0].size  = 0;
+        }
         if(disk.write(i + 1, iBlock.data) != Disk::BLOCK_SIZE) {
             printf("Failed to write inode block.\n");
             return false;
         }
-        free_blocks_[i + 1] = true;
     }
-    // 3. write root dir inode (inode 0 in block 1)
-    Block rootInodeBlock = {0};
-    if(disk.read(1, rootInodeBlock.data) != Disk::BLOCK_SIZE) {
-        printf("Failed to read rootInodeBlock.\n");
-        return false;
+
+    // 3. bitmap: super block, inode table, bitmap itself, the journal and the index are used
+    size_t numMetaBlocks = 1 + numInodeBlocks + numBitmapBlocks + numJournalBlocks + numIndexBlocks;
+    for(uint32_t i = 0; i < numBitmapBlocks; ++i) {
+        Block bBlock = {0};
+        for(size_t b = i * BITS_PER_BLOCK; b < numMetaBlocks && b < (i + 1) * BITS_PER_BLOCK; ++b) {
+            size_t bit = b - i * BITS_PER_BLOCK;
+            bBlock.data[bit / 8] |= (char)(1 << (bit % 8));
+        }
+        // a discarded block is already all free
+        if(quick && i * BITS_PER_BLOCK >= numMetaBlocks) {
+            break;
+        }
+        if(disk.write(1 + numInodeBlocks + i, bBlock.data) != Disk::BLOCK_SIZE) {
+            printf("Failed to write bitmap block.\n");
+            return false;
+        }
     }
-    rootInodeBlock.inodes[0].valid = 1;
-    rootInodeBlock.inodes[0].size  = 0;
-    if(disk.write(1, rootInodeBlock.data) != Disk::BLOCK_SIZE) {
-        printf("Failed to write rootInodeBlock.\n");
-        return false;
+
+    // an old transaction left on the image must never be replayed
+    for(uint32_t h = 0; h < 2 && numJournalBlocks > 0; ++h) {
+        Block jBlock = {0};
+        if(disk.write(1 + numInodeBlocks + numBitmapBlocks + h * numJournalBlocks / 2, jBlock.data) != Disk::BLOCK_SIZE) {
+            printf("Failed to write journal block.\n");
+            return false;
+        }
     }
 
     // 4.Clear all remaining blocks.
-    for(int i = 1 + numInodeBlocks; i < numBlocks; ++i) {
+    for(size_t i = numMetaBlocks; !quick && i < numBlocks; ++i) {
         Block rmBlock = {0};
         if(disk.write(i, rmBlock.data) != Disk::BLOCK_SIZE) {
             printf("Failed to write rmBlock.\n");
@@ -164,10 +490,29 @@ bool FileSystem::format(Disk& disk) {
         }
     }
     
-    return true;
+    return disk.flush();
 }
 
 bool FileSystem::mount(Disk& disk) {
+    TraceCall call(trace_, Trace::OP_MOUNT, 0, disk.getBlockNum());
+    bool ok = mountDisk(disk);
+    // a replay formats its image the same way
+    if(ok) {
+        call.setInode(((meta_data_.features & FEATURE_LARGE_FILES) ? FORMAT_LARGE : 0) |
+                      ((meta_data_.features & FEATURE_EXTENTS) ? FORMAT_EXTENTS : 0) |
+                      ((meta_data_.features & FEATURE_JOURNAL) ? FORMAT_JOURNAL : 0) |
+                      ((meta_data_.features & FEATURE_PACKED) ? FORMAT_PACKED : 0) |
+                      ((meta_data_.features & FEATURE_COMPRESSED) ? FORMAT_COMPRESSED : 0) |
+                      ((meta_data_.features & FEATURE_DEDUP) ? FORMAT_DEDUP : 0));
+    }
+    call.done(ok ? 0 : -1);
+    return ok;
+}
+
+bool FileSystem::mountDisk(Disk& disk) {
+    if(disk_) {
+        return false;
+    }
     Block block = {0};
     // read super block
     if(disk.read(0, block.data) != Disk::BLOCK_SIZE) {
@@ -179,362 +524,1954 @@ bool FileSystem::mount(Disk& disk) {
     if(block.super.blocks != disk.getBlockNum()) {
         return false;
     }
+    // inode table must cover all inodes and fit on the disk
+    if(1 + block.super.inode_blocks + block.super.bitmap_blocks >= block.super.blocks ||
+       block.super.inodes > block.super.inode_blocks * inodesPerBlock(block.super)) {
+        return false;
+    }
+    // refuse images using features this code does not understand
+    if((block.super.features & ~FEATURES_KNOWN) != 0 ||
+       initializedInodeBlocks(block.super) > block.super.inode_blocks) {
+        return false;
+    }
+    // extents and packed data live in the large inode format
+    if((block.super.features & (FEATURE_EXTENTS | FEATURE_PACKED)) && !(block.super.features & FEATURE_LARGE_FILES)) {
+        return false;
+    }
+    // compressed pointers are block pointers with 23 bits for the block
+    if((block.super.features & FEATURE_COMPRESSED) &&
+       ((block.super.features & FEATURE_EXTENTS) || block.super.blocks > COMPRESSED_MAX_BLOCKS)) {
+        return false;
+    }
+    // the journal sits behind the bitmap, two halves of at least two blocks
+    if((block.super.features & FEATURE_JOURNAL) &&
+       (block.super.journal_blocks < 4 ||
+        1 + block.super.inode_blocks + block.super.bitmap_blocks + block.super.journal_blocks >= block.super.blocks)) {
+        return false;
+    }
+    // the index follows the journal and holds an entry per block
+    if((block.super.features & FEATURE_DEDUP) &&
+       ((block.super.features & (FEATURE_EXTENTS | FEATURE_COMPRESSED)) ||
+        (uint64_t)block.super.index_blocks * INDEX_ENTRIES_PER_BLOCK < block.super.blocks ||
+        1 + block.super.inode_blocks + block.super.bitmap_blocks + block.super.journal_blocks +
+        block.super.index_blocks >= block.super.blocks)) {
+        return false;
+    }
     meta_data_ = block.super;
+    if(!(meta_data_.features & FEATURE_JOURNAL)) {
+        meta_data_.journal_blocks = 0;
+    }
+    if(!(meta_data_.features & FEATURE_DEDUP)) {
+        meta_data_.index_blocks = 0;
+    }
+    inodes_per_block_ = inodesPerBlock(meta_data_);
     disk_ = &disk;
-    if(free_blocks_) {
-        free(free_blocks_);
-        free_blocks_ = nullptr;
+    if(not free_blocks_.init(disk.getBlockNum(), BITS_PER_BLOCK)) {
+        release();
+        return false;
+    }
+
+    // committed metadata that may not have made it home, the super block
+    // itself included
+    if(meta_data_.features & FEATURE_JOURNAL) {
+        if(not replayJournal() || disk.read(0, block.data) != Disk::BLOCK_SIZE) {
+            release();
+            return false;
+        }
+        meta_data_ = block.super;
+    }
+
+    if(not loadInodes() || not loadTails()) {
+        release();
+        return false;
+    }
+    inode_locks_ = (pthread_rwlock_t*)calloc(meta_data_.inodes, sizeof(pthread_rwlock_t));
+    if(!inode_locks_) {
+        release();
+        return false;
+    }
+    for(uint32_t i = 0; i < meta_data_.inodes; ++i) {
+        pthread_rwlock_init(&inode_locks_[i], nullptr);
     }
-    free_blocks_ = (bool*)calloc(disk.getBlockNum(), sizeof(bool));
-    free_blocks_[0] = true;
-    // inode block used
-    for(int i = 0; i < meta_data_.inode_blocks; ++i) {
-        free_blocks_[1 + i] = true;
+    open_files_ = (Handle**)calloc(meta_data_.inodes, sizeof(Handle*));
+    streams_    = (Stream*)calloc(meta_data_.inodes, sizeof(Stream));
+    if(!open_files_ || !streams_) {
+        release();
+        return false;
+    }
+
+    // A cleanly unmounted disk has an up to date bitmap on disk, and so
+    // does a journaled one after replay. Images without a bitmap region,
+    // or that were not unmounted, are rebuilt from the inode table.
+    bool ok = false;
+    if(meta_data_.bitmap_blocks > 0 &&
+       (meta_data_.state == STATE_CLEAN || (meta_data_.features & FEATURE_JOURNAL))) {
+        ok = loadBitmap();
+    }
+    if(!ok && !rebuildBitmap()) {
+        release();
+        return false;
+    }
+    if((meta_data_.features & FEATURE_DEDUP) && !loadRefs(meta_data_.state == STATE_CLEAN)) {
+        release();
+        return false;
+    }
+
+    // mark the disk in use until unmount() writes the bitmap back
+    if(meta_data_.bitmap_blocks > 0) {
+        meta_data_.state = 0;
+        if(not storeSuperBlock()) {
+            release();
+            return false;
+        }
     }
 
+    startReadahead();
     return true;
 }
 
-void FileSystem::unmount() {
-    if(free_blocks_) {
-        free(free_blocks_);
-        free_blocks_ = nullptr;
+bool FileSystem::storeSuperBlock() {
+    // a journaled image may only be called clean once every block that
+    // went home is durable, mount() then skips the replay
+    bool journal = (meta_data_.features & FEATURE_JOURNAL) != 0;
+    if(journal && !disk_->sync()) {
+        return false;
     }
-    disk_ = nullptr;
-    meta_data_ = (SuperBlock){0};
+    Block block = {0};
+    block.super = meta_data_;
+    if(disk_->write(0, block.data) != Disk::BLOCK_SIZE) {
+        printf("Failed to write super block.\n");
+        return false;
+    }
+    // the state flag has to reach the image, not just the cache
+    return journal ? disk_->sync() : disk_->flush();
 }
 
-ssize_t FileSystem::create() {
-    if(!disk_ || !free_blocks_) {
-        return -1;
+/**
+ * Read the on-disk bitmap, bit n of the region set means block n is used.
+ **/
+bool FileSystem::loadBitmap() {
+    // the in-memory words share the on-disk layout, one chunk per block
+    for(uint32_t i = 0; i < meta_data_.bitmap_blocks; ++i) {
+        if(disk_->read(1 + meta_data_.inode_blocks + i, free_blocks_.chunk(i)) != Disk::BLOCK_SIZE) {
+            return false;
+        }
+    }
+    free_blocks_.seal();
+    return true;
+}
+
+bool FileSystem::storeBitmap() {
+    MutexLock guard(&alloc_lock_);
+    bool ok = true;
+    for(uint32_t i = 0; i < meta_data_.bitmap_blocks; ++i) {
+        if(!free_blocks_.chunkDirty(i)) {
+            continue;
+        }
+        if(!writeMeta(1 + meta_data_.inode_blocks + i, free_blocks_.chunk(i))) {
+            printf("Failed to write bitmap block.\n");
+            ok = false;
+            continue;
+        }
+        free_blocks_.chunkClean(i);
     }
+    return ok;
+}
 
-    // find a free inode
-    for(int inode = 0; inode < meta_data_.inodes; ++inode) {
-        size_t blockIdx = 1 + (inode / INODES_PER_BLOCK);
-        size_t offset   = inode % INODES_PER_BLOCK;
+/**
+ * Recompute which blocks are used by walking every valid inode and its
+ * indirect blocks. Only needed when the on-disk bitmap can't be trusted.
+ **/
+bool FileSystem::rebuildBitmap() {
+    size_t numBlocks = meta_data_.blocks;
+    free_blocks_.reset();
+    // super block, inode table, bitmap, journal and index are always used
+    for(size_t i = 0; i < indexStart() + meta_data_.index_blocks; ++i) {
+        free_blocks_.set(i);
+    }
 
-        // Read the block containing this inode
-        Block block = {0};
-        if(disk_->read(blockIdx, block.data) != Disk::BLOCK_SIZE) {
-            /*文件系统应该具备部分故障隔离能力，单个inode块的问题不应该导致整个文件创建操作失败。
-            跳过损坏的inode块可以让文件系统继续使用其他正常的inode块*/
+    for(uint32_t n = 0; n < meta_data_.inodes; ++n) {
+        Inode* inode = &inodes_[n];
+        if(inode->valid != 1 || (inode->flags & INODE_INLINE)) {
             continue;
         }
-        // Check if this inode is free
-        if(block.inodes[offset].valid == 1) {
+        if(inode->flags & INODE_TAIL) {
+            if(tailMap(inode)->block < numBlocks) {
+                free_blocks_.set(tailMap(inode)->block);
+            }
             continue;
         }
-        block.inodes[offset].valid = 1;
-        block.inodes[offset].size = 0;
-        // clear all pointers
-        for(int i = 0; i < POINTERS_PER_INODE; ++i) {
-            block.inodes[offset].direct[i] = 0;
+        if(meta_data_.features & FEATURE_EXTENTS) {
+            std::vector<Extent> extents;
+            if(!loadExtents(inode, extents)) {
+                return false;
+            }
+            uint32_t extent_block = extentMap(inode)->block;
+            if(extent_block != 0 && extent_block < numBlocks) {
+                free_blocks_.set(extent_block);
+            }
+            for(size_t i = 0; i < extents.size(); ++i) {
+                if(extents[i].start + (size_t)extents[i].length <= numBlocks) {
+                    free_blocks_.setRange(extents[i].start, extents[i].length);
+                }
+            }
+            continue;
         }
-        block.inodes[offset].indirect = 0;
-
-        // write the updated block back to disk
-        if(disk_->write(blockIdx, block.data) != Disk::BLOCK_SIZE) {
-            return -1;
+        // pointer blocks and the data behind them, a compressed block
+        // keeps its tail block in use
+        std::vector<uint32_t> blocks(inode->direct, inode->direct + POINTERS_PER_INODE);
+        if(!treeBlocks(inode->indirect, 1, blocks) ||
+           !treeBlocks(inode->double_indirect, 2, blocks) ||
+           !treeBlocks(inode->triple_indirect, 3, blocks)) {
+            return false;
+        }
+        for(size_t i = 0; i < blocks.size(); ++i) {
+            uint32_t block = blocks[i];
+            if((meta_data_.features & FEATURE_COMPRESSED) && compressedPointer(block)) {
+                block = pointerTail(block).block;
+            }
+            if(block != 0 && block < numBlocks) {
+                free_blocks_.set(block);
+            }
         }
-        return (ssize_t)inode;
     }
-    return -1;
+    return true;
 }
 
-bool FileSystem::remove(size_t inode_number) {
-    if(!disk_ || !free_blocks_) {
-        return false;
+/**
+ * Read the whole inode table into memory. After this, inode lookups
+ * cost no I/O; modified inode blocks are written back by storeInodes().
+ **/
+bool FileSystem::loadInodes() {
+    if(inodes_) {
+        free(inodes_);
+        inodes_ = nullptr;
     }
-    if(inode_number >= meta_data_.inodes) {
-        return false;
+    if(dirty_inode_blocks_) {
+        free(dirty_inode_blocks_);
+        dirty_inode_blocks_ = nullptr;
     }
-    size_t blockIdx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offset   = inode_number % INODES_PER_BLOCK;
-    Block block = {0};
-    if(disk_->read(blockIdx, block.data) != Disk::BLOCK_SIZE) {
+    // the table is written back block by block, keep it block aligned
+    size_t table_bytes = (size_t)meta_data_.inode_blocks * inodes_per_block_ * sizeof(Inode);
+    void* mem = nullptr;
+    if(posix_memalign(&mem, Disk::BLOCK_SIZE, table_bytes) != 0) {
         return false;
     }
-    // Check if this inode is free
-    Inode* inode = &block.inodes[offset];
-    if(inode->valid != 1) {
+    inodes_ = (Inode*)mem;
+    memset(inodes_, 0, table_bytes);
+    dirty_inode_blocks_ = (bool*)calloc(meta_data_.inode_blocks, sizeof(bool));
+    if(!dirty_inode_blocks_) {
         return false;
     }
-    // Release direct blocks
-    for(int i = 0; i < POINTERS_PER_INODE; ++i) {
-        if(inode->direct[i] != 0) {
-            if(inode->direct[i] < disk_->getBlockNum()) {
-                free_blocks_[inode->direct[i]] = 0;
-            }else {
-                printf("Unexpected error in direct block\n");
-            }
-        }
-        inode->direct[i] = 0;
-    }
-    // Release indirect block
-    if(inode->indirect != 0) {
-        Block ind_block = {0};
-        if(disk_->read(inode->indirect, ind_block.data) != Disk::BLOCK_SIZE) {
+
+    // blocks past the watermark were never written, they stay zero
+    bool large = (meta_data_.features & FEATURE_LARGE_FILES) != 0;
+    Block block;
+    for(uint32_t i = 0; i < initializedInodeBlocks(meta_data_); ++i) {
+        Inode* table = &inodes_[i * inodes_per_block_];
+        char* dest = large ? (char*)table : block.data;
+        if(disk_->read(1 + i, dest) != Disk::BLOCK_SIZE) {
+            printf("Failed to read inode block %u.\n", 1 + i);
             return false;
         }
-        for(int i = 0; i < POINTERS_PER_BLOCK; ++i) {
-            int blockId = ind_block.pointers[i];
-            if(blockId != 0 && blockId < disk_->getBlockNum()) {
-                // mark block as free in bit map
-                free_blocks_[blockId] = 0;
-            }
-            ind_block.pointers[i] = 0;
-        }
-        if(inode->indirect < disk_->getBlockNum()) {
-            free_blocks_[inode->indirect] = 0;
+        for(uint32_t j = 0; !large && j < LEGACY_INODES_PER_BLOCK; ++j) {
+            expandInode(block.legacy_inodes[j], &table[j]);
         }
-        inode->indirect = 0;
     }
-    // mark inode as free
-    inode->valid = 0;
-    inode->size  = 0;
+    return true;
+}
 
-    // write the updated block back to disk
-    if(disk_->write(blockIdx, block.data) != Disk::BLOCK_SIZE) {
-        return false;
+/**
+ * Inodes per inode table block: 64 byte inodes on FEATURE_LARGE_FILES
+ * images, 32 byte ones before that.
+ **/
+uint32_t FileSystem::inodesPerBlock(const SuperBlock& super) {
+    if(super.features & FEATURE_LARGE_FILES) {
+        return INODES_PER_BLOCK;
     }
+    return LEGACY_INODES_PER_BLOCK;
+}
 
-    return true;
+void FileSystem::expandInode(const LegacyInode& legacy, Inode* inode) {
+    memset(inode, 0, sizeof(Inode));
+    inode->valid    = legacy.valid;
+    inode->size     = legacy.size;
+    memcpy(inode->direct, legacy.direct, sizeof(inode->direct));
+    inode->indirect = legacy.indirect;
 }
 
-ssize_t FileSystem::stat(size_t inode_number) {
-    if(!disk_ || !free_blocks_) {
-        return -1;
-    }
-    if(inode_number >= meta_data_.inodes) {
-        return -1;
+/**
+ * Write inode table block i from memory, packing it into the old format
+ * where the image uses it. maxFileBlocks() keeps inodes on such images
+ * within what the old format can describe.
+ **/
+bool FileSystem::writeInodeBlock(uint32_t i) {
+    Inode* table = &inodes_[i * inodes_per_block_];
+    if(meta_data_.features & FEATURE_LARGE_FILES) {
+        return writeMeta(1 + i, (char*)table);
     }
-    size_t blockIdx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offset   = inode_number % INODES_PER_BLOCK;
     Block block = {0};
-    if(disk_->read(blockIdx, block.data) != Disk::BLOCK_SIZE) {
-        return -1;
-    }
-    Inode* inode = &block.inodes[offset];
-    if(inode->valid != 1) {
-        return -1;
+    for(uint32_t j = 0; j < LEGACY_INODES_PER_BLOCK; ++j) {
+        LegacyInode* legacy = &block.legacy_inodes[j];
+        legacy->valid    = table[j].valid;
+        legacy->size     = (uint32_t)table[j].size;
+        memcpy(legacy->direct, table[j].direct, sizeof(legacy->direct));
+        legacy->indirect = table[j].indirect;
     }
+    return writeMeta(1 + i, block.data);
+}
 
-    return (ssize_t)inode->size;
+/**
+ * Number of inode blocks holding real data on disk: all of them, unless
+ * the image was quick formatted.
+ **/
+uint32_t FileSystem::initializedInodeBlocks(const SuperBlock& super) {
+    if(super.features & FEATURE_LAZY_INODES) {
+        return super.inode_watermark;
+    }
+    return super.inode_blocks;
 }
 
-ssize_t FileSystem::read(size_t inode_number, char *data, size_t length, size_t offset) {
-    if(!disk_ || !free_blocks_ || !data) {
-        return -1;
+/**
+ * Write back every inode block touched since the last store, one write
+ * per block no matter how many of its inodes changed.
+ * On a quick formatted image a dirty block past the watermark raises it,
+ * and every block in between is written too so that all blocks below the
+ * watermark are initialized.
+ **/
+bool FileSystem::storeInodes() {
+    if(!disk_ || !inodes_) {
+        return false;
     }
-    if(inode_number >= meta_data_.inodes) {
-        return -1;
+    uint32_t watermark = initializedInodeBlocks(meta_data_);
+    for(uint32_t i = meta_data_.inode_blocks; i > watermark; --i) {
+        if(dirty_inode_blocks_[i - 1]) {
+            for(uint32_t j = watermark; j < i; ++j) {
+                if(!dirty_inode_blocks_[j]) {
+                    dirty_inode_blocks_[j] = true;
+                    dirty_inode_count_++;
+                }
+            }
+            watermark = i;
+            break;
+        }
     }
-    size_t blockIdx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offsetInBlock   = inode_number % INODES_PER_BLOCK;
-    Block block = {0};
-    if(disk_->read(blockIdx, block.data) != Disk::BLOCK_SIZE) {
-        return -1;
+    bool ok = true;
+    for(uint32_t i = 0; i < meta_data_.inode_blocks; ++i) {
+        if(!dirty_inode_blocks_[i]) {
+            continue;
+        }
+        if(!writeInodeBlock(i)) {
+            printf("Failed to write inode block %u.\n", 1 + i);
+            ok = false;
+            continue;
+        }
+        dirty_inode_blocks_[i] = false;
+        dirty_inode_count_--;
     }
-    Inode* inode = &block.inodes[inode_number];
-    if(inode->valid != 1) {
-        return -1;
+    if(ok && watermark > initializedInodeBlocks(meta_data_)) {
+        meta_data_.inode_watermark = watermark;
+        Block block = {0};
+        block.super = meta_data_;
+        if(!writeMeta(0, block.data)) {
+            printf("Failed to write super block.\n");
+            ok = false;
+        }
     }
+    return ok;
+}
 
-    // Calculate total bytes to read
-    size_t total_bytes = length;
-    if(offset + length > inode->size) {
-        total_bytes = inode->size - offset;
+/**
+ * Write everything back. Callers that were waiting while another sync()
+ * ran share its result, their changes were made before it started; with
+ * a journal that makes concurrent syncs cost one commit between them.
+ **/
+bool FileSystem::sync() {
+    OpTimer timer(&stats_, Stats::OP_SYNC);
+    TraceCall call(trace_, Trace::OP_SYNC);
+    if(!disk_ || !inodes_) {
+        call.done(timer.done(-1));
+        return false;
     }
-    if(total_bytes <= 0) {
-        return 0;
+    uint64_t ticket = commits_;
+    WriteLock guard(&fs_lock_);
+    // commits_ only moves under the lock, so a sync that bumped it after
+    // the ticket was taken started after this caller's changes
+    if(commits_ > ticket) {
+        call.done(timer.done(last_sync_ok_ ? 0 : -1));
+        return last_sync_ok_;
     }
+    commits_++;
+    bool ok = flushAll();
+    if(meta_data_.features & FEATURE_JOURNAL) {
+        if(meta_data_.features & FEATURE_DEDUP) {
+            releaseRetiredRefs();
+        }
+        releaseRetired();
+        releaseRetiredTails();
+    }
+    ok = storeInodes() && ok;
+    ok = storeBitmap() && ok;
+    if(meta_data_.features & FEATURE_JOURNAL) {
+        ok = commitJournal() && ok;
+    } else {
+        ok = disk_->flush() && ok;
+    }
+    last_sync_ok_ = ok;
+    call.done(timer.done(ok ? 0 : -1));
+    return ok;
+}
 
-    size_t bytes_read = 0;
-    // Calculate starting block and offset within blocks of this file
-    size_t current_block_idx = offset / Disk::BLOCK_SIZE;
-    size_t block_offset      = offset % Disk::BLOCK_SIZE;
+void FileSystem::unmount() {
+    TraceCall call(trace_, Trace::OP_UNMOUNT);
+    // write back everything still cached for this disk, then mark the
+    // bitmap, and the dedup index, trustworthy for the next mount
+    if(disk_ && inodes_) {
+        if(sync() && meta_data_.bitmap_blocks > 0 &&
+           (!(meta_data_.features & FEATURE_DEDUP) || storeIndex())) {
+            meta_data_.state = STATE_CLEAN;
+            storeSuperBlock();
+        }
+    }
+    release();
+}
 
-    Block data_block = {0};
-    while(bytes_read < total_bytes && current_block_idx < POINTERS_PER_INODE) {
-        size_t bIndex = inode->direct[current_block_idx];
-        if(bIndex != 0) {
-            // read the data block
-            if(disk_->read(bIndex, data_block.data) != Disk::BLOCK_SIZE) {
-                return -1;
-            }
-            // Calculate bytes to copy from this block
-            size_t bytes_to_copy = Disk::BLOCK_SIZE - block_offset;
-            if(bytes_to_copy > total_bytes - bytes_read) {
-                bytes_to_copy = total_bytes - bytes_read;
+/**
+ * Drop all mount state without writing anything back.
+ **/
+void FileSystem::release() {
+    stopReadahead();
+    free_blocks_.release();
+    if(inode_locks_) {
+        for(uint32_t i = 0; i < meta_data_.inodes; ++i) {
+            pthread_rwlock_destroy(&inode_locks_[i]);
+        }
+        free(inode_locks_);
+        inode_locks_ = nullptr;
+    }
+    // handles still open are gone with the mount, and so is any data
+    // they still buffer
+    if(open_files_) {
+        for(uint32_t i = 0; i < meta_data_.inodes; ++i) {
+            freeHandle(open_files_[i]);
+        }
+        free(open_files_);
+        open_files_ = nullptr;
+    }
+    if(streams_) {
+        free(streams_);
+        streams_ = nullptr;
+    }
+    if(inodes_) {
+        free(inodes_);
+        inodes_ = nullptr;
+    }
+    if(dirty_inode_blocks_) {
+        free(dirty_inode_blocks_);
+        dirty_inode_blocks_ = nullptr;
+    }
+    delayed_blocks_ = 0;
+    buffered_blocks_ = 0;
+    free_hint_ = 0;
+    // whatever was not committed is lost, as in a crash
+    pthread_mutex_lock(&journal_lock_);
+    for(std::map<size_t, char*>::iterator it = staged_.begin(); it != staged_.end(); ++it) {
+        free(it->second);
+    }
+    staged_.clear();
+    pthread_mutex_unlock(&journal_lock_);
+    retired_.clear();
+    retired_blocks_ = 0;
+    pthread_mutex_lock(&tail_lock_);
+    tails_.clear();
+    retired_tails_.clear();
+    pthread_mutex_unlock(&tail_lock_);
+    pthread_mutex_lock(&alloc_lock_);
+    refs_.clear();
+    retired_refs_.clear();
+    index_.clear();
+    indexed_.clear();
+    pthread_mutex_unlock(&alloc_lock_);
+    dirty_inode_count_ = 0;
+    pthread_mutex_lock(&dentry_lock_);
+    dentries_.clear();
+    pthread_mutex_unlock(&dentry_lock_);
+    disk_ = nullptr;
+    meta_data_ = (SuperBlock){0};
+}
+
+ssize_t FileSystem::create() {
+    OpTimer timer(&stats_, Stats::OP_CREATE);
+    TraceCall call(trace_, Trace::OP_CREATE);
+    return call.done(timer.done(createFile()));
+}
+
+/**
+ * New inode with the content of inode_number, sharing its blocks until
+ * either file is written. Needs a FORMAT_DEDUP image, see cloneFile().
+ **/
+ssize_t FileSystem::clone(size_t inode_number) {
+    TraceCall call(trace_, Trace::OP_CLONE, inode_number);
+    return call.done(cloneFile(inode_number));
+}
+
+ssize_t FileSystem::createFile() {
+    if(!disk_ || !inodes_) {
+        return -1;
+    }
+    commitIfFull();
+
+    ReadLock fs_guard(&fs_lock_);
+    MutexLock table_guard(&table_lock_);
+
+    // find a free inode, starting where the last search stopped so
+    // filling a large table stays linear
+    uint32_t skipped = meta_data_.inodes;
+    for(uint32_t inode = free_hint_; inode < meta_data_.inodes; ++inode) {
+        if(inodes_[inode].valid == 1) {
+            continue;
+        }
+        // a free inode can still be locked by a late reader or by the
+        // remove() that freed it, don't wait for it
+        if(pthread_rwlock_trywrlock(&inode_locks_[inode]) != 0) {
+            skipped = std::min(skipped, inode);
+            continue;
+        }
+        // clear all pointers
+        memset(&inodes_[inode], 0, sizeof(Inode));
+        inodes_[inode].valid = 1;
+        dirtyInode(inode);
+        pthread_rwlock_unlock(&inode_locks_[inode]);
+        free_hint_ = std::min(skipped, inode + 1);
+        return (ssize_t)inode;
+    }
+    free_hint_ = skipped;
+    return -1;
+}
+
+bool FileSystem::remove(size_t inode_number) {
+    OpTimer timer(&stats_, Stats::OP_REMOVE);
+    TraceCall call(trace_, Trace::OP_REMOVE, inode_number);
+    bool ok = removeFile(inode_number);
+    call.done(timer.done(ok ? 0 : -1));
+    return ok;
+}
+
+bool FileSystem::removeFile(size_t inode_number) {
+    if(!disk_ || !inodes_) {
+        return false;
+    }
+    if(inode_number >= meta_data_.inodes) {
+        return false;
+    }
+    commitIfFull();
+    ReadLock fs_guard(&fs_lock_);
+    WriteLock inode_guard(&inode_locks_[inode_number]);
+    // Check if this inode is free
+    Inode* inode = &inodes_[inode_number];
+    if(inode->valid != 1) {
+        return false;
+    }
+    // an open inode is pinned, data buffered without open() is dropped
+    Handle* file = open_files_[inode_number];
+    if(file && file->refs > 0) {
+        return false;
+    }
+    if(file) {
+        open_files_[inode_number] = nullptr;
+        freeHandle(file);
+    }
+    // a packed file owns no blocks, at most tail slots
+    if(packed(inode)) {
+        unpackInode(inode_number);
+    }
+    // Release blocks in runs of neighbouring blocks
+    Run run = {0, 0};
+    if(meta_data_.features & FEATURE_EXTENTS) {
+        std::vector<Extent> extents;
+        if(!loadExtents(inode, extents)) {
+            return false;
+        }
+        ExtentMap* map = extentMap(inode);
+        if(map->block != 0) {
+            retireBlocks(map->block, 1);
+        }
+        for(size_t i = 0; i < extents.size(); ++i) {
+            retireBlocks(extents[i].start, extents[i].length);
+        }
+        // leaves the pointer fields below all zero
+        memset(map, 0, sizeof(ExtentMap));
+    }
+    // with FEATURE_DEDUP pointer blocks may be shared with a clone, each
+    // lets go of what it points to only with its last reference
+    bool shared = (meta_data_.features & FEATURE_DEDUP) != 0;
+    std::vector<uint32_t> tree;
+    if(!shared && (!treeBlocks(inode->indirect, 1, tree) ||
+                   !treeBlocks(inode->double_indirect, 2, tree) ||
+                   !treeBlocks(inode->triple_indirect, 3, tree))) {
+        return false;
+    }
+    // Release direct blocks
+    for(int i = 0; i < POINTERS_PER_INODE; ++i) {
+        if(inode->direct[i] != 0) {
+            if(inode->direct[i] < disk_->getBlockNum() ||
+               ((meta_data_.features & FEATURE_COMPRESSED) && compressedPointer(inode->direct[i]))) {
+                releasePointer(run, inode->direct[i]);
+            }else {
+                printf("Unexpected error in direct block\n");
             }
-            // Copy data to buffer
-            memcpy(data + bytes_read, data_block.data + block_offset, bytes_to_copy);
-            bytes_read += bytes_to_copy;
         }
+        inode->direct[i] = 0;
+    }
+    // Release pointer blocks, each usually sits right in front of the data it points to
+    for(size_t i = 0; i < tree.size(); ++i) {
+        releasePointer(run, tree[i]);
+    }
+    if(shared) {
+        releaseBlock(run, inode->indirect, 1);
+        releaseBlock(run, inode->double_indirect, 2);
+        releaseBlock(run, inode->triple_indirect, 3);
+    }
+    inode->indirect        = 0;
+    inode->double_indirect = 0;
+    inode->triple_indirect = 0;
+    releaseBlock(run, 0);
+    pthread_mutex_lock(&ra_lock_);
+    memset(&streams_[inode_number], 0, sizeof(Stream));
+    pthread_mutex_unlock(&ra_lock_);
 
-        current_block_idx++;
-        block_offset = 0; /*set offset to 0*/
+    // mark inode as free
+    MutexLock table_guard(&table_lock_);
+    inode->valid = 0;
+    inode->size  = 0;
+    dirtyInode(inode_number);
+    free_hint_ = std::min(free_hint_, (uint32_t)inode_number);
+
+    return true;
+}
+
+/**
+ * Build the handle of inode_number and register it in open_files_, with
+ * no references yet. Caller holds the inode write lock.
+ **/
+FileSystem::Handle* FileSystem::newHandle(size_t inode_number) {
+    // block aligned, the pointers go to the disk as they are
+    void* mem = nullptr;
+    if(posix_memalign(&mem, Disk::BLOCK_SIZE, sizeof(Handle)) != 0) {
+        return nullptr;
     }
-    
-    // Read data from indirect block if needed
-    if(bytes_read < total_bytes && inode->indirect != 0) {
-        data_block = {0};
-        Block indirect_block = {0};
-        if(disk_->read(inode->indirect, indirect_block.data) != Disk::BLOCK_SIZE) {
-            return -1;
+    Handle* handle = new (mem) Handle();
+    memset(handle->pointers, 0, sizeof(handle->pointers));
+    Inode* inode = &inodes_[inode_number];
+    uint32_t cached = cachedBlock(inode);
+    if(cached != 0 && !readMeta(cached, (char*)handle->pointers)) {
+        handle->~Handle();
+        free(handle);
+        return nullptr;
+    }
+    handle->inode_number      = inode_number;
+    handle->refs              = 0;
+    handle->reserved          = 0;
+    open_files_[inode_number] = handle;
+    return handle;
+}
+
+/**
+ * Free handle together with any data it still buffers.
+ **/
+void FileSystem::freeHandle(Handle* handle) {
+    if(!handle) {
+        return;
+    }
+    std::map<size_t, char*>::iterator it;
+    for(it = handle->dirty.begin(); it != handle->dirty.end(); ++it) {
+        free(it->second);
+    }
+    buffered_blocks_ -= handle->dirty.size();
+    if(handle->reserved > 0 && inodes_) {
+        unreserveBlocks(handle->reserved);
+    }
+    handle->~Handle();
+    free(handle);
+}
+
+/**
+ * Write the buffered data of inode_number to disk. Blocks are allocated
+ * here, in runs that follow the file's existing blocks, all data goes out
+ * in one writev() and the indirect block is written once. A small file on
+ * a FEATURE_PACKED image is packed instead, see pack.cpp, and on a
+ * FEATURE_DEDUP image blocks already on disk are shared, see dedup.cpp.
+ * The inode itself is only marked dirty, storeInodes() writes it. A handle
+ * nobody has open is freed afterwards. Caller holds the inode write lock, or the file
+ * system lock exclusively.
+ **/
+bool FileSystem::flushInode(size_t inode_number) {
+    Handle* file = open_files_[inode_number];
+    if(!file) {
+        return true;
+    }
+    bool ok = true;
+    if(!file->dirty.empty() && file->dirty.begin()->first == 0 && file->dirty.size() == 1 &&
+       packable(inode_number) && packInode(inode_number, file->dirty.begin()->second)) {
+        unreserveBlocks(file->reserved);
+        file->reserved = 0;
+        file->reserved_pointers.clear();
+        free(file->dirty.begin()->second);
+        buffered_blocks_--;
+        file->dirty.clear();
+    }
+    if(!file->dirty.empty()) {
+        Inode* inode = &inodes_[inode_number];
+        // grown out of its slots, or no slots to be had
+        if(packed(inode)) {
+            unpackInode(inode_number);
+        }
+        std::vector<size_t> blocks(file->dirty.size());
+        std::vector<char*>  bufs;
+        bufs.reserve(file->dirty.size());
+        // compressed or shared pointers the blocks get, then the pointers
+        // they had
+        bool compress = (meta_data_.features & FEATURE_COMPRESSED) != 0;
+        bool dedup    = (meta_data_.features & FEATURE_DEDUP) != 0;
+        std::vector<uint32_t> replace((compress || dedup) ? file->dirty.size() : 0);
+        std::vector<uint32_t> shared(dedup ? file->dirty.size() : 0);
+        std::vector<uint64_t> fingerprints(dedup ? file->dirty.size() : 0);
+
+        // map each run of consecutive file blocks in one go
+        Run reserved = {0, 0};
+        bool indirect_pending = false;
+        size_t mapped = 0;
+        std::map<size_t, char*>::iterator it = file->dirty.begin();
+        while(it != file->dirty.end()) {
+            size_t first = it->first;
+            size_t count = 0;
+            for(; it != file->dirty.end() && it->first == first + count; ++it) {
+                bufs.push_back(it->second);
+                count++;
+            }
+            if(compress) {
+                compressBlocks(&bufs[mapped], count, &replace[mapped]);
+            }
+            if(dedup) {
+                dedupBlocks(&bufs[mapped], count, &replace[mapped], &fingerprints[mapped]);
+                memcpy(&shared[mapped], &replace[mapped], count * sizeof(uint32_t));
+            }
+            ssize_t done = mapBlocks(inode_number, first, count, &blocks[mapped], &reserved, &indirect_pending,
+                                     (compress || dedup) ? &replace[mapped] : nullptr);
+            if(done != (ssize_t)count) {
+                // slots and shared blocks of blocks that were not mapped
+                // are unused, after an I/O error the next mount finds which
+                if(compress && done >= 0) {
+                    MutexLock guard(&tail_lock_);
+                    for(size_t i = mapped + done; i < mapped + count; ++i) {
+                        if(replace[i] != 0) {
+                            freeTail(pointerTail(replace[i]));
+                        }
+                    }
+                }
+                if(dedup && done >= 0) {
+                    Run release = {0, 0};
+                    for(size_t i = mapped + done; i < mapped + count; ++i) {
+                        releaseBlock(release, replace[i]);
+                    }
+                    releaseBlock(release, 0);
+                }
+                if(done > 0) {
+                    mapped += done;
+                }
+                ok = false;
+                break;
+            }
+            mapped += count;
+        }
+        if(reserved.length > 0) {
+            freeBlocks(reserved.start, reserved.length);
+        }
+        unreserveBlocks(file->reserved);
+        file->reserved = 0;
+        file->reserved_pointers.clear();
+
+        if(indirect_pending && !writeMeta(cachedBlock(inode), (char*)file->pointers)) {
+            ok = false;
         }
-        // NOTE: indirect_idx = 0 here is error
-        size_t indirect_idx = current_block_idx - POINTERS_PER_INODE;
-        while(bytes_read < total_bytes && indirect_idx < POINTERS_PER_BLOCK) {
-            int bIndex = indirect_block.pointers[indirect_idx];
-            if(bIndex != 0) {
-                // Read the data block
-                if(disk_->read(bIndex, data_block.data) != Disk::BLOCK_SIZE) {
-                    return -1;
+        // compressed and shared blocks are on disk already, and what they
+        // replaced goes
+        if(compress || dedup) {
+            Run release = {0, 0};
+            size_t plain = 0;
+            for(size_t i = 0; i < mapped; ++i) {
+                if(replace[i] != 0) {
+                    releasePointer(release, replace[i]);
                 }
-                // Calculate bytes to copy from this block
-                size_t bytes_to_copy = Disk::BLOCK_SIZE - block_offset;
-                if(bytes_to_copy > total_bytes - bytes_read) {
-                    bytes_to_copy = total_bytes - bytes_read;
+                if(!compressedPointer((uint32_t)blocks[i]) && !(dedup && shared[i] != 0)) {
+                    blocks[plain] = blocks[i];
+                    bufs[plain]   = bufs[i];
+                    if(dedup) {
+                        fingerprints[plain] = fingerprints[i];
+                    }
+                    plain++;
                 }
-                // Copy data to buffer
-                memcpy(data + bytes_read, data_block.data + block_offset, bytes_to_copy);
-                bytes_read += bytes_to_copy;
             }
-            indirect_idx++;
-            block_offset = 0;          
+            releaseBlock(release, 0);
+            mapped = plain;
+        }
+        if(mapped > 0 && disk_->writev(blocks.data(), bufs.data(), mapped) < 0) {
+            ok = false;
+        }else if(dedup) {
+            indexBlocks(blocks.data(), fingerprints.data(), mapped);
+        }
+        if(!ok) {
+            printf("Failed to write back inode %lu\n", inode_number);
+        }
+        for(it = file->dirty.begin(); it != file->dirty.end(); ++it) {
+            free(it->second);
         }
+        buffered_blocks_ -= file->dirty.size();
+        file->dirty.clear();
     }
-    if(bytes_read != total_bytes) {
-        printf("FS read: bytes unmatched!\n");
+    if(file->refs == 0) {
+        open_files_[inode_number] = nullptr;
+        freeHandle(file);
     }
-    
-    return (ssize_t)bytes_read;
+    return ok;
 }
 
-ssize_t FileSystem::write(size_t inode_number, char *data, size_t length, size_t offset) {
-    if(!disk_ || !free_blocks_ || !data) {
-        return -1;
+/**
+ * Flush every inode with buffered data. With a journal, what is written
+ * back so far is committed whenever the next sync() might no longer fit
+ * in one transaction. Caller holds the file system lock exclusively.
+ **/
+bool FileSystem::flushAll() {
+    bool ok = true;
+    bool journal = (meta_data_.features & FEATURE_JOURNAL) != 0;
+    for(uint32_t i = 0; i < meta_data_.inodes; ++i) {
+        if(open_files_[i]) {
+            ok = flushInode(i) && ok;
+            if(journal && pendingBlocks() > journalCapacity() / 2) {
+                ok = commitStep() && ok;
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * Open inode_number, returning the handle to pass to read/write/close.
+ * Opening an inode that is already open returns the same handle. An
+ * open inode cannot be removed, and its writes stay buffered until the
+ * last close() unless sync() or buffer pressure flushes them earlier.
+ **/
+FileSystem::Handle* FileSystem::open(size_t inode_number) {
+    TraceCall call(trace_, Trace::OP_OPEN, inode_number);
+    Handle* handle = openFile(inode_number);
+    call.done(handle ? 0 : -1);
+    return handle;
+}
+
+FileSystem::Handle* FileSystem::openFile(size_t inode_number) {
+    if(!disk_ || !inodes_) {
+        return nullptr;
     }
     if(inode_number >= meta_data_.inodes) {
+        return nullptr;
+    }
+    ReadLock fs_guard(&fs_lock_);
+    WriteLock inode_guard(&inode_locks_[inode_number]);
+    Inode* inode = &inodes_[inode_number];
+    if(inode->valid != 1) {
+        return nullptr;
+    }
+    Handle* handle = open_files_[inode_number];
+    if(!handle) {
+        handle = newHandle(inode_number);
+        if(!handle) {
+            return nullptr;
+        }
+    }
+    handle->refs++;
+    return handle;
+}
+
+ssize_t FileSystem::read(Handle* handle, char *data, size_t length, size_t offset) {
+    if(!handle) {
         return -1;
     }
-    size_t blockIdx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offsetInBlock   = inode_number % INODES_PER_BLOCK;
-    Block block = {0};
-    if(disk_->read(blockIdx, block.data) != Disk::BLOCK_SIZE) {
+    return read(handle->inode_number, data, length, offset);
+}
+
+ssize_t FileSystem::write(Handle* handle, char *data, size_t length, size_t offset) {
+    if(!handle) {
+        return -1;
+    }
+    return write(handle->inode_number, data, length, offset);
+}
+
+void FileSystem::close(Handle* handle) {
+    if(!handle || !inodes_) {
+        return;
+    }
+    size_t inode_number = handle->inode_number;
+    TraceCall call(trace_, Trace::OP_CLOSE, inode_number);
+    ReadLock fs_guard(&fs_lock_);
+    WriteLock inode_guard(&inode_locks_[inode_number]);
+    if(--handle->refs == 0) {
+        flushInode(inode_number);
+    }
+}
+
+ssize_t FileSystem::stat(size_t inode_number) {
+    OpTimer timer(&stats_, Stats::OP_STAT);
+    TraceCall call(trace_, Trace::OP_STAT, inode_number);
+    return call.done(timer.done(statFile(inode_number)));
+}
+
+ssize_t FileSystem::statFile(size_t inode_number) {
+    if(!disk_ || !inodes_) {
+        return -1;
+    }
+    if(inode_number >= meta_data_.inodes) {
         return -1;
     }
-    Inode* inode = &block.inodes[inode_number];
+    ReadLock fs_guard(&fs_lock_);
+    ReadLock inode_guard(&inode_locks_[inode_number]);
+    Inode* inode = &inodes_[inode_number];
     if(inode->valid != 1) {
         return -1;
     }
 
-    size_t current_block_idx = offset / Disk::BLOCK_SIZE;
-    size_t block_offset      = offset % Disk::BLOCK_SIZE;
+    return (ssize_t)inode->size;
+}
 
-    size_t bytes_written = 0;
-    Block data_block = {0};
-    // direct blocks
-    while(bytes_written < length && current_block_idx < POINTERS_PER_INODE) {
-        int bIndex = inode->direct[current_block_idx];
-        if(bIndex == 0) {
-            // alloc new block
-            ssize_t new_block = allocBlock();
-            if(new_block == -1) {
-                return -1;
+/**
+ * Append block and, for a pointer block at depth (1 = indirect, 2 =
+ * double, 3 = triple indirect), every block below it to blocks, each
+ * pointer block ahead of what it points to. Numbers beyond the disk are
+ * skipped, compressed pointers are passed on as they are.
+ **/
+bool FileSystem::treeBlocks(uint32_t block, size_t depth, std::vector<uint32_t>& blocks) {
+    if(block == 0 || block >= meta_data_.blocks) {
+        return true;
+    }
+    blocks.push_back(block);
+    Block pointer_block;
+    if(!readMeta(block, pointer_block.data)) {
+        return false;
+    }
+    for(uint32_t i = 0; i < POINTERS_PER_BLOCK; ++i) {
+        uint32_t pointer = pointer_block.pointers[i];
+        if(depth > 1) {
+            if(!treeBlocks(pointer, depth - 1, blocks)) {
+                return false;
             }
-            inode->direct[current_block_idx] = (uint32_t)new_block;
+        }else if((pointer != 0 && pointer < meta_data_.blocks) ||
+                 ((meta_data_.features & FEATURE_COMPRESSED) && compressedPointer(pointer))) {
+            blocks.push_back(pointer);
         }
-        // Read existing data block if we're writing to a non-empty block
-        if(block_offset > 0) {
-            if(disk_->read(inode->direct[current_block_idx], data_block.data) != Disk::BLOCK_SIZE) {
-                return -1;
+    }
+    return true;
+}
+
+/**
+ * Largest file size in blocks. The old inode format has no room for more
+ * than the single indirect block, extents count file blocks in 32 bits.
+ **/
+size_t FileSystem::maxFileBlocks() const {
+    if(meta_data_.features & FEATURE_EXTENTS) {
+        return UINT32_MAX;
+    }
+    size_t blocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    if(meta_data_.features & FEATURE_LARGE_FILES) {
+        blocks += (size_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+        blocks += (size_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    }
+    return blocks;
+}
+
+/**
+ * Write level back if it was changed.
+ **/
+bool FileSystem::storeLevel(Level& level) {
+    if(!level.dirty) {
+        return true;
+    }
+    if(!writeMeta(level.block, (char*)level.pointers)) {
+        return false;
+    }
+    level.dirty = false;
+    return true;
+}
+
+/**
+ * Pointer block a handle keeps in memory: the indirect block, or the
+ * extent block with FEATURE_EXTENTS. 0 if the inode has none.
+ **/
+uint32_t FileSystem::cachedBlock(Inode* inode) {
+    if(packed(inode)) {
+        return 0;
+    }
+    if(meta_data_.features & FEATURE_EXTENTS) {
+        return extentMap(inode)->block;
+    }
+    return inode->indirect;
+}
+
+/**
+ * Copy the extents of inode, wherever they are kept, into extents.
+ **/
+bool FileSystem::loadExtents(Inode* inode, std::vector<Extent>& extents) {
+    ExtentMap* map = extentMap(inode);
+    if(map->block == 0) {
+        size_t count = map->count < INLINE_EXTENTS ? map->count : INLINE_EXTENTS;
+        extents.assign(map->extents, map->extents + count);
+        return true;
+    }
+    if(map->block >= meta_data_.blocks) {
+        return true;
+    }
+    Block extent_block;
+    if(!readMeta(map->block, extent_block.data)) {
+        return false;
+    }
+    size_t count = map->count < EXTENTS_PER_BLOCK ? map->count : EXTENTS_PER_BLOCK;
+    extents.assign(extent_block.extents, extent_block.extents + count);
+    return true;
+}
+
+/**
+ * mapBlocks() for FEATURE_EXTENTS. The sorted extent list is searched
+ * once for first and then walked, so a range inside one extent costs a
+ * single lookup whatever its length. New blocks extend the extent in
+ * front of them (or behind them) when they are physically adjacent, and
+ * start a new extent otherwise. Extents live in the inode until a fourth
+ * one is needed, then they all move to an extent block; once that is
+ * full too the mapping stops short. While the inode is open the extent
+ * block comes from the handle, and its write can be left to the caller
+ * through block_pending.
+ **/
+ssize_t FileSystem::mapExtents(size_t inode_number, size_t first, size_t count, size_t *blocks, Run *reserved,
+                               bool *block_pending) {
+    Inode* inode = &inodes_[inode_number];
+    Handle* file = open_files_[inode_number];
+    ExtentMap* map = extentMap(inode);
+    Block extent_block;
+    Extent* list = map->extents;
+    uint32_t capacity = INLINE_EXTENTS;
+    if(map->block != 0) {
+        list = file ? (Extent*)file->pointers : extent_block.extents;
+        capacity = EXTENTS_PER_BLOCK;
+        if(!file && !readMeta(map->block, extent_block.data)) {
+            return -1;
+        }
+    }
+    bool block_dirty = false;
+    size_t max_blocks = maxFileBlocks();
+
+    // first extent that ends after first
+    size_t low = 0, high = map->count;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if((size_t)list[mid].file_block + list[mid].length <= first) {
+            low = mid + 1;
+        }else {
+            high = mid;
+        }
+    }
+    size_t e = low;
+
+    ssize_t goal = -1;
+    if(e > 0) {
+        goal = list[e - 1].start + list[e - 1].length;
+    }
+    size_t mapped = 0;
+    while(mapped < count) {
+        size_t idx = first + mapped;
+        if(idx >= max_blocks) {
+            break;
+        }
+        while(e < map->count && (size_t)list[e].file_block + list[e].length <= idx) {
+            e++;
+        }
+        if(e < map->count && list[e].file_block <= idx) {
+            // the rest of extent e maps in one go
+            size_t n = list[e].file_block + list[e].length - idx;
+            if(n > count - mapped) {
+                n = count - mapped;
+            }
+            size_t start = list[e].start + (idx - list[e].file_block);
+            for(size_t i = 0; i < n; ++i) {
+                blocks[mapped + i] = start + i;
+            }
+            mapped += n;
+            goal = start + n;
+            continue;
+        }
+        if(!reserved) {
+            // a hole reaches up to the next extent
+            size_t n = count - mapped;
+            if(e < map->count && list[e].file_block - idx < n) {
+                n = list[e].file_block - idx;
+            }
+            memset(&blocks[mapped], 0, n * sizeof(size_t));
+            mapped += n;
+            continue;
+        }
+
+        ssize_t new_block = takeBlock(*reserved, count - mapped, goal);
+        if(new_block == -1) {
+            break;
+        }
+        Extent* prev = (e > 0) ? &list[e - 1] : nullptr;
+        Extent* next = (e < map->count) ? &list[e] : nullptr;
+        if(prev && prev->file_block + prev->length == idx && prev->start + prev->length == (size_t)new_block) {
+            prev->length++;
+            // the hole between prev and next may be closed now
+            if(next && next->file_block == idx + 1 && next->start == (size_t)new_block + 1) {
+                prev->length += next->length;
+                memmove(next, next + 1, (map->count - e - 1) * sizeof(Extent));
+                map->count--;
+            }
+        }else if(next && next->file_block == idx + 1 && next->start == (size_t)new_block + 1) {
+            next->file_block--;
+            next->start--;
+            next->length++;
+        }else {
+            if(map->count == capacity && capacity == INLINE_EXTENTS) {
+                // move the extents out of the inode
+                ssize_t extent_block_nr = allocBlock();
+                if(extent_block_nr == -1) {
+                    reserved->start--;
+                    reserved->length++;
+                    break;
+                }
+                Extent* moved = file ? (Extent*)file->pointers : extent_block.extents;
+                memset(moved, 0, Disk::BLOCK_SIZE);
+                memcpy(moved, map->extents, map->count * sizeof(Extent));
+                memset(map->extents, 0, sizeof(map->extents));
+                map->block = (uint32_t)extent_block_nr;
+                list = moved;
+                capacity = EXTENTS_PER_BLOCK;
+                block_dirty = true;
+            }
+            if(map->count == capacity) {
+                // give the block back to the reservation it came from
+                printf("Extent list of inode %lu is full\n", inode_number);
+                reserved->start--;
+                reserved->length++;
+                break;
             }
+            memmove(&list[e + 1], &list[e], (map->count - e) * sizeof(Extent));
+            list[e].file_block = (uint32_t)idx;
+            list[e].start      = (uint32_t)new_block;
+            list[e].length     = 1;
+            map->count++;
         }
-        // Calculate bytes to copy to this block
-        size_t bytes_to_copy = Disk::BLOCK_SIZE - block_offset;
-        if(bytes_to_copy > length - bytes_written) {
-            bytes_to_copy = length - bytes_written;
+        dirtyInode(inode_number);
+        if(map->block != 0) {
+            block_dirty = true;
         }
-        // copy data to buffer
-        memcpy(data_block.data + block_offset, data + bytes_written, bytes_to_copy);
-        // Write data block back to disk
-        if(disk_->write(inode->direct[current_block_idx], data_block.data) != Disk::BLOCK_SIZE) {
+        blocks[mapped++] = (size_t)new_block;
+        goal = new_block + 1;
+    }
+
+    // Write the extent block once for all changes
+    if(block_dirty && file && block_pending) {
+        *block_pending = true;
+    }else if(block_dirty) {
+        if(!writeMeta(map->block, (char*)list)) {
             return -1;
         }
-        bytes_written += bytes_to_copy;
-        current_block_idx++;
-        block_offset = 0;
     }
+    return (ssize_t)mapped;
+}
 
-    // Handle indirect blocks if needed
-    data_block = {0};
-    if(bytes_written < length) {
-        Block indirect_block = {0};
-        size_t indirect_idx = current_block_idx - POINTERS_PER_BLOCK;
-        // Allocate indirect block if needed
-        if(inode->indirect == 0) {
-            ssize_t new_block = allocBlock();
-            if(new_block == -1)
-                return -1;
-            inode->indirect = new_block;
-            memset(indirect_block.data, 0, Disk::BLOCK_SIZE);
-            if(disk_->write(inode->indirect, indirect_block.data) != Disk::BLOCK_SIZE) {
-                return -1;
-            }
+/**
+ * Translate count file blocks starting at file block first into disk
+ * block numbers, 0 standing for a hole. Past the direct pointers, blocks
+ * hang off the indirect block, then two levels of pointer blocks under the
+ * double indirect block, then three under the triple indirect block.
+ * With reserved, holes are filled with blocks taken from it and pointer
+ * blocks are created on demand. Each pointer block on the way is read
+ * once for the whole range and a modified one is written back once, when
+ * the walk leaves it or at the end; the indirect block of an open inode
+ * can be left to the caller through indirect_pending instead.
+ * While the inode is open its indirect pointers come from the handle
+ * instead of the disk, and new pointers are kept up to date there.
+ * A pointer block an INODE_SHARED inode may share with a clone is copied
+ * before it changes. With FEATURE_COMPRESSED a pointer may be a
+ * compressed pointer, which is
+ * returned as it is. replace, along with reserved, gives the pointer each
+ * block is to have instead, a compressed pointer or with FEATURE_DEDUP a
+ * block holding the same data, 0 for a block of its own; on return it
+ * holds the pointers given up, which the caller releases, or 0.
+ * Returns the number of blocks mapped, which is short of count when the
+ * maximum file size or the end of free space is reached.
+ **/
+ssize_t FileSystem::mapBlocks(size_t inode_number, size_t first, size_t count, size_t *blocks, Run *reserved,
+                              bool *indirect_pending, uint32_t *replace) {
+    // a packed file has no blocks until flushInode() unpacks it
+    if(packed(&inodes_[inode_number])) {
+        if(reserved) {
+            return -1;
+        }
+        memset(blocks, 0, count * sizeof(size_t));
+        return (ssize_t)count;
+    }
+    if(meta_data_.features & FEATURE_EXTENTS) {
+        return mapExtents(inode_number, first, count, blocks, reserved, indirect_pending);
+    }
+    Inode* inode = &inodes_[inode_number];
+    Handle* file = open_files_[inode_number];
+    size_t max_blocks = maxFileBlocks();
+
+    // one level per pointer block on a path: 0 for the indirect tree,
+    // 1-2 for the double and 3-5 for the triple indirect tree
+    const size_t LEVELS = 6;
+    Block buffers[LEVELS];
+    Level levels[LEVELS];
+    for(size_t i = 0; i < LEVELS; ++i) {
+        levels[i].block    = 0;
+        levels[i].pointers = buffers[i].pointers;
+        levels[i].dirty    = false;
+    }
+    if(file) {
+        levels[0].block    = inode->indirect;
+        levels[0].pointers = file->pointers;
+    }
+
+    // place new blocks right behind the previous block of the file
+    ssize_t goal = -1;
+    if(first > 0 && first <= POINTERS_PER_INODE && inode->direct[first - 1] != 0 &&
+       !compressedPointer(inode->direct[first - 1])) {
+        goal = inode->direct[first - 1] + 1;
+    }
+
+    size_t mapped = 0;
+    bool full = false;
+    for(; mapped < count; ++mapped) {
+        size_t idx = first + mapped;
+        if(idx >= max_blocks) {
+            break;
+        }
+        uint32_t* pointer = nullptr;            /* Where the block number of idx is kept */
+        Level*    parent  = nullptr;            /* Pointer block holding it, the inode if none */
+        if(idx < POINTERS_PER_INODE) {
+            pointer = &inode->direct[idx];
         }else {
-            // indirect block exist, read it
-            if(disk_->read(inode->indirect, indirect_block.data) != Disk::BLOCK_SIZE) {
-                return -1;
+            // pick the tree and the position within it
+            size_t index = idx - POINTERS_PER_INODE;
+            size_t span  = POINTERS_PER_BLOCK;
+            size_t depth = 1, base = 0;
+            pointer = &inode->indirect;
+            if(index >= span) {
+                index -= span;
+                span  *= POINTERS_PER_BLOCK;
+                depth  = 2;
+                base   = 1;
+                pointer = &inode->double_indirect;
+                if(index >= span) {
+                    index -= span;
+                    span  *= POINTERS_PER_BLOCK;
+                    depth  = 3;
+                    base   = 3;
+                    pointer = &inode->triple_indirect;
+                }
+            }
+            bool hole = false;
+            for(size_t d = 0; d < depth; ++d) {
+                Level* level = &levels[base + d];
+                if(*pointer == 0) {
+                    if(!reserved) {
+                        hole = true;
+                        break;
+                    }
+                    // a pointer block goes in front of the data it points to
+                    ssize_t new_block = takeBlock(*reserved, count - mapped + depth - d, goal);
+                    if(new_block == -1) {
+                        full = true;
+                        break;
+                    }
+                    if(!storeLevel(*level)) {
+                        return -1;
+                    }
+                    *pointer = (uint32_t)new_block;
+                    if(parent) {
+                        parent->dirty = true;
+                    }else {
+                        dirtyInode(inode_number);
+                    }
+                    level->block = (size_t)new_block;
+                    memset(level->pointers, 0, Disk::BLOCK_SIZE);
+                    level->dirty = true;
+                    goal = new_block + 1;
+                }else if(level->block != *pointer) {
+                    if(!storeLevel(*level) ||
+                       !readMeta(*pointer, (char*)level->pointers)) {
+                        return -1;
+                    }
+                    level->block = *pointer;
+                }
+                // a pointer block shared with a clone is copied before it
+                // changes, the copy takes a reference to what it points to
+                if(reserved && (inode->flags & INODE_SHARED) && !level->dirty && !ownBlock(*pointer)) {
+                    ssize_t new_block = takeBlock(*reserved, count - mapped + depth - d, goal);
+                    if(new_block == -1) {
+                        full = true;
+                        break;
+                    }
+                    if(!shareBlocks(level->pointers, POINTERS_PER_BLOCK)) {
+                        return -1;
+                    }
+                    Run release = {0, 0};
+                    releaseBlock(release, *pointer, depth - d);
+                    releaseBlock(release, 0);
+                    *pointer = (uint32_t)new_block;
+                    if(parent) {
+                        parent->dirty = true;
+                    }else {
+                        dirtyInode(inode_number);
+                    }
+                    level->block = (size_t)new_block;
+                    level->dirty = true;
+                    goal = new_block + 1;
+                }
+                span   /= POINTERS_PER_BLOCK;
+                parent  = level;
+                pointer = &level->pointers[index / span];
+                index  %= span;
+            }
+            if(full) {
+                break;
+            }
+            if(hole) {
+                blocks[mapped] = 0;
+                continue;
+            }
+            if(*pointer == 0 && pointer != parent->pointers && pointer[-1] != 0 && !compressedPointer(pointer[-1])) {
+                goal = pointer[-1] + 1;
             }
         }
 
-        // Write data to indirect blocks
-        while(bytes_written < length && indirect_idx < POINTERS_PER_BLOCK) {
-            int bIndex = indirect_block.pointers[indirect_idx];
-            if(bIndex == 0) {
-                ssize_t new_block = allocBlock();
-                if(new_block == -1)
-                    return -1;
-                indirect_block.pointers[indirect_idx] = (uint32_t)new_block;
-                // Write updated indirect block
-                if(disk_->write(inode->indirect, indirect_block.data) != Disk::BLOCK_SIZE) {
-                    return -1;
+        // a compressed or shared block is never rewritten in place
+        if(replace) {
+            uint32_t want = replace[mapped];
+            replace[mapped] = 0;
+            if(want != 0 || compressedPointer(*pointer) || !ownBlock(*pointer)) {
+                replace[mapped] = *pointer;
+                *pointer = want;
+                if(parent) {
+                    parent->dirty = true;
+                }else {
+                    dirtyInode(inode_number);
                 }
             }
-
-            // Read existing data block if we're writing to a non-empty block
-            if(block_offset > 0) {
-                if(disk_->read(indirect_block.pointers[indirect_idx], data_block.data) != Disk::BLOCK_SIZE) {
-                    return -1;
+        }
+        if(*pointer == 0 && reserved) {
+            ssize_t new_block = takeBlock(*reserved, count - mapped, goal);
+            if(new_block == -1) {
+                // keep the old block, no new one was asked for
+                if(replace) {
+                    *pointer = replace[mapped];
+                    replace[mapped] = 0;
                 }
+                break;
+            }
+            *pointer = (uint32_t)new_block;
+            if(parent) {
+                parent->dirty = true;
+            }else {
+                dirtyInode(inode_number);
             }
-            memset(data_block.data, 0, Disk::BLOCK_SIZE);
+        }
+        blocks[mapped] = *pointer;
+        if(*pointer != 0 && !compressedPointer(*pointer)) {
+            goal = *pointer + 1;
+        }
+    }
 
-            size_t bytes_to_copy = Disk::BLOCK_SIZE - block_offset;
-            if(bytes_to_copy > length - bytes_written) {
-                bytes_to_copy = length - bytes_written;
+    // Write updated pointer blocks once for all new pointers
+    for(size_t i = 0; i < LEVELS; ++i) {
+        if(i == 0 && file && levels[0].dirty && indirect_pending) {
+            *indirect_pending = true;
+            continue;
+        }
+        if(!storeLevel(levels[i])) {
+            return -1;
+        }
+    }
+    return (ssize_t)mapped;
+}
+
+ssize_t FileSystem::read(size_t inode_number, char *data, size_t length, size_t offset) {
+    OpTimer timer(&stats_, Stats::OP_READ);
+    TraceCall call(trace_, Trace::OP_READ, inode_number, length, offset);
+    return call.done(timer.done(readFile(inode_number, data, length, offset), true));
+}
+
+ssize_t FileSystem::readFile(size_t inode_number, char *data, size_t length, size_t offset) {
+    if(!disk_ || !inodes_ || !data) {
+        return -1;
+    }
+    if(inode_number >= meta_data_.inodes) {
+        return -1;
+    }
+    ReadLock fs_guard(&fs_lock_);
+    ReadLock inode_guard(&inode_locks_[inode_number]);
+    Inode* inode = &inodes_[inode_number];
+    if(inode->valid != 1) {
+        return -1;
+    }
+
+    // Calculate total bytes to read
+    if(offset >= inode->size) {
+        return 0;
+    }
+    size_t total_bytes = length;
+    if(offset + length > inode->size) {
+        total_bytes = inode->size - offset;
+    }
+    if(total_bytes == 0) {
+        return 0;
+    }
+    Handle* file = open_files_[inode_number];
+    bool buffered = file && !file->dirty.empty();
+    if(packed(inode) && !buffered) {
+        return readPacked(inode, data, total_bytes, offset);
+    }
+
+    // Calculate starting block, offset within it and blocks touched
+    size_t first_block_idx = offset / Disk::BLOCK_SIZE;
+    size_t head            = offset % Disk::BLOCK_SIZE;
+    size_t tail            = (head + total_bytes) % Disk::BLOCK_SIZE;
+    size_t count           = (head + total_bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+
+    std::vector<size_t> blocks(count);
+    if(mapBlocks(inode_number, first_block_idx, count, blocks.data(), nullptr) != (ssize_t)count) {
+        return -1;
+    }
+
+    // Whole blocks are read straight into data, a partial first or last
+    // block goes through a bounce buffer. Holes read as zeroes, buffered
+    // writes win over the disk, compressed blocks are decoded afterwards.
+    Block head_block, tail_block;
+    std::vector<size_t> io_blocks;
+    std::vector<char*>  io_bufs;
+    std::vector<size_t> compressed_blocks;
+    std::vector<char*>  compressed_bufs;
+    io_blocks.reserve(count);
+    io_bufs.reserve(count);
+    for(size_t i = 0; i < count; ++i) {
+        char* dest;
+        if(i == 0 && (head > 0 || (count == 1 && tail > 0))) {
+            dest = head_block.data;
+        }else if(i == count - 1 && tail > 0) {
+            dest = tail_block.data;
+        }else {
+            dest = data + i * Disk::BLOCK_SIZE - head;
+        }
+        if(buffered) {
+            std::map<size_t, char*>::iterator it = file->dirty.find(first_block_idx + i);
+            if(it != file->dirty.end()) {
+                memcpy(dest, it->second, Disk::BLOCK_SIZE);
+                continue;
             }
+        }
+        if(blocks[i] == 0) {
+            memset(dest, 0, Disk::BLOCK_SIZE);
+            continue;
+        }
+        if(compressedPointer(blocks[i])) {
+            compressed_blocks.push_back(blocks[i]);
+            compressed_bufs.push_back(dest);
+            continue;
+        }
+        io_blocks.push_back(blocks[i]);
+        io_bufs.push_back(dest);
+    }
+    if(!io_blocks.empty() && disk_->readv(io_blocks.data(), io_bufs.data(), io_blocks.size()) < 0) {
+        return -1;
+    }
+    Block scratch;
+    uint32_t scratch_block = 0;
+    for(size_t i = 0; i < compressed_blocks.size(); ++i) {
+        if(!readCompressed((uint32_t)compressed_blocks[i], compressed_bufs[i], scratch, &scratch_block)) {
+            printf("Damaged compressed block in inode %lu\n", inode_number);
+            return -1;
+        }
+    }
+
+    if(head > 0 || (count == 1 && tail > 0)) {
+        size_t bytes = Disk::BLOCK_SIZE - head;
+        if(bytes > total_bytes) {
+            bytes = total_bytes;
+        }
+        memcpy(data, head_block.data + head, bytes);
+    }
+    if(count > 1 && tail > 0) {
+        memcpy(data + (count - 1) * Disk::BLOCK_SIZE - head, tail_block.data, tail);
+    }
+
+    readahead(inode_number, offset, total_bytes);
+    return (ssize_t)total_bytes;
+}
+
+/**
+ * Sequential read detection. A read starting where the previous one on
+ * the same inode ended grows the inode's readahead window (doubling up to
+ * readahead_max_ blocks) and, once the reader gets within half a window
+ * of what was prefetched, queues the next window for the prefetch thread.
+ * Any other read switches readahead off for the inode until it turns
+ * sequential again. Caller holds the inode lock.
+ **/
+void FileSystem::readahead(size_t inode_number, size_t offset, size_t length) {
+    if(readahead_max_ == 0 || !ra_running_) {
+        return;
+    }
+    size_t max_window = readahead_max_;
+    if(disk_->cacheBlocks() > 0 && max_window > disk_->cacheBlocks() / 4) {
+        // leave most of the cache to the blocks actually in use
+        max_window = disk_->cacheBlocks() / 4;
+    }
+    if(max_window == 0) {
+        return;
+    }
+    size_t end_block   = (offset + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    size_t file_blocks = (inodes_[inode_number].size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+
+    MutexLock guard(&ra_lock_);
+    Stream* stream = &streams_[inode_number];
+    bool sequential = (offset == stream->next_offset);
+    stream->next_offset = offset + length;
+    if(!sequential) {
+        stream->window = 0;
+        stream->ahead  = 0;
+        return;
+    }
+    stream->window = (stream->window == 0) ? READAHEAD_MIN : stream->window * 2;
+    if(stream->window > max_window) {
+        stream->window = max_window;
+    }
+    if(stream->ahead < end_block) {
+        stream->ahead = end_block;
+    }
+    if(stream->ahead - end_block > stream->window / 2) {
+        return;
+    }
+    size_t target = end_block + stream->window;
+    if(target > file_blocks) {
+        target = file_blocks;
+    }
+    // a full queue means the disk can't keep up, skip rather than pile up
+    if(target <= stream->ahead || prefetch_queue_.size() >= READAHEAD_MAX / READAHEAD_MIN) {
+        return;
+    }
+    Prefetch request = {inode_number, stream->ahead, target - stream->ahead};
+    prefetch_queue_.push_back(request);
+    stream->ahead = target;
+    pthread_cond_signal(&ra_cond_);
+}
+
+void FileSystem::startReadahead() {
+    ra_stop_ = false;
+    ra_running_ = pthread_create(&ra_thread_, nullptr, prefetchMain, this) == 0;
+}
+
+void FileSystem::stopReadahead() {
+    if(!ra_running_) {
+        return;
+    }
+    pthread_mutex_lock(&ra_lock_);
+    ra_stop_ = true;
+    prefetch_queue_.clear();
+    pthread_cond_signal(&ra_cond_);
+    pthread_mutex_unlock(&ra_lock_);
+    pthread_join(ra_thread_, nullptr);
+    ra_running_ = false;
+}
+
+void* FileSystem::prefetchMain(void* arg) {
+    ((FileSystem*)arg)->prefetchLoop();
+    return nullptr;
+}
 
-            memcpy(data_block.data + block_offset, data + bytes_written, bytes_to_copy);
+/**
+ * Prefetch thread: take queued windows and pull their data blocks into
+ * the disk cache. Blocks are resolved and read under the same locks a
+ * reader holds, so no writer can change them underneath. Tail blocks are
+ * left out: other inodes share them and rewrite them under tail_lock_,
+ * which the inode lock does not exclude.
+ **/
+void FileSystem::prefetchLoop() {
+    while(true) {
+        pthread_mutex_lock(&ra_lock_);
+        while(!ra_stop_ && prefetch_queue_.empty()) {
+            pthread_cond_wait(&ra_cond_, &ra_lock_);
+        }
+        if(ra_stop_) {
+            pthread_mutex_unlock(&ra_lock_);
+            break;
+        }
+        Prefetch request = prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+        // the reader may have caught up meanwhile, don't fetch behind it
+        size_t reader = streams_[request.inode_number].next_offset / Disk::BLOCK_SIZE;
+        pthread_mutex_unlock(&ra_lock_);
+        if(reader >= request.first + request.count) {
+            continue;
+        }
+        if(reader > request.first) {
+            request.count -= reader - request.first;
+            request.first  = reader;
+        }
+
+        ReadLock fs_guard(&fs_lock_);
+        ReadLock inode_guard(&inode_locks_[request.inode_number]);
+        Inode* inode = &inodes_[request.inode_number];
+        size_t file_blocks = (inode->size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+        if(inode->valid != 1 || request.first >= file_blocks) {
+            continue;
+        }
+        size_t count = request.count;
+        if(request.first + count > file_blocks) {
+            count = file_blocks - request.first;
+        }
+        std::vector<size_t> blocks(count);
+        ssize_t mapped = mapBlocks(request.inode_number, request.first, count, blocks.data(), nullptr);
+        if(mapped <= 0) {
+            continue;
+        }
+        // holes need no reading, compressed blocks are read on demand
+        std::vector<size_t> todo;
+        for(ssize_t i = 0; i < mapped; ++i) {
+            size_t block = blocks[i];
+            if(block != 0 && !compressedPointer((uint32_t)block))
+                todo.push_back(block);
+        }
+        if(!todo.empty()) {
+            disk_->prefetch(todo.data(), todo.size());
+        }
+    }
+}
+
+/**
+ * Zero-copy read: describe bytes [offset, offset + length) of the file as
+ * spans pointing straight into the mapped image, merging blocks that are
+ * adjacent on disk. Spans stay valid until the file is written or the
+ * disk is closed. Returns the number of bytes covered, or -1 when the
+ * disk is not mapped, the file has buffered writes or keeps its data in
+ * its inode, and read() has to
+ * be used instead.
+ **/
+ssize_t FileSystem::view(size_t inode_number, size_t length, size_t offset, std::vector<Span>& spans) {
+    TraceCall call(trace_, Trace::OP_VIEW, inode_number, length, offset);
+    return call.done(viewFile(inode_number, length, offset, spans));
+}
+
+ssize_t FileSystem::viewFile(size_t inode_number, size_t length, size_t offset, std::vector<Span>& spans) {
+    static const char zero_block[Disk::BLOCK_SIZE] = {0};
+
+    spans.clear();
+    if(!disk_ || !inodes_ || !disk_->mapped()) {
+        return -1;
+    }
+    if(inode_number >= meta_data_.inodes) {
+        return -1;
+    }
+    ReadLock fs_guard(&fs_lock_);
+    ReadLock inode_guard(&inode_locks_[inode_number]);
+    Inode* inode = &inodes_[inode_number];
+    if(inode->valid != 1) {
+        return -1;
+    }
+    Handle* file = open_files_[inode_number];
+    if(file && !file->dirty.empty()) {
+        return -1;
+    }
+    if(offset >= inode->size) {
+        return 0;
+    }
+    size_t total_bytes = length;
+    if(offset + length > inode->size) {
+        total_bytes = inode->size - offset;
+    }
+    if(total_bytes == 0) {
+        return 0;
+    }
+    if(inode->flags & INODE_INLINE) {
+        return -1;
+    }
+    if(inode->flags & INODE_TAIL) {
+        TailMap* tail = tailMap(inode);
+        const char* block = disk_->view(tail->block);
+        if(!block || offset + total_bytes > tail->count * TAIL_SLOT) {
+            return -1;
+        }
+        Span span = {block + tail->slot * TAIL_SLOT + offset, total_bytes};
+        spans.push_back(span);
+        return (ssize_t)total_bytes;
+    }
+
+    size_t first_block_idx = offset / Disk::BLOCK_SIZE;
+    size_t head            = offset % Disk::BLOCK_SIZE;
+    size_t count           = (head + total_bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    std::vector<size_t> blocks(count);
+    if(mapBlocks(inode_number, first_block_idx, count, blocks.data(), nullptr) != (ssize_t)count) {
+        return -1;
+    }
 
-            // write to disk
-            if(disk_->write(indirect_block.pointers[indirect_idx], data_block.data) != Disk::BLOCK_SIZE) {
+    size_t bytes = 0;
+    for(size_t i = 0; i < count; ++i) {
+        // compressed data has to be decoded, read() it instead
+        if(compressedPointer((uint32_t)blocks[i])) {
+            return -1;
+        }
+        const char* block = (blocks[i] != 0) ? disk_->view(blocks[i]) : zero_block;
+        if(!block) {
+            return -1;
+        }
+        size_t start = (i == 0) ? head : 0;
+        size_t len   = Disk::BLOCK_SIZE - start;
+        if(len > total_bytes - bytes) {
+            len = total_bytes - bytes;
+        }
+        if(!spans.empty() && spans.back().data + spans.back().length == block + start) {
+            spans.back().length += len;
+        }else {
+            Span span = {block + start, len};
+            spans.push_back(span);
+        }
+        bytes += len;
+    }
+    return (ssize_t)bytes;
+}
+
+ssize_t FileSystem::write(size_t inode_number, char *data, size_t length, size_t offset) {
+    OpTimer timer(&stats_, Stats::OP_WRITE);
+    TraceCall call(trace_, Trace::OP_WRITE, inode_number, length, offset);
+    return call.done(timer.done(writeFile(inode_number, data, length, offset), true));
+}
+
+ssize_t FileSystem::writeFile(size_t inode_number, char *data, size_t length, size_t offset) {
+    if(!disk_ || !inodes_ || !data) {
+        return -1;
+    }
+    if(inode_number >= meta_data_.inodes) {
+        return -1;
+    }
+    commitIfFull();
+    ssize_t result;
+    {
+        ReadLock fs_guard(&fs_lock_);
+        WriteLock inode_guard(&inode_locks_[inode_number]);
+        if(inodes_[inode_number].valid != 1) {
+            return -1;
+        }
+
+        result = bufferData(inode_number, data, length, offset);
+        // too much waiting, the writer pays for writing its own file back
+        if(result > 0 && buffered_blocks_ > WRITEBACK_BLOCKS) {
+            if(!flushInode(inode_number)) {
                 return -1;
             }
-            bytes_written += bytes_to_copy;
-            indirect_idx++;
-            block_offset = 0;
         }
     }
-    if(offset + length > inode->size) {
-        inode->size = offset + length;
-        if(disk_->write(blockIdx, block.data) != Disk::BLOCK_SIZE) {
+    // short of space while removed blocks wait for their commit
+    if(result >= 0 && (size_t)result < length && retired_blocks_ > 0 && sync()) {
+        ssize_t more = writeFile(inode_number, data + result, length - result, offset + result);
+        if(more > 0) {
+            result += more;
+        }
+    }
+    return result;
+}
+
+/**
+ * Pointer blocks a new data block at file block idx may need that file
+ * has not reserved yet, as keys for Handle::reserved_pointers (0 stands
+ * for the extent block). A missing
+ * tree root is certain; blocks below an existing root are counted without
+ * reading them, which at worst holds back one block per pointer block
+ * until the next flush. With copies the root counts as well, for a file
+ * whose pointer blocks may be copied from a clone.
+ **/
+void FileSystem::pointerBlocksNeeded(Handle* file, size_t idx, std::vector<uint64_t>& keys, bool copies) {
+    Inode* inode = &inodes_[file->inode_number];
+    // a packed inode is unpacked into an empty map before blocks are mapped
+    bool empty = packed(inode);
+    if(meta_data_.features & FEATURE_EXTENTS) {
+        // the extent block, should the inline extents run out
+        if((empty || extentMap(inode)->block == 0) && file->reserved_pointers.count(0) == 0) {
+            keys.push_back(0);
+        }
+        return;
+    }
+    if(idx < POINTERS_PER_INODE) {
+        return;
+    }
+    size_t index = idx - POINTERS_PER_INODE;
+    size_t span  = POINTERS_PER_BLOCK;
+    uint64_t depth = 1;
+    uint32_t root  = empty ? 0 : inode->indirect;
+    if(index >= span) {
+        index -= span;
+        span  *= POINTERS_PER_BLOCK;
+        depth  = 2;
+        root   = empty ? 0 : inode->double_indirect;
+        if(index >= span) {
+            index -= span;
+            span  *= POINTERS_PER_BLOCK;
+            depth  = 3;
+            root   = empty ? 0 : inode->triple_indirect;
+        }
+    }
+    // span: data blocks under one pointer block of the current level
+    for(uint64_t d = 0; d < depth; ++d, span /= POINTERS_PER_BLOCK) {
+        if(d == 0 && root != 0 && !copies) {
+            continue;
+        }
+        uint64_t key = (depth << 60) | (d << 56) | (index / span);
+        if(file->reserved_pointers.count(key) == 0) {
+            keys.push_back(key);
+        }
+    }
+}
+
+/**
+ * Copy data into the buffered blocks of the inode. A partial block that
+ * exists on disk is read first so the untouched bytes survive, new blocks
+ * start out zeroed, and a packed file is loaded into block 0 as a whole.
+ * Every hole that gets data reserves a free block plus
+ * the pointer blocks it may need; the write stops short when no more
+ * blocks can be promised or the maximum file size is reached.
+ **/
+ssize_t FileSystem::bufferData(size_t inode_number, char *data, size_t length, size_t offset) {
+    Inode* inode = &inodes_[inode_number];
+    if(length == 0) {
+        return 0;
+    }
+    Handle* file = open_files_[inode_number];
+    if(!file) {
+        file = newHandle(inode_number);
+        if(!file) {
             return -1;
         }
     }
+    if(packed(inode) && file->dirty.find(0) == file->dirty.end()) {
+        std::vector<uint64_t> pointer_keys;
+        pointerBlocksNeeded(file, 0, pointer_keys, false);
+        size_t need = 1 + pointer_keys.size();
+        void* mem = nullptr;
+        // 1 when loaded, 0 when out of space (a short write), -1 on errors
+        ssize_t loaded = -1;
+        if(!reserveBlocks(need)) {
+            loaded = 0;
+        }else if(posix_memalign(&mem, Disk::BLOCK_SIZE, Disk::BLOCK_SIZE) == 0 && loadPacked(inode_number, (char*)mem)) {
+            loaded = 1;
+        }else {
+            free(mem);
+            unreserveBlocks(need);
+        }
+        if(loaded <= 0) {
+            if(file->dirty.empty() && file->refs == 0) {
+                open_files_[inode_number] = nullptr;
+                freeHandle(file);
+            }
+            return loaded;
+        }
+        file->reserved += need;
+        file->reserved_pointers.insert(pointer_keys.begin(), pointer_keys.end());
+        file->dirty[0] = (char*)mem;
+        buffered_blocks_++;
+    }
 
+    // look the whole range up at once, holes map to 0
+    size_t first_block_idx = offset / Disk::BLOCK_SIZE;
+    size_t count = (offset % Disk::BLOCK_SIZE + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    std::vector<size_t> blocks(count);
+    ssize_t mapped = mapBlocks(inode_number, first_block_idx, count, blocks.data(), nullptr);
+    if(mapped < 0) {
+        mapped = 0;
+    }
+
+    size_t bytes_written = 0;
+    std::vector<uint64_t> pointer_keys;
+    while(bytes_written < length) {
+        size_t idx   = (offset + bytes_written) / Disk::BLOCK_SIZE;
+        size_t start = (offset + bytes_written) % Disk::BLOCK_SIZE;
+        size_t bytes = Disk::BLOCK_SIZE - start;
+        if(bytes > length - bytes_written) {
+            bytes = length - bytes_written;
+        }
+        if(idx - first_block_idx >= (size_t)mapped) {
+            break;
+        }
+
+        char* buffer;
+        std::map<size_t, char*>::iterator it = file->dirty.find(idx);
+        if(it != file->dirty.end()) {
+            buffer = it->second;
+        }else {
+            size_t block = blocks[idx - first_block_idx];
+            size_t need = 0;
+            pointer_keys.clear();
+            bool shared = (inode->flags & INODE_SHARED) != 0;
+            if(block == 0) {
+                pointerBlocksNeeded(file, idx, pointer_keys, shared);
+                need = 1 + pointer_keys.size();
+            }else if(compressedPointer((uint32_t)block)) {
+                // may not compress as well next time
+                need = 1;
+            }else if(!ownBlock((uint32_t)block) || shared) {
+                // shared with other files, the new data goes elsewhere,
+                // and after a clone so may the pointer blocks above it
+                if(shared) {
+                    pointerBlocksNeeded(file, idx, pointer_keys, true);
+                }
+                need = 1 + pointer_keys.size();
+            }
+            if(need > 0 && !reserveBlocks(need)) {
+                break;
+            }
+            void* mem = nullptr;
+            if(posix_memalign(&mem, Disk::BLOCK_SIZE, Disk::BLOCK_SIZE) != 0) {
+                unreserveBlocks(need);
+                break;
+            }
+            buffer = (char*)mem;
+            Block scratch;
+            uint32_t scratch_block = 0;
+            if(bytes < Disk::BLOCK_SIZE && compressedPointer((uint32_t)block)) {
+                if(!readCompressed((uint32_t)block, buffer, scratch, &scratch_block)) {
+                    free(buffer);
+                    unreserveBlocks(need);
+                    break;
+                }
+            }else if(bytes < Disk::BLOCK_SIZE && block != 0) {
+                if(disk_->read(block, buffer) != Disk::BLOCK_SIZE) {
+                    free(buffer);
+                    unreserveBlocks(need);
+                    break;
+                }
+            }else if(bytes < Disk::BLOCK_SIZE) {
+                memset(buffer, 0, Disk::BLOCK_SIZE);
+            }
+            file->reserved += need;
+            file->reserved_pointers.insert(pointer_keys.begin(), pointer_keys.end());
+            file->dirty[idx] = buffer;
+            buffered_blocks_++;
+        }
+        memcpy(buffer + start, data + bytes_written, bytes);
+        bytes_written += bytes;
+    }
+
+    // a write that stored nothing, say on a full disk, leaves the size alone
+    if(bytes_written > 0 && offset + bytes_written > inode->size) {
+        inode->size = offset + bytes_written;
+        dirtyInode(inode_number);
+    }
+    // nothing buffered and nobody has it open
+    if(file->dirty.empty() && file->refs == 0) {
+        open_files_[inode_number] = nullptr;
+        freeHandle(file);
+    }
     return (ssize_t)bytes_written;
-}
\ No newline at end of file
+}
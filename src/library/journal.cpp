@@ -0,0 +1,296 @@
+#include "fs.h"
+#include "lock.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+/**
+ * The journal region follows the bitmap and is split in two halves. A
+ * transaction is written to the half picked by its sequence number: a
+ * JournalHeader listing the home block of every image, then the images.
+ * Header, images, the data written since the last commit and the home
+ * copies of the previous transaction all reach the image with the same
+ * fsync; the checksum in the header tells a complete transaction from a
+ * torn one. Only after that are the images written to their home blocks.
+ *
+ * So at any time the newest complete transaction is in one half, and the
+ * one before it, whose home writes may not have landed when the newest
+ * was synced, in the other. mount() replays both, oldest first.
+ *
+ * A block freed by a transaction must not be reused before the
+ * transaction is committed, or a crash could leave the old metadata
+ * pointing at new data. remove() therefore retires blocks, and sync()
+ * frees them right before the commit that records the removal.
+ **/
+
+/**
+ * Read a metadata block, the version waiting for the next commit if
+ * there is one.
+ **/
+bool FileSystem::readMeta(size_t block, char* data) {
+    if(meta_data_.features & FEATURE_JOURNAL) {
+        MutexLock guard(&journal_lock_);
+        std::map<size_t, char*>::iterator it = staged_.find(block);
+        if(it != staged_.end()) {
+            memcpy(data, it->second, Disk::BLOCK_SIZE);
+            return true;
+        }
+    }
+    return disk_->read(block, data) == Disk::BLOCK_SIZE;
+}
+
+/**
+ * Write a metadata block. With a journal it is only staged for the next
+ * commit, a later write of the same block replaces the staged image.
+ **/
+bool FileSystem::writeMeta(size_t block, char* data) {
+    if(!(meta_data_.features & FEATURE_JOURNAL)) {
+        return disk_->write(block, data) == Disk::BLOCK_SIZE;
+    }
+    MutexLock guard(&journal_lock_);
+    char*& image = staged_[block];
+    if(!image) {
+        void* mem = nullptr;
+        if(posix_memalign(&mem, Disk::BLOCK_SIZE, Disk::BLOCK_SIZE) != 0) {
+            staged_.erase(block);
+            return false;
+        }
+        image = (char*)mem;
+    }
+    memcpy(image, data, Disk::BLOCK_SIZE);
+    return true;
+}
+
+/**
+ * Free blocks a file no longer references: at once without a journal,
+ * at the next commit with one.
+ **/
+void FileSystem::retireBlocks(size_t start, size_t count) {
+    if(!(meta_data_.features & FEATURE_JOURNAL)) {
+        freeBlocks(start, count);
+        return;
+    }
+    if(start == 0 || start + count > meta_data_.blocks) {
+        return;
+    }
+    MutexLock guard(&alloc_lock_);
+    Run run = {start, count};
+    retired_.push_back(run);
+    retired_blocks_ += count;
+}
+
+/**
+ * Free the retired blocks and drop what was staged for them, nothing
+ * needs their old content any more. Caller holds the file system lock
+ * exclusively and commits before releasing it.
+ **/
+void FileSystem::releaseRetired() {
+    std::vector<Run> retired;
+    {
+        MutexLock guard(&alloc_lock_);
+        retired.swap(retired_);
+        retired_blocks_ = 0;
+    }
+    for(size_t i = 0; i < retired.size(); ++i) {
+        {
+            MutexLock guard(&journal_lock_);
+            std::map<size_t, char*>::iterator it = staged_.lower_bound(retired[i].start);
+            while(it != staged_.end() && it->first < retired[i].start + retired[i].length) {
+                free(it->second);
+                staged_.erase(it++);
+            }
+        }
+        freeBlocks(retired[i].start, retired[i].length);
+    }
+}
+
+/**
+ * Blocks one transaction can log.
+ **/
+size_t FileSystem::journalCapacity() const {
+    return std::min((size_t)JOURNAL_TAGS, (size_t)meta_data_.journal_blocks / 2 - 1);
+}
+
+/**
+ * Blocks the next commit may log at most: what is staged, the dirty
+ * inode blocks, and the bitmap and the super block that may join.
+ **/
+size_t FileSystem::pendingBlocks() {
+    size_t pending;
+    {
+        MutexLock guard(&journal_lock_);
+        pending = staged_.size();
+    }
+    return pending + dirty_inode_count_ + meta_data_.bitmap_blocks + 1;
+}
+
+/**
+ * Commit when the next sync() might no longer fit in one transaction.
+ * Called by operations before they take any lock.
+ **/
+void FileSystem::commitIfFull() {
+    if(!disk_ || !(meta_data_.features & FEATURE_JOURNAL)) {
+        return;
+    }
+    if(pendingBlocks() > journalCapacity() / 2) {
+        sync();
+    }
+}
+
+/**
+ * Commit what sync() has written back so far as a transaction of its
+ * own. Called between two inodes, where the inodes, the bitmap and the
+ * staged blocks agree with each other. Blocks retired since the last
+ * sync stay allocated, they are freed by the final commit. Caller holds
+ * the file system lock exclusively.
+ **/
+bool FileSystem::commitStep() {
+    bool ok = storeInodes();
+    ok = storeBitmap() && ok;
+    return commitJournal() && ok;
+}
+
+uint64_t FileSystem::journalChecksum(const JournalHeader& header, char* const* images) {
+    // FNV-1a over 64 bit words, the checksum field itself counts as 0
+    uint64_t hash = 14695981039346656037ull;
+    JournalHeader copy = header;
+    copy.checksum = 0;
+    const uint64_t* words = (const uint64_t*)&copy;
+    for(size_t i = 0; i < sizeof(copy) / 8; ++i) {
+        hash = (hash ^ words[i]) * 1099511628211ull;
+    }
+    for(uint32_t n = 0; n < header.count; ++n) {
+        words = (const uint64_t*)images[n];
+        for(size_t i = 0; i < Disk::BLOCK_SIZE / 8; ++i) {
+            hash = (hash ^ words[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Log every staged block as one transaction, sync the image once and
+ * write the blocks home. A stage larger than a transaction is refused
+ * as a whole: splitting it could commit half an update. Nothing goes
+ * home then, the blocks stay staged. sync() commits in steps so that
+ * does not happen. Caller holds the file system lock exclusively.
+ **/
+bool FileSystem::commitJournal() {
+    std::vector<size_t> homes;
+    std::vector<char*>  images;
+    {
+        MutexLock guard(&journal_lock_);
+        for(std::map<size_t, char*>::iterator it = staged_.begin(); it != staged_.end(); ++it) {
+            homes.push_back(it->first);
+            images.push_back(it->second);
+        }
+    }
+    if(homes.empty()) {
+        return disk_->sync();
+    }
+    size_t count = homes.size();
+    if(count > journalCapacity()) {
+        printf("Journal transaction of %lu blocks does not fit in %lu\n", count, journalCapacity());
+        return false;
+    }
+
+    size_t half_blocks = meta_data_.journal_blocks / 2;
+    Block header = {0};
+    header.journal.magic    = JOURNAL_MAGIC;
+    header.journal.count    = count;
+    header.journal.sequence = journal_sequence_;
+    std::vector<size_t> log(count);
+    size_t start = journalStart() + (journal_sequence_ % 2) * half_blocks;
+    for(size_t i = 0; i < count; ++i) {
+        header.journal.tags[i] = homes[i];
+        log[i] = start + 1 + i;
+    }
+    header.journal.checksum = journalChecksum(header.journal, images.data());
+    if(disk_->writev(log.data(), images.data(), count) < 0 ||
+       disk_->write(start, header.data) != Disk::BLOCK_SIZE || !disk_->sync()) {
+        printf("Failed to commit journal transaction %lu\n", journal_sequence_);
+        return false;
+    }
+    journal_sequence_++;
+
+    // committed, the images can go home and leave the stage
+    MutexLock guard(&journal_lock_);
+    for(size_t i = 0; i < count; ++i) {
+        if(disk_->write(homes[i], images[i]) != Disk::BLOCK_SIZE) {
+            printf("Failed to write block %lu home\n", homes[i]);
+        }
+        staged_.erase(homes[i]);
+        free(images[i]);
+    }
+    return true;
+}
+
+/**
+ * Bring the home blocks up to date with the transactions in the journal
+ * after an unclean shutdown, and pick the sequence number to go on with
+ * in any case.
+ **/
+bool FileSystem::replayJournal() {
+    size_t half_blocks = meta_data_.journal_blocks / 2;
+    bool clean = meta_data_.state == STATE_CLEAN;
+    Block headers[2];
+    std::vector<char> images[2];
+    bool valid[2] = {false, false};
+    journal_sequence_ = 1;
+    for(int h = 0; h < 2; ++h) {
+        size_t start = journalStart() + h * half_blocks;
+        JournalHeader* header = &headers[h].journal;
+        if(disk_->read(start, headers[h].data) != Disk::BLOCK_SIZE) {
+            return false;
+        }
+        if(header->magic != JOURNAL_MAGIC || header->count > journalCapacity() ||
+           header->sequence % 2 != (uint64_t)h) {
+            continue;
+        }
+        journal_sequence_ = std::max(journal_sequence_, header->sequence + 1);
+        // after a clean unmount every transaction is home already
+        if(clean || header->count == 0) {
+            continue;
+        }
+        images[h].resize((size_t)header->count * Disk::BLOCK_SIZE + Disk::BLOCK_SIZE);
+        char* base = (char*)(((size_t)images[h].data() + Disk::BLOCK_SIZE - 1) & ~(Disk::BLOCK_SIZE - 1));
+        std::vector<char*> bufs(header->count);
+        for(uint32_t i = 0; i < header->count; ++i) {
+            bufs[i] = base + (size_t)i * Disk::BLOCK_SIZE;
+        }
+        if(disk_->readBlocks(start + 1, header->count, base) < 0) {
+            return false;
+        }
+        valid[h] = journalChecksum(*header, bufs.data()) == header->checksum;
+    }
+
+    size_t replayed = 0;
+    int order[2] = {0, 1};
+    if(headers[1].journal.sequence < headers[0].journal.sequence) {
+        std::swap(order[0], order[1]);
+    }
+    for(int k = 0; k < 2; ++k) {
+        int h = order[k];
+        if(!valid[h]) {
+            continue;
+        }
+        char* base = (char*)(((size_t)images[h].data() + Disk::BLOCK_SIZE - 1) & ~(Disk::BLOCK_SIZE - 1));
+        for(uint32_t i = 0; i < headers[h].journal.count; ++i) {
+            uint32_t home = headers[h].journal.tags[i];
+            // never into the journal itself or off the disk
+            if((home >= journalStart() && home < journalStart() + meta_data_.journal_blocks) ||
+               home >= meta_data_.blocks) {
+                continue;
+            }
+            if(disk_->write(home, base + (size_t)i * Disk::BLOCK_SIZE) != Disk::BLOCK_SIZE) {
+                return false;
+            }
+            replayed++;
+        }
+    }
+    if(replayed > 0) {
+        printf("Replayed %lu journal blocks\n", replayed);
+        return disk_->sync();
+    }
+    return true;
+}
@@ -0,0 +1,213 @@
+#include "lz.h"
+#include <string.h>
+
+static const int      HASH_BITS     = 12;
+static const uint32_t WINDOW        = 4096;     /* Matches reach back less than this, one block */
+static const int      MAX_CHAIN     = 4;        /* Earlier positions tried per match */
+static const uint32_t NONE          = 0xffffffff;
+static const size_t   LAST_LITERALS = 5;        /* A match never covers the last bytes */
+
+static uint32_t load32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(const unsigned char* p) {
+    return (load32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// a length of 15 or more continues in bytes of 255 and a remainder
+static bool putLength(unsigned char** out, unsigned char* end, size_t length) {
+    for(; length >= 255; length -= 255) {
+        if(*out >= end) {
+            return false;
+        }
+        *(*out)++ = 255;
+    }
+    if(*out >= end) {
+        return false;
+    }
+    *(*out)++ = (unsigned char)length;
+    return true;
+}
+
+static bool putSequence(unsigned char** out, unsigned char* end, const unsigned char* literals,
+                        size_t literal_count, size_t match_length, size_t offset) {
+    if(*out >= end) {
+        return false;
+    }
+    unsigned char* token = (*out)++;
+    size_t match_code = match_length ? match_length - LZ::MIN_MATCH : 0;
+    *token = (unsigned char)(((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if(literal_count >= 15 && !putLength(out, end, literal_count - 15)) {
+        return false;
+    }
+    if((size_t)(end - *out) < literal_count) {
+        return false;
+    }
+    memcpy(*out, literals, literal_count);
+    *out += literal_count;
+    if(match_length == 0) {
+        return true;
+    }
+    if(end - *out < 2) {
+        return false;
+    }
+    *(*out)++ = (unsigned char)offset;
+    *(*out)++ = (unsigned char)(offset >> 8);
+    return match_code < 15 || putLength(out, end, match_code - 15);
+}
+
+// prefixes seen so far: the latest position of each hash, and for every
+// position the distance back to the previous one with its hash
+struct Chains {
+    const unsigned char* in;
+    uint32_t             head[1 << HASH_BITS];
+    uint16_t             prev[WINDOW];
+
+    void insert(const unsigned char* p) {
+        uint32_t pos = (uint32_t)(p - in);
+        uint32_t h   = hash4(p);
+        prev[pos % WINDOW] = (head[h] != NONE && pos - head[h] < WINDOW) ? (uint16_t)(pos - head[h]) : 0;
+        head[h] = pos;
+    }
+
+    // longest match for p among up to MAX_CHAIN earlier positions, not past limit
+    size_t find(const unsigned char* p, const unsigned char* limit, const unsigned char** ref) const {
+        uint32_t pos = (uint32_t)(p - in);
+        uint32_t candidate = head[hash4(p)];
+        size_t best = 0;
+        if(candidate == NONE || pos - candidate >= WINDOW) {
+            return 0;
+        }
+        for(int depth = 0; depth < MAX_CHAIN; ++depth) {
+            const unsigned char* q = in + candidate;
+            if(load32(q) == load32(p)) {
+                size_t match = LZ::MIN_MATCH;
+                while(p + match < limit && q[match] == p[match]) {
+                    match++;
+                }
+                if(match > best) {
+                    best = match;
+                    *ref = q;
+                }
+            }
+            uint16_t step = prev[candidate % WINDOW];
+            if(step == 0 || pos - (candidate - step) >= WINDOW) {
+                break;
+            }
+            candidate -= step;
+        }
+        return best;
+    }
+};
+
+size_t LZ::compress(const char* src, size_t length, char* dst, size_t capacity) {
+    const unsigned char* in     = (const unsigned char*)src;
+    const unsigned char* in_end = in + length;
+    unsigned char* out     = (unsigned char*)dst;
+    unsigned char* out_end = out + capacity;
+    Chains chains;
+    chains.in = in;
+    memset(chains.head, 0xff, sizeof(chains.head));
+
+    const unsigned char* anchor = in;
+    const unsigned char* p = in;
+    const unsigned char* match_limit = length > LAST_LITERALS + MIN_MATCH ? in_end - LAST_LITERALS : in;
+    while(p + MIN_MATCH <= match_limit) {
+        const unsigned char* ref = nullptr;
+        size_t match = chains.find(p, match_limit, &ref);
+        chains.insert(p);
+        if(match == 0) {
+            p++;
+            continue;
+        }
+        // a longer match one byte on wins, the byte becomes a literal
+        while(p + 1 + MIN_MATCH <= match_limit) {
+            const unsigned char* next_ref = nullptr;
+            size_t next = chains.find(p + 1, match_limit, &next_ref);
+            if(next <= match) {
+                break;
+            }
+            p++;
+            match = next;
+            ref   = next_ref;
+            chains.insert(p);
+        }
+        if(!putSequence(&out, out_end, anchor, p - anchor, match, p - ref)) {
+            return 0;
+        }
+        for(const unsigned char* q = p + 1; q < p + match && q + MIN_MATCH <= in_end; ++q) {
+            chains.insert(q);
+        }
+        p += match;
+        anchor = p;
+    }
+    if(!putSequence(&out, out_end, anchor, in_end - anchor, 0, 0)) {
+        return 0;
+    }
+    return out - (unsigned char*)dst;
+}
+
+ssize_t LZ::decompress(const char* src, size_t length, char* dst, size_t capacity) {
+    const unsigned char* in     = (const unsigned char*)src;
+    const unsigned char* in_end = in + length;
+    unsigned char* out     = (unsigned char*)dst;
+    unsigned char* out_end = out + capacity;
+    while(in < in_end) {
+        unsigned char token = *in++;
+        size_t literals = token >> 4;
+        if(literals == 15) {
+            unsigned char more;
+            do {
+                if(in >= in_end) {
+                    return -1;
+                }
+                more = *in++;
+                literals += more;
+            } while(more == 255);
+        }
+        if((size_t)(in_end - in) < literals || (size_t)(out_end - out) < literals) {
+            return -1;
+        }
+        memcpy(out, in, literals);
+        in  += literals;
+        out += literals;
+        if(in == in_end) {
+            break;
+        }
+
+        if(in_end - in < 2) {
+            return -1;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match = token & 15;
+        if(match == 15) {
+            unsigned char more;
+            do {
+                if(in >= in_end) {
+                    return -1;
+                }
+                more = *in++;
+                match += more;
+            } while(more == 255);
+        }
+        match += MIN_MATCH;
+        if(offset == 0 || offset > (size_t)(out - (unsigned char*)dst) || (size_t)(out_end - out) < match) {
+            return -1;
+        }
+        // a match closer than its length repeats what it produces, byte by byte
+        const unsigned char* ref = out - offset;
+        if(offset >= match) {
+            memcpy(out, ref, match);
+        }else {
+            for(size_t i = 0; i < match; ++i) {
+                out[i] = ref[i];
+            }
+        }
+        out += match;
+    }
+    return out - (unsigned char*)dst;
+}
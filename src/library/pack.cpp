@@ -0,0 +1,311 @@
+#include "fs.h"
+#include "lock.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Small files on FEATURE_PACKED images. A packed file has no block map:
+ * with INODE_INLINE its bytes sit in the inode from direct on, with
+ * INODE_TAIL a TailMap there names a run of slots in a tail block. Tail
+ * blocks are ordinary used blocks in the bitmap; which of their slots
+ * are taken is not stored on disk but rebuilt from the inodes at mount.
+ *
+ * Files are packed when they are flushed. A write to a packed file first
+ * copies the packed bytes into a buffered block 0, from there on it is
+ * written like any other file until the next flush packs it again or,
+ * once it has grown past TAIL_MAX, gives up its slots and maps block 0
+ * the usual way.
+ *
+ * Slots of a tail block are written with a read-modify-write of the whole
+ * block under tail_lock_. With a journal, freed slots are retired like
+ * freed blocks and only handed out again after the next commit.
+ **/
+
+static uint16_t slotMask(uint32_t slot, uint32_t count) {
+    return (uint16_t)(((1u << count) - 1) << slot);
+}
+
+/**
+ * Whether the next flush of inode_number may pack it: it is small enough
+ * and owns no blocks, or is packed already. Caller holds the inode write
+ * lock.
+ **/
+bool FileSystem::packable(size_t inode_number) {
+    if(!(meta_data_.features & FEATURE_PACKED)) {
+        return false;
+    }
+    Inode* inode = &inodes_[inode_number];
+    if(inode->size > TAIL_MAX) {
+        return false;
+    }
+    if(packed(inode)) {
+        return true;
+    }
+    // block map, extent map or not, all zero when the file has no blocks
+    const char* map = inlineData(inode);
+    for(uint32_t i = 0; i < INLINE_BYTES; ++i) {
+        if(map[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Store the first inode->size bytes of data, the file's block 0, in the
+ * inode or in tail slots. Slots the file already has are rewritten in
+ * place when the data still fits them. Returns false, leaving the inode
+ * as it was, when no slots can be had.
+ **/
+bool FileSystem::packInode(size_t inode_number, const char* data) {
+    Inode* inode = &inodes_[inode_number];
+    size_t size = inode->size;
+    if(size <= INLINE_BYTES) {
+        if(inode->flags & INODE_TAIL) {
+            MutexLock guard(&tail_lock_);
+            retireTail(*tailMap(inode));
+        }
+        memset(inlineData(inode), 0, INLINE_BYTES);
+        memcpy(inlineData(inode), data, size);
+        inode->flags = INODE_INLINE;
+        dirtyInode(inode_number);
+        return true;
+    }
+
+    uint32_t count = (uint32_t)((size + TAIL_SLOT - 1) / TAIL_SLOT);
+    MutexLock guard(&tail_lock_);
+    bool had_tail = (inode->flags & INODE_TAIL) != 0;
+    TailMap old = had_tail ? *tailMap(inode) : (TailMap){0, 0, 0};
+    TailMap tail = old;
+    bool fresh = false;
+    if(had_tail && old.count >= count) {
+        tail.count = count;
+    }else if(!allocTail(count, &tail, &fresh)) {
+        return false;
+    }
+
+    Block block;
+    if(fresh) {
+        memset(block.data, 0, Disk::BLOCK_SIZE);
+    }else if(disk_->read(tail.block, block.data) != Disk::BLOCK_SIZE) {
+        if(tail.block != old.block || tail.slot != old.slot) {
+            freeTail(tail);
+        }
+        return false;
+    }
+    char* slots = block.data + tail.slot * TAIL_SLOT;
+    memcpy(slots, data, size);
+    memset(slots + size, 0, count * TAIL_SLOT - size);
+    if(disk_->write(tail.block, block.data) != Disk::BLOCK_SIZE) {
+        printf("Failed to write tail block %u\n", tail.block);
+        if(tail.block != old.block || tail.slot != old.slot) {
+            freeTail(tail);
+        }
+        return false;
+    }
+
+    // what the file no longer uses of its old slots
+    if(had_tail && tail.block == old.block && tail.slot == old.slot) {
+        TailMap rest = {old.block, old.slot + count, old.count - count};
+        if(rest.count > 0) {
+            retireTail(rest);
+        }
+    }else if(had_tail) {
+        retireTail(old);
+    }
+    memset(inlineData(inode), 0, INLINE_BYTES);
+    *tailMap(inode) = tail;
+    inode->flags = INODE_TAIL;
+    dirtyInode(inode_number);
+    return true;
+}
+
+/**
+ * Turn a packed inode into an empty block mapped one of the same size,
+ * giving up its slots. Caller holds the inode write lock and has the
+ * data buffered if it is still needed.
+ **/
+void FileSystem::unpackInode(size_t inode_number) {
+    Inode* inode = &inodes_[inode_number];
+    if(inode->flags & INODE_TAIL) {
+        MutexLock guard(&tail_lock_);
+        retireTail(*tailMap(inode));
+    }
+    memset(inlineData(inode), 0, INLINE_BYTES);
+    inode->flags = 0;
+    dirtyInode(inode_number);
+}
+
+/**
+ * read() of a packed file, length bytes from offset, both within the
+ * file. Costs one block read for a tail, none for inline data.
+ **/
+ssize_t FileSystem::readPacked(Inode* inode, char* data, size_t length, size_t offset) {
+    if(inode->flags & INODE_INLINE) {
+        if(offset + length > INLINE_BYTES) {
+            return -1;
+        }
+        memcpy(data, inlineData(inode) + offset, length);
+        return (ssize_t)length;
+    }
+    TailMap* tail = tailMap(inode);
+    if(tail->block >= meta_data_.blocks || tail->slot + tail->count > TAIL_SLOTS ||
+       offset + length > tail->count * TAIL_SLOT) {
+        return -1;
+    }
+    Block block;
+    if(disk_->read(tail->block, block.data) != Disk::BLOCK_SIZE) {
+        return -1;
+    }
+    memcpy(data, block.data + tail->slot * TAIL_SLOT + offset, length);
+    return (ssize_t)length;
+}
+
+/**
+ * Fill buffer, a whole block, with the content of packed inode_number
+ * followed by zeroes.
+ **/
+bool FileSystem::loadPacked(size_t inode_number, char* buffer) {
+    Inode* inode = &inodes_[inode_number];
+    memset(buffer, 0, Disk::BLOCK_SIZE);
+    return readPacked(inode, buffer, inode->size, 0) == (ssize_t)inode->size;
+}
+
+/**
+ * Find count adjacent free slots, in the first tail block that has them
+ * or else in a new one, and mark them used. *fresh tells whether the
+ * block is new, so its other slots hold nothing yet. Caller holds
+ * tail_lock_.
+ **/
+bool FileSystem::allocTail(uint32_t count, TailMap* tail, bool* fresh) {
+    const uint16_t ALL_SLOTS = slotMask(0, TAIL_SLOTS);
+    for(std::map<uint32_t, uint16_t>::iterator it = tails_.begin(); it != tails_.end(); ++it) {
+        uint16_t used = it->second;
+        if((uint32_t)__builtin_popcount((uint16_t)~used & ALL_SLOTS) < count) {
+            continue;
+        }
+        for(uint32_t slot = 0; slot + count <= TAIL_SLOTS; ++slot) {
+            uint16_t mask = slotMask(slot, count);
+            if(used & mask) {
+                continue;
+            }
+            tail->block = it->first;
+            tail->slot  = slot;
+            tail->count = count;
+            *fresh      = false;
+            if((used | mask) == ALL_SLOTS) {
+                tails_.erase(it);
+            }else {
+                it->second = used | mask;
+            }
+            return true;
+        }
+    }
+    ssize_t block = allocBlock();
+    if(block < 0) {
+        return false;
+    }
+    tail->block = (uint32_t)block;
+    tail->slot  = 0;
+    tail->count = count;
+    *fresh      = true;
+    tails_[tail->block] = slotMask(0, count);
+    return true;
+}
+
+/**
+ * Make the slots of tail free, and the block once none of its slots is
+ * used. Caller holds tail_lock_.
+ **/
+void FileSystem::freeTail(const TailMap& tail) {
+    if(tail.block == 0 || tail.block >= meta_data_.blocks || tail.count == 0 || tail.slot + tail.count > TAIL_SLOTS) {
+        return;
+    }
+    // a block missing from tails_ has every slot used
+    std::map<uint32_t, uint16_t>::iterator it = tails_.find(tail.block);
+    uint16_t used = (it == tails_.end()) ? slotMask(0, TAIL_SLOTS) : it->second;
+    used &= (uint16_t)~slotMask(tail.slot, tail.count);
+    if(used == 0) {
+        if(it != tails_.end()) {
+            tails_.erase(it);
+        }
+        freeBlocks(tail.block, 1);
+    }else {
+        tails_[tail.block] = used;
+    }
+}
+
+/**
+ * Give up slots a file no longer references: at once without a journal,
+ * at the next commit with one. Caller holds tail_lock_.
+ **/
+void FileSystem::retireTail(const TailMap& tail) {
+    if(meta_data_.features & FEATURE_JOURNAL) {
+        retired_tails_.push_back(tail);
+    }else {
+        freeTail(tail);
+    }
+}
+
+/**
+ * Free the retired slots, see releaseRetired().
+ **/
+void FileSystem::releaseRetiredTails() {
+    MutexLock guard(&tail_lock_);
+    for(size_t i = 0; i < retired_tails_.size(); ++i) {
+        freeTail(retired_tails_[i]);
+    }
+    retired_tails_.clear();
+}
+
+/**
+ * Rebuild the used slots of every tail block from the inode table, and
+ * with FEATURE_COMPRESSED from the block pointers of every file as well.
+ **/
+bool FileSystem::loadTails() {
+    MutexLock guard(&tail_lock_);
+    tails_.clear();
+    retired_tails_.clear();
+    if(!(meta_data_.features & (FEATURE_PACKED | FEATURE_COMPRESSED))) {
+        return true;
+    }
+    for(uint32_t n = 0; n < meta_data_.inodes; ++n) {
+        Inode* inode = &inodes_[n];
+        if(inode->valid != 1 || (inode->flags & INODE_INLINE)) {
+            continue;
+        }
+        if(inode->flags & INODE_TAIL) {
+            TailMap* tail = tailMap(inode);
+            if(tail->block < meta_data_.blocks && tail->count > 0 && tail->slot + tail->count <= TAIL_SLOTS) {
+                tails_[tail->block] |= slotMask(tail->slot, tail->count);
+            }
+            continue;
+        }
+        if(!(meta_data_.features & FEATURE_COMPRESSED)) {
+            continue;
+        }
+        std::vector<uint32_t> pointers(inode->direct, inode->direct + POINTERS_PER_INODE);
+        if(!treeBlocks(inode->indirect, 1, pointers) ||
+           !treeBlocks(inode->double_indirect, 2, pointers) ||
+           !treeBlocks(inode->triple_indirect, 3, pointers)) {
+            return false;
+        }
+        for(size_t i = 0; i < pointers.size(); ++i) {
+            TailMap tail = pointerTail(pointers[i]);
+            if(compressedPointer(pointers[i]) && tail.block < meta_data_.blocks && tail.count > 0 &&
+               tail.slot + tail.count <= TAIL_SLOTS) {
+                tails_[tail.block] |= slotMask(tail.slot, tail.count);
+            }
+        }
+    }
+    // only blocks with room are kept
+    std::map<uint32_t, uint16_t>::iterator it = tails_.begin();
+    while(it != tails_.end()) {
+        if(it->second == slotMask(0, TAIL_SLOTS)) {
+            tails_.erase(it++);
+        }else {
+            ++it;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,165 @@
+#include "stats.h"
+#include "disk.h"
+#include <stdio.h>
+
+Stats::Stats() {
+    reset();
+}
+
+const char* Stats::name(int op) {
+    static const char* names[OP_COUNT] = {"create", "remove", "stat", "read", "write", "alloc", "sync"};
+    return op >= 0 && op < OP_COUNT ? names[op] : "unknown";
+}
+
+void Stats::record(int op, uint64_t nanoseconds, ssize_t result, size_t bytes) {
+    Counters& c = ops_[op];
+    int bucket = nanoseconds == 0 ? 0 : 63 - __builtin_clzll(nanoseconds);
+    if(bucket >= BUCKETS) {
+        bucket = BUCKETS - 1;
+    }
+    c.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    c.total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+    c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if(result < 0) {
+        c.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t max = c.max_ns.load(std::memory_order_relaxed);
+    while(nanoseconds > max && !c.max_ns.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+    // counted last, a reader seeing the call also sees its latency
+    c.calls.fetch_add(1, std::memory_order_release);
+}
+
+void Stats::reset() {
+    for(int op = 0; op < OP_COUNT; ++op) {
+        Counters& c = ops_[op];
+        c.calls = 0;
+        c.errors = 0;
+        c.bytes = 0;
+        c.total_ns = 0;
+        c.max_ns = 0;
+        for(int b = 0; b < BUCKETS; ++b) {
+            c.buckets[b] = 0;
+        }
+    }
+    blocks_allocated_ = 0;
+    blocks_freed_ = 0;
+    compress_bytes_ = 0;
+    compress_stored_ = 0;
+    decode_bytes_ = 0;
+    decode_ns_ = 0;
+    dedup_blocks_ = 0;
+    dedup_shared_ = 0;
+}
+
+/**
+ * Latency below which a fraction p of the calls finished, in ns. Only
+ * the bucket is known, so this is the upper end of the bucket holding
+ * the p-th call, capped by the largest latency seen.
+ **/
+uint64_t Stats::percentile(int op, double p) const {
+    const Counters& c = ops_[op];
+    uint64_t total = 0;
+    uint64_t counts[BUCKETS];
+    for(int b = 0; b < BUCKETS; ++b) {
+        counts[b] = c.buckets[b].load(std::memory_order_relaxed);
+        total += counts[b];
+    }
+    if(total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    if(rank == 0) {
+        rank = 1;
+    }
+    uint64_t max = c.max_ns.load(std::memory_order_relaxed);
+    uint64_t seen = 0;
+    for(int b = 0; b < BUCKETS; ++b) {
+        seen += counts[b];
+        if(seen >= rank) {
+            uint64_t upper = (2ull << b) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void Stats::print(Disk* disk) const {
+    printf("%-7s %10s %7s %14s %10s %10s %10s %10s\n", "op", "calls", "errors", "bytes", "mean us",
+           "p50 us", "p99 us", "max us");
+    for(int op = 0; op < OP_COUNT; ++op) {
+        const Counters& c = ops_[op];
+        uint64_t calls = c.calls.load(std::memory_order_acquire);
+        if(calls == 0) {
+            continue;
+        }
+        printf("%-7s %10lu %7lu %14lu %10.1f %10.1f %10.1f %10.1f\n", name(op), calls, c.errors.load(),
+               c.bytes.load(), c.total_ns.load() / 1000.0 / calls, percentile(op, 0.5) / 1000.0,
+               percentile(op, 0.99) / 1000.0, c.max_ns.load() / 1000.0);
+    }
+    printf("%lu blocks allocated, %lu blocks freed\n", blocks_allocated_.load(), blocks_freed_.load());
+    if(compress_bytes_.load() > 0) {
+        printf("%lu bytes compressed into %lu, ratio %.2f\n", compress_bytes_.load(), compress_stored_.load(),
+               (double)compress_bytes_.load() / compress_stored_.load());
+    }
+    if(decode_bytes_.load() > 0) {
+        printf("%lu bytes decompressed at %.1f MB/s\n", decode_bytes_.load(),
+               decode_bytes_.load() * 1000.0 / (decode_ns_.load() + 1));
+    }
+    if(dedup_blocks_.load() > 0) {
+        printf("%lu blocks written, %lu shared with blocks already on disk\n", dedup_blocks_.load(),
+               dedup_shared_.load());
+    }
+    if(disk) {
+        printf("%lu disk block reads, %lu disk block writes, %lu disk syncs\n", disk->blockReads(),
+               disk->blockWrites(), disk->syncs());
+        printf("%lu cache hits, %lu cache misses, %lu cache evictions\n", disk->cacheHits(),
+               disk->cacheMisses(), disk->cacheEvictions());
+    }
+}
+
+/**
+ * Everything print() shows plus the raw histograms, as one JSON object.
+ * Bucket n of "histogram_ns" counts latencies in [2^n, 2^(n+1)) ns,
+ * trailing empty buckets are left out.
+ **/
+std::string Stats::json(Disk* disk) const {
+    std::string out = "{\"ops\": {";
+    char buf[256];
+    for(int op = 0; op < OP_COUNT; ++op) {
+        const Counters& c = ops_[op];
+        snprintf(buf, sizeof(buf), "%s\"%s\": {\"calls\": %lu, \"errors\": %lu, \"bytes\": %lu, "
+                 "\"total_ns\": %lu, \"max_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"histogram_ns\": [",
+                 op ? ", " : "", name(op), c.calls.load(std::memory_order_acquire), c.errors.load(),
+                 c.bytes.load(), c.total_ns.load(), c.max_ns.load(), percentile(op, 0.5), percentile(op, 0.99));
+        out += buf;
+        int last = BUCKETS - 1;
+        while(last >= 0 && c.buckets[last].load(std::memory_order_relaxed) == 0) {
+            last--;
+        }
+        for(int b = 0; b <= last; ++b) {
+            snprintf(buf, sizeof(buf), "%s%lu", b ? ", " : "", c.buckets[b].load(std::memory_order_relaxed));
+            out += buf;
+        }
+        out += "]}";
+    }
+    snprintf(buf, sizeof(buf), "}, \"blocks_allocated\": %lu, \"blocks_freed\": %lu",
+             blocks_allocated_.load(), blocks_freed_.load());
+    out += buf;
+    snprintf(buf, sizeof(buf), ", \"compression\": {\"bytes\": %lu, \"stored\": %lu, \"decoded\": %lu, "
+             "\"decode_ns\": %lu}", compress_bytes_.load(), compress_stored_.load(), decode_bytes_.load(),
+             decode_ns_.load());
+    out += buf;
+    snprintf(buf, sizeof(buf), ", \"dedup\": {\"blocks\": %lu, \"shared\": %lu}", dedup_blocks_.load(),
+             dedup_shared_.load());
+    out += buf;
+    if(disk) {
+        snprintf(buf, sizeof(buf), ", \"disk\": {\"block_reads\": %lu, \"block_writes\": %lu, \"syncs\": %lu, "
+                 "\"cache_hits\": %lu, \"cache_misses\": %lu, \"cache_evictions\": %lu}",
+                 disk->blockReads(), disk->blockWrites(), disk->syncs(), disk->cacheHits(),
+                 disk->cacheMisses(), disk->cacheEvictions());
+        out += buf;
+    }
+    out += "}";
+    return out;
+}
@@ -0,0 +1,204 @@
+#include "trace.h"
+#include "lock.h"
+#include "stats.h"
+#include <errno.h>
+#include <string.h>
+
+thread_local int TraceCall::depth_ = 0;
+
+Trace::Trace() {
+    stream_   = nullptr;
+    start_ns_ = 0;
+    last_ns_  = 0;
+    pthread_mutex_init(&lock_, nullptr);
+}
+
+Trace::~Trace() {
+    close();
+    pthread_mutex_destroy(&lock_);
+}
+
+const char* Trace::name(int op) {
+    static const char* names[OP_COUNT] = {"none", "format", "mount", "unmount", "sync", "create", "remove",
+                                          "stat", "read", "write", "view", "open", "close", "lookup",
+                                          "mkfile", "mkdir", "unlink", "list", "clone"};
+    return op > 0 && op < OP_COUNT ? names[op] : "unknown";
+}
+
+bool Trace::open(const char* path) {
+    close();
+    FILE* stream = fopen(path, "wb");
+    if(!stream) {
+        printf("Unable to open trace %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    uint64_t magic = TRACE_MAGIC;
+    uint32_t version = TRACE_VERSION;
+    if(fwrite(&magic, sizeof(magic), 1, stream) != 1 || fwrite(&version, sizeof(version), 1, stream) != 1) {
+        fclose(stream);
+        return false;
+    }
+    MutexLock guard(&lock_);
+    start_ns_ = Stats::now();
+    last_ns_  = 0;
+    stream_   = stream;
+    return true;
+}
+
+void Trace::close() {
+    MutexLock guard(&lock_);
+    if(stream_) {
+        fclose(stream_);
+        stream_ = nullptr;
+    }
+}
+
+static size_t put_varint(unsigned char* out, uint64_t value) {
+    size_t n = 0;
+    while(value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+void Trace::record(const Record& record) {
+    unsigned char buf[1 + 7 * 10];
+    MutexLock guard(&lock_);
+    if(!stream_) {
+        return;
+    }
+    size_t n = 0;
+    buf[n++] = record.op;
+    n += put_varint(buf + n, zigzag((int64_t)(record.time_ns - last_ns_)));
+    n += put_varint(buf + n, record.duration_ns);
+    n += put_varint(buf + n, record.inode);
+    n += put_varint(buf + n, record.length);
+    n += put_varint(buf + n, record.offset);
+    n += put_varint(buf + n, zigzag(record.result));
+    if(hasPath(record.op)) {
+        n += put_varint(buf + n, record.path.size());
+    }
+    last_ns_ = record.time_ns;
+    if(fwrite(buf, 1, n, stream_) != n ||
+       (hasPath(record.op) && fwrite(record.path.data(), 1, record.path.size(), stream_) != record.path.size())) {
+        printf("Failed to write trace, recording stopped\n");
+        fclose(stream_);
+        stream_ = nullptr;
+    }
+}
+
+TraceReader::TraceReader() {
+    stream_  = nullptr;
+    last_ns_ = 0;
+}
+
+TraceReader::~TraceReader() {
+    close();
+}
+
+bool TraceReader::open(const char* path) {
+    close();
+    stream_ = fopen(path, "rb");
+    if(!stream_) {
+        printf("Unable to open trace %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    uint64_t magic = 0;
+    uint32_t version = 0;
+    if(fread(&magic, sizeof(magic), 1, stream_) != 1 || fread(&version, sizeof(version), 1, stream_) != 1 ||
+       magic != Trace::TRACE_MAGIC || version != Trace::TRACE_VERSION) {
+        printf("%s is not a trace\n", path);
+        close();
+        return false;
+    }
+    last_ns_ = 0;
+    return true;
+}
+
+void TraceReader::close() {
+    if(stream_) {
+        fclose(stream_);
+        stream_ = nullptr;
+    }
+}
+
+bool TraceReader::varint(uint64_t* value) {
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(stream_);
+        if(c == EOF) {
+            return false;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TraceReader::next(Trace::Record& record) {
+    if(!stream_) {
+        return false;
+    }
+    int op = fgetc(stream_);
+    if(op == EOF) {
+        return false;
+    }
+    uint64_t time, result, length;
+    if(op <= 0 || op >= Trace::OP_COUNT || !varint(&time) || !varint(&record.duration_ns) ||
+       !varint(&record.inode) || !varint(&record.length) || !varint(&record.offset) || !varint(&result)) {
+        return false;
+    }
+    record.op = (uint8_t)op;
+    last_ns_ += (uint64_t)((int64_t)(time >> 1) ^ -(int64_t)(time & 1));
+    record.time_ns = last_ns_;
+    record.result = (int64_t)(result >> 1) ^ -(int64_t)(result & 1);
+    record.path.clear();
+    if(Trace::hasPath(op)) {
+        if(!varint(&length) || length > 65536) {
+            return false;
+        }
+        record.path.resize(length);
+        if(length > 0 && fread(&record.path[0], 1, length, stream_) != length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TraceCall::TraceCall(Trace* trace, int op, uint64_t inode, uint64_t length, uint64_t offset, const char* path) {
+    trace_ = trace && trace->recording() ? trace : nullptr;
+    if(!trace_) {
+        return;
+    }
+    depth_++;
+    start_ = Stats::now();
+    record_.op = (uint8_t)op;
+    record_.inode = inode;
+    record_.length = length;
+    record_.offset = offset;
+    record_.result = 0;
+    if(path) {
+        record_.path = path;
+    }
+}
+
+TraceCall::~TraceCall() {
+    if(!trace_) {
+        return;
+    }
+    if(--depth_ > 0) {
+        return;
+    }
+    uint64_t end = Stats::now();
+    record_.time_ns = start_ - trace_->start();
+    record_.duration_ns = end - start_;
+    trace_->record(record_);
+}
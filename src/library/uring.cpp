@@ -0,0 +1,197 @@
+#include "uring.h"
+#include "lock.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+Ring::Ring() {
+    ring_fd_ = -1;
+    file_fd_ = -1;
+    entries_ = 0;
+    sq_ring_ = cq_ring_ = sqes_ = nullptr;
+    sq_ring_size_ = cq_ring_size_ = sqes_size_ = 0;
+    pthread_mutex_init(&lock_, nullptr);
+}
+
+Ring::~Ring() {
+    release();
+    pthread_mutex_destroy(&lock_);
+}
+
+bool Ring::init(int fd, unsigned entries) {
+    release();
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ring_fd = io_uring_setup(entries, &p);
+    if(ring_fd < 0) {
+        // ENOSYS on old kernels, EPERM when disabled or filtered
+        return false;
+    }
+    ring_fd_ = ring_fd;
+    file_fd_ = fd;
+    entries_ = p.sq_entries;
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && cq_ring_size_ > sq_ring_size_)
+        sq_ring_size_ = cq_ring_size_;
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if(sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        release();
+        return false;
+    }
+    if(single) {
+        cq_ring_ = sq_ring_;
+    }else {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if(cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            release();
+            return false;
+        }
+    }
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if(sqes_ == MAP_FAILED) {
+        sqes_ = nullptr;
+        release();
+        return false;
+    }
+
+    char* sq = (char*)sq_ring_;
+    sq_head_  = (unsigned*)(sq + p.sq_off.head);
+    sq_tail_  = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask_  = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array_ = (unsigned*)(sq + p.sq_off.array);
+    char* cq = (char*)cq_ring_;
+    cq_head_  = (unsigned*)(cq + p.cq_off.head);
+    cq_tail_  = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask_  = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes_     = cq + p.cq_off.cqes;
+    return true;
+}
+
+void Ring::release() {
+    if(sqes_) {
+        munmap(sqes_, sqes_size_);
+    }
+    if(cq_ring_ && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if(sq_ring_) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    sq_ring_ = cq_ring_ = sqes_ = nullptr;
+    if(ring_fd_ >= 0) {
+        ::close(ring_fd_);
+    }
+    // ready() reads it without the lock
+    __atomic_store_n(&ring_fd_, -1, __ATOMIC_RELEASE);
+    file_fd_ = -1;
+}
+
+/**
+ * Queue up to entries_ requests at a time, enter the kernel once per
+ * batch and reap all completions of the batch. Every request the kernel
+ * took is reaped before returning, even when a system call fails, so its
+ * buffers are no longer in use and no stale completion is left for the
+ * next call. A failed system call then tears the ring down and Disk stays
+ * on preadv/pwritev.
+ **/
+bool Ring::submit(Request* requests, size_t count) {
+    MutexLock guard(&lock_);
+    // another caller may have torn the ring down while we waited
+    if(ring_fd_ < 0) {
+        return false;
+    }
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)sqes_;
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)cqes_;
+    bool ok = true;
+    bool failed = false;
+
+    size_t done = 0;
+    while(done < count && !failed) {
+        unsigned batch = (count - done < entries_) ? (unsigned)(count - done) : entries_;
+        unsigned tail = *sq_tail_;
+        for(unsigned i = 0; i < batch; ++i) {
+            Request* r = &requests[done + i];
+            unsigned idx = tail & *sq_mask_;
+            struct io_uring_sqe* sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode    = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd        = file_fd_;
+            sqe->off       = (uint64_t)r->offset;
+            sqe->addr      = (uint64_t)(uintptr_t)r->iov;
+            sqe->len       = r->iovcnt;
+            sqe->user_data = done + i;
+            sq_array_[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0;
+        while(submitted < batch) {
+            int ret = io_uring_enter(ring_fd_, batch - submitted, batch - submitted, IORING_ENTER_GETEVENTS);
+            if(ret < 0 && errno == EINTR)
+                continue;
+            // taking nothing would loop forever
+            if(ret <= 0) {
+                failed = true;
+                break;
+            }
+            submitted += ret;
+        }
+
+        // only the requests the kernel took complete, never more than those;
+        // their buffers are the kernel's until they do, so keep reaping even
+        // when waiting fails: completions still land in the mapped ring
+        unsigned reaped = 0;
+        while(reaped < submitted) {
+            unsigned head = *cq_head_;
+            unsigned ctail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            if(head == ctail) {
+                if(io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                   errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    failed = true;
+                    usleep(100);
+                }
+                continue;
+            }
+            while(head != ctail && reaped < submitted) {
+                struct io_uring_cqe* cqe = &cqes[head & *cq_mask_];
+                if(cqe->user_data < done || cqe->user_data >= done + batch) {
+                    ok = false;
+                }else {
+                    Request* r = &requests[cqe->user_data];
+                    if(cqe->res < 0 || (size_t)cqe->res != r->bytes)
+                        ok = false;
+                }
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+        done += batch;
+    }
+    if(failed) {
+        // entries the kernel never took are still queued, drop them with the ring
+        release();
+        return false;
+    }
+    return ok;
+}
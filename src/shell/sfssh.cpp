@@ -7,6 +7,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
 
 /* Macros */
 
@@ -15,37 +18,87 @@
 /* Command Prototyes */
 
 void do_debug(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
-void do_format(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_format(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2, char *arg3, char *arg4, char *arg5);
 void do_mount(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_create(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_remove(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_stat(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_cat(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
-void do_copyin(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_copyin(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2, char *arg3);
+void do_clone(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_sync(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_mkdir(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_touch(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_rm(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_ls(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_lookup(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
+void do_stats(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 void do_help(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2);
 
 /* Utility Prototypes */
 
 bool copyout(FileSystem& fs, size_t inode_number, const char *path);
-bool copyin(FileSystem& fs, const char *path, size_t inode_number);
+bool copyin(FileSystem& fs, const char *path, size_t inode_number, size_t offset = 0);
+ssize_t inode_arg(FileSystem& fs, const char *arg, bool create);
 
 /* Main Execution */
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m|-u|-d] [-t trace] <diskfile> <nblocks> [cache_blocks]\n", program);
+    fprintf(stderr, "    -m    map the disk image instead of using read/write\n");
+    fprintf(stderr, "    -u    submit multi-block I/O through io_uring\n");
+    fprintf(stderr, "    -d    open the disk image with O_DIRECT\n");
+    fprintf(stderr, "    -t    record every file system call into trace, see sfs_replay\n");
+}
+
 int main(int argc, char *argv[]) {
+    Trace trace;
     Disk disk;
     FileSystem fs;
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    int flags = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "mudt:")) != -1) {
+        switch (opt) {
+        case 'm':
+            flags |= Disk::OPEN_MMAP;
+            break;
+        case 'u':
+            flags |= Disk::OPEN_URING;
+            break;
+        case 'd':
+            flags |= Disk::OPEN_DIRECT;
+            break;
+        case 't':
+            if (!trace.open(optarg)) {
+                return EXIT_FAILURE;
+            }
+            fs.setTrace(&trace);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 3 && argc != 4) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    if(not disk.open(argv[1], atoi(argv[2]))) {
+    size_t cache_blocks = Disk::DEFAULT_CACHE_BLOCKS;
+    if (argc == 4) {
+        cache_blocks = atoi(argv[3]);
+    }
+
+    if(not disk.open(argv[1], atoi(argv[2]), cache_blocks, flags)) {
         return EXIT_FAILURE;
     }
 
     while (true) {
-        char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
+        char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ], arg3[BUFSIZ], arg4[BUFSIZ], arg5[BUFSIZ];
         fprintf(stderr, "sfs> ");
         fflush(stderr);
 
@@ -53,7 +106,7 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
+        int args = sscanf(line, "%s %s %s %s %s %s", cmd, arg1, arg2, arg3, arg4, arg5);
         if (args == 0) {
             continue;
         }
@@ -61,7 +114,7 @@ int main(int argc, char *argv[]) {
         if (streq(cmd, "debug")) {
             do_debug(disk, fs, args, arg1, arg2);
         } else if (streq(cmd, "format")) {
-            do_format(disk, fs, args, arg1, arg2);
+            do_format(disk, fs, args, arg1, arg2, arg3, arg4, arg5);
         } else if (streq(cmd, "mount")) {
             do_mount(disk, fs, args, arg1, arg2);
         } else if (streq(cmd, "create")) {
@@ -75,7 +128,23 @@ int main(int argc, char *argv[]) {
         } else if (streq(cmd, "cat")) {
             do_cat(disk, fs, args, arg1, arg2);
         } else if (streq(cmd, "copyin")) {
-            do_copyin(disk, fs, args, arg1, arg2);
+            do_copyin(disk, fs, args, arg1, arg2, arg3);
+        } else if (streq(cmd, "clone")) {
+            do_clone(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "sync")) {
+            do_sync(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "mkdir")) {
+            do_mkdir(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "touch")) {
+            do_touch(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "rm")) {
+            do_rm(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "ls")) {
+            do_ls(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "lookup")) {
+            do_lookup(disk, fs, args, arg1, arg2);
+        } else if (streq(cmd, "stats")) {
+            do_stats(disk, fs, args, arg1, arg2);
         } else if (streq(cmd, "help")) {
             do_help(disk, fs, args, arg1, arg2);
         } else if (streq(cmd, "exit") || streq(cmd, "quit")) {
@@ -103,13 +172,31 @@ void do_debug(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
     fs.debug(disk);
 }
 
-void do_format(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-        printf("Usage: format\n");
-        return;
+void do_format(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2, char *arg3, char *arg4, char *arg5) {
+    int flags = 0;
+    char *options[] = {arg1, arg2, arg3, arg4, arg5};
+    for (int i = 0; i < args - 1; ++i) {
+        if (streq(options[i], "quick")) {
+            flags |= FileSystem::FORMAT_QUICK;
+        } else if (streq(options[i], "large")) {
+            flags |= FileSystem::FORMAT_LARGE;
+        } else if (streq(options[i], "extents")) {
+            flags |= FileSystem::FORMAT_EXTENTS;
+        } else if (streq(options[i], "journal")) {
+            flags |= FileSystem::FORMAT_JOURNAL;
+        } else if (streq(options[i], "packed")) {
+            flags |= FileSystem::FORMAT_PACKED;
+        } else if (streq(options[i], "compressed")) {
+            flags |= FileSystem::FORMAT_COMPRESSED;
+        } else if (streq(options[i], "dedup")) {
+            flags |= FileSystem::FORMAT_DEDUP;
+        } else {
+            printf("Usage: format [quick] [large|extents] [journal] [packed] [compressed|dedup]\n");
+            return;
+        }
     }
 
-    if (fs.format(disk)) {
+    if (fs.format(disk, flags)) {
         printf("disk formatted.\n");
     } else {
         printf("format failed!\n");
@@ -159,11 +246,11 @@ void do_remove(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
 
 void do_stat(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
-        printf("Usage: stat <inode>\n");
+        printf("Usage: stat <inode|path>\n");
         return;
     }
 
-    ssize_t inode_number = atoi(arg1);
+    ssize_t inode_number = inode_arg(fs, arg1, false);
     ssize_t bytes        = fs.stat(inode_number);
     if (bytes >= 0) {
         printf("inode %ld has size %ld bytes.\n", inode_number, bytes);
@@ -174,48 +261,195 @@ void do_stat(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
 
 void do_copyout(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
-        printf("Usage: copyout <inode> <file>\n");
+        printf("Usage: copyout <inode|path> <file>\n");
         return;
     }
 
-    if (!copyout(fs, atoi(arg1), arg2)) {
+    ssize_t inode_number = inode_arg(fs, arg1, false);
+    if (inode_number < 0 || !copyout(fs, inode_number, arg2)) {
         printf("copyout failed!\n");
     }
 }
 
 void do_cat(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
-        printf("Usage: cat <inode>\n");
+        printf("Usage: cat <inode|path>\n");
         return;
     }
 
-    if (!copyout(fs, atoi(arg1), "/dev/stdout")) {
+    ssize_t inode_number = inode_arg(fs, arg1, false);
+    if (inode_number < 0 || !copyout(fs, inode_number, "/dev/stdout")) {
         printf("cat failed!\n");
     }
 }
 
-void do_copyin(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
-    if (args != 3) {
-        printf("Usage: copyin <file> <inode>\n");
+void do_copyin(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2, char *arg3) {
+    if (args != 3 && args != 4) {
+        printf("Usage: copyin <file> <inode|path> [offset]\n");
         return;
     }
 
-    if (!copyin(fs, arg1, atoi(arg2))) {
+    ssize_t inode_number = inode_arg(fs, arg2, true);
+    size_t offset = args == 4 ? strtoul(arg3, NULL, 10) : 0;
+    if (inode_number < 0 || !copyin(fs, arg1, inode_number, offset)) {
         printf("copyout failed!\n");
     }
 }
 
+void do_clone(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 2 && args != 3) {
+        printf("Usage: clone <inode|path> [path]\n");
+        return;
+    }
+
+    ssize_t inode_number = inode_arg(fs, arg1, false);
+    ssize_t clone_number = -1;
+    if (inode_number >= 0) {
+        clone_number = args == 3 ? fs.clone(inode_number, arg2) : fs.clone(inode_number);
+    }
+    if (clone_number >= 0) {
+        printf("cloned inode %ld to inode %ld.\n", inode_number, clone_number);
+    } else {
+        printf("clone failed!\n");
+    }
+}
+
+void do_sync(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: sync\n");
+        return;
+    }
+
+    if (fs.sync()) {
+        printf("disk synced.\n");
+    } else {
+        printf("sync failed!\n");
+    }
+}
+
+void do_mkdir(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: mkdir <path>\n");
+        return;
+    }
+
+    ssize_t inode_number = fs.mkdir(arg1);
+    if (inode_number >= 0) {
+        printf("created directory %s as inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("mkdir failed!\n");
+    }
+}
+
+void do_touch(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: touch <path>\n");
+        return;
+    }
+
+    ssize_t inode_number = fs.lookup(arg1);
+    if (inode_number < 0) {
+        inode_number = fs.mkfile(arg1);
+    }
+    if (inode_number >= 0) {
+        printf("%s is inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("touch failed!\n");
+    }
+}
+
+void do_rm(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: rm <path>\n");
+        return;
+    }
+
+    if (fs.unlink(arg1)) {
+        printf("removed %s.\n", arg1);
+    } else {
+        printf("rm failed!\n");
+    }
+}
+
+void do_ls(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args > 2) {
+        printf("Usage: ls [path]\n");
+        return;
+    }
+
+    std::vector<FileSystem::Name> names;
+    if (!fs.list(args == 2 ? arg1 : "/", names)) {
+        printf("ls failed!\n");
+        return;
+    }
+    std::sort(names.begin(), names.end(), [](const FileSystem::Name& a, const FileSystem::Name& b) {
+        return a.name < b.name;
+    });
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (names[i].directory) {
+            printf("%8lu %s/\n", names[i].inode_number, names[i].name.c_str());
+        } else {
+            printf("%8lu %s (%ld bytes)\n", names[i].inode_number, names[i].name.c_str(),
+                   fs.stat(names[i].inode_number));
+        }
+    }
+}
+
+void do_lookup(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: lookup <path>\n");
+        return;
+    }
+
+    ssize_t inode_number = fs.lookup(arg1);
+    if (inode_number >= 0) {
+        printf("%s is inode %ld.\n", arg1, inode_number);
+    } else {
+        printf("lookup failed!\n");
+    }
+}
+
+void do_stats(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
+    if (args == 1) {
+        fs.stats().print(&disk);
+    } else if (args == 2 && streq(arg1, "reset")) {
+        fs.stats().reset();
+        printf("stats reset.\n");
+    } else if (args == 2 && streq(arg1, "json")) {
+        printf("%s\n", fs.stats().json(&disk).c_str());
+    } else if (args == 3 && streq(arg1, "json")) {
+        FILE *stream = fopen(arg2, "w");
+        if (stream == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", arg2, strerror(errno));
+            return;
+        }
+        fprintf(stream, "%s\n", fs.stats().json(&disk).c_str());
+        fclose(stream);
+        printf("stats written to %s.\n", arg2);
+    } else {
+        printf("Usage: stats [reset|json [file]]\n");
+    }
+}
+
 void do_help(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [quick] [large|extents] [journal] [packed] [compressed|dedup]\n");
     printf("    mount\n");
     printf("    debug\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
-    printf("    cat     <inode>\n");
-    printf("    stat    <inode>\n");
-    printf("    copyin  <file> <inode>\n");
-    printf("    copyout <inode> <file>\n");
+    printf("    cat     <inode|path>\n");
+    printf("    stat    <inode|path>\n");
+    printf("    copyin  <file> <inode|path> [offset]\n");
+    printf("    copyout <inode|path> <file>\n");
+    printf("    clone   <inode|path> [path]\n");
+    printf("    mkdir   <path>\n");
+    printf("    touch   <path>\n");
+    printf("    rm      <path>\n");
+    printf("    ls      [path]\n");
+    printf("    lookup  <path>\n");
+    printf("    sync\n");
+    printf("    stats   [reset|json [file]]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -223,32 +457,51 @@ void do_help(Disk& disk, FileSystem& fs, int args, char *arg1, char *arg2) {
 
 /* Utility Functions */
 
-bool copyin(FileSystem& fs, const char *path, size_t inode_number) {
+/* An argument starting with / is a path, anything else an inode number */
+ssize_t inode_arg(FileSystem& fs, const char *arg, bool create) {
+    if (arg[0] != '/') {
+        return atoi(arg);
+    }
+    ssize_t inode_number = fs.lookup(arg);
+    if (inode_number < 0 && create) {
+        inode_number = fs.mkfile(arg);
+    }
+    if (inode_number < 0) {
+        fprintf(stderr, "No such file: %s\n", arg);
+    }
+    return inode_number;
+}
+
+bool copyin(FileSystem& fs, const char *path, size_t inode_number, size_t offset) {
     FILE *stream = fopen(path, "r");
     if (!stream) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
+    // an invalid inode gives a null handle, which fails like the inode would
+    FileSystem::Handle *handle = fs.open(inode_number);
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
+    alignas(Disk::BLOCK_SIZE) char buffer[4*BUFSIZ] = {0};
+    size_t copied = 0;
     while (true) {
         ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
         if (result <= 0) {
             break;
         }
-        ssize_t actual = fs.write(inode_number, buffer, result, offset);
+        ssize_t actual = fs.write(handle, buffer, result, offset);
         if (actual < 0) {
             fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
             break;
         }
         offset += actual;
+        copied += actual;
         if (actual != result) {
             fprintf(stderr, "fs_write only wrote %ld bytes, not %ld bytes\n", actual, result);
             break;
         }
     }
-    printf("%lu bytes copied\n", offset);
+    printf("%lu bytes copied\n", copied);
+    fs.close(handle);
     fclose(stream);
     return true;
 }
@@ -259,18 +512,31 @@ bool copyout(FileSystem& fs, size_t inode_number, const char *path) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
+    FileSystem::Handle *handle = fs.open(inode_number);
 
-    char buffer[4*BUFSIZ] = {0};
+    alignas(Disk::BLOCK_SIZE) char buffer[4*BUFSIZ] = {0};
+    std::vector<FileSystem::Span> spans;
     size_t offset = 0;
     while (true) {
-        ssize_t result = fs.read(inode_number, buffer, sizeof(buffer), offset);
+        // a mapped disk hands out the file in place, no copy into buffer
+        ssize_t result = fs.view(inode_number, sizeof(buffer), offset, spans);
+        if (result >= 0) {
+            for (size_t i = 0; i < spans.size(); ++i) {
+                fwrite(spans[i].data, 1, spans[i].length, stream);
+            }
+        } else {
+            result = fs.read(handle, buffer, sizeof(buffer), offset);
+            if (result > 0) {
+                fwrite(buffer, 1, result, stream);
+            }
+        }
         if (result <= 0) {
             break;
         }
-        fwrite(buffer, 1, result, stream);
         offset += result;
     }
     printf("%lu bytes copied\n", offset);
+    fs.close(handle);
     fclose(stream);
     return true;
 }
\ No newline at end of file
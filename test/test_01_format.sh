@@ -8,8 +8,13 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
-2 disk block reads
+    1 bitmap blocks
+    clean
+Inode 0:
+    size: 0 bytes
+0 disk block reads
 5 disk block writes
+2 cache hits, 5 cache misses, 0 cache evictions
 EOF
 }
 
@@ -39,6 +44,25 @@ SuperBlock:
 EOF
 }
 
+image-5-quick-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    5 blocks
+    1 inode blocks
+    128 inodes
+    1 bitmap blocks
+    clean
+    1 inode blocks initialized
+Inode 0:
+    size: 0 bytes
+0 disk block reads
+3 disk block writes
+2 cache hits, 3 cache misses, 0 cache evictions
+EOF
+}
+
 test-input() {
     cat <<EOF
 format
@@ -63,10 +87,35 @@ test-format() {
     rm -f $DISK.formatted test.log
 }
 
+test-quick-input() {
+    cat <<EOF
+format quick
+debug
+EOF
+}
+
+test-format-quick() {
+    DISK=$1
+    BLOCKS=$2
+    OUTPUT=$3
+
+    cp $DISK $DISK.formatted
+    echo -n "Testing quick format on $DISK.formatted ... "
+    if diff -u <(test-quick-input | ../bin/sfssh $DISK.formatted $BLOCKS 2> /dev/null) <($OUTPUT) > test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat test.log
+	EXIT=$(($EXIT + 1))
+    fi
+    rm -f $DISK.formatted test.log
+}
+
 EXIT=0
 
 test-format ../data/image.5   5   image-5-output
 #test-format data/image.20  20  image-20-output
 #test-format data/image.200 200 image-200-output
+test-format-quick ../data/image.5 5 image-5-quick-output
 
 exit $EXIT
@@ -13,6 +13,7 @@ mount-output() {
 disk mounted.
 2 disk block reads
 0 disk block writes
+0 cache hits, 2 cache misses, 0 cache evictions
 EOF
 }
 
@@ -29,6 +30,7 @@ disk mounted.
 mount failed!
 2 disk block reads
 0 disk block writes
+0 cache hits, 2 cache misses, 0 cache evictions
 EOF
 }
 
@@ -45,6 +47,7 @@ disk mounted.
 format failed!
 2 disk block reads
 0 disk block writes
+0 cache hits, 2 cache misses, 0 cache evictions
 EOF
 }
 
@@ -79,6 +82,7 @@ bad-mount-output() {
 mount failed!
 1 disk block reads
 0 disk block writes
+0 cache hits, 1 cache misses, 0 cache evictions
 EOF
 }
 
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: concurrent create/remove/read/write on a copy of data/image.200,
+# the files already on the image are read by every thread
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing stress on $SCRATCH/image.200 ... "
+if ./bin/sfs_stress $SCRATCH/image.200 200 4 2000 > $SCRATCH/stress.log 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/stress.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: the shell still reads the original files afterwards
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+copyout 9 $SCRATCH/9.txt
+EOF
+
+echo -n "Testing copyout after stress in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/9.txt | awk '{print $1}') = 'cc4e48a5fe0ba15b13a98b3fd34b340e' ]; then
+    echo "Success"
+else
+    echo "Failure"
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
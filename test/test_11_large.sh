@@ -0,0 +1,80 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: a file past the single indirect block needs the large inode format
+
+head -c 6000000 /dev/urandom > $SCRATCH/large.data
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.3000 3000 > $SCRATCH/large.log 2>&1
+format large
+mount
+create
+copyin $SCRATCH/large.data 1
+EOF
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.3000 3000 >> $SCRATCH/large.log 2>&1
+mount
+stat 1
+copyout 1 $SCRATCH/large.copy
+EOF
+
+echo -n "Testing large file in $SCRATCH/image.3000 ... "
+if cmp -s $SCRATCH/large.data $SCRATCH/large.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/large.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: removing it gives every block back
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.3000 3000 >> $SCRATCH/large.log 2>&1
+mount
+remove 1
+create
+copyin $SCRATCH/large.data 1
+EOF
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.3000 3000 >> $SCRATCH/large.log 2>&1
+mount
+copyout 1 $SCRATCH/large.copy2
+EOF
+
+echo -n "Testing large file reuse in $SCRATCH/image.3000 ... "
+if cmp -s $SCRATCH/large.data $SCRATCH/large.copy2; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/large.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: the same file on an extent mapped image
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.extents 3000 > $SCRATCH/extents.log 2>&1
+format extents
+mount
+create
+copyin $SCRATCH/large.data 1
+EOF
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.extents 3000 >> $SCRATCH/extents.log 2>&1
+mount
+copyout 1 $SCRATCH/extents.copy
+EOF
+
+echo -n "Testing large file in $SCRATCH/image.extents ... "
+if cmp -s $SCRATCH/large.data $SCRATCH/extents.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/extents.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,84 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: files copied in by name can be found and copied out by name
+
+head -c 100000 /dev/urandom > $SCRATCH/names.data
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/names.log 2>&1
+format
+mount
+mkdir /docs
+mkdir /docs/old
+copyin $SCRATCH/names.data /docs/old/report
+touch /docs/empty
+EOF
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 >> $SCRATCH/names.log 2>&1
+mount
+copyout /docs/old/report $SCRATCH/names.copy
+ls /docs
+EOF
+
+echo -n "Testing names in $SCRATCH/image.1000 ... "
+if cmp -s $SCRATCH/names.data $SCRATCH/names.copy && grep -q " old/$" $SCRATCH/names.log &&
+   grep -q " empty (0 bytes)$" $SCRATCH/names.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/names.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: a directory can only be removed once it is empty
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/rm.log 2>&1
+mount
+rm /docs/old
+rm /docs/old/report
+rm /docs/old
+lookup /docs/old
+lookup /docs/empty
+EOF
+
+echo -n "Testing rm in $SCRATCH/image.1000 ... "
+if [ "$(grep -c "rm failed!" $SCRATCH/rm.log)" = 1 ] && grep -q "lookup failed!" $SCRATCH/rm.log &&
+   grep -q "/docs/empty is inode" $SCRATCH/rm.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/rm.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: a directory with thousands of names, spread over many buckets
+
+for i in $(seq 1 3000); do
+    echo "touch /many/file$i"
+done > $SCRATCH/many.cmds
+
+(echo "format quick extents"; echo "mount"; echo "mkdir /many"; cat $SCRATCH/many.cmds) |
+    ./bin/sfssh $SCRATCH/image.extents 40000 > $SCRATCH/many.log 2> /dev/null
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.extents 40000 >> $SCRATCH/many.log 2> /dev/null
+mount
+lookup /many/file1
+lookup /many/file3000
+ls /many
+EOF
+
+echo -n "Testing large directory in $SCRATCH/image.extents ... "
+if [ "$(grep -c " file[0-9]* (0 bytes)$" $SCRATCH/many.log)" = 3000 ] &&
+   [ "$(grep -c "is inode" $SCRATCH/many.log)" = 3002 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    tail -20 $SCRATCH/many.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: whatever was synced survives the shell being killed before unmount
+
+head -c 300000 /dev/urandom > $SCRATCH/journal.data
+mkfifo $SCRATCH/journal.in
+
+stdbuf -o0 ./bin/sfssh $SCRATCH/image.2000 2000 < $SCRATCH/journal.in > $SCRATCH/journal.log 2>&1 &
+SHELL_PID=$!
+exec 3> $SCRATCH/journal.in
+cat >&3 <<EOF
+format journal
+mount
+mkdir /logs
+copyin $SCRATCH/journal.data /logs/kept
+sync
+EOF
+for i in $(seq 1 50); do
+    grep -q "disk synced." $SCRATCH/journal.log && break
+    sleep 0.1
+done
+{ kill -9 $SHELL_PID; wait $SHELL_PID; } 2> /dev/null
+exec 3>&-
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.2000 2000 > $SCRATCH/replay.log 2>&1
+mount
+copyout /logs/kept $SCRATCH/journal.copy
+EOF
+
+echo -n "Testing journal replay in $SCRATCH/image.2000 ... "
+if cmp -s $SCRATCH/journal.data $SCRATCH/journal.copy && grep -q "Replayed [0-9]* journal blocks$" $SCRATCH/replay.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/journal.log $SCRATCH/replay.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: a clean unmount leaves nothing to replay
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.2000 2000 > $SCRATCH/clean.log 2>&1
+mount
+rm /logs/kept
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.2000 2000 >> $SCRATCH/clean.log 2>&1
+mount
+lookup /logs/kept
+EOF
+
+echo -n "Testing journal after unmount in $SCRATCH/image.2000 ... "
+if ! grep -q "Replayed" $SCRATCH/clean.log && grep -q "lookup failed!" $SCRATCH/clean.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/clean.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: a recorded shell session replays with the same results
+
+head -c 200000 /dev/urandom > $SCRATCH/trace.data
+
+cat <<EOF | ./bin/sfssh -t $SCRATCH/session.trace $SCRATCH/image.1000 1000 > $SCRATCH/record.log 2>&1
+format extents
+mount
+mkdir /docs
+copyin $SCRATCH/trace.data /docs/report
+copyout /docs/report $SCRATCH/trace.copy
+create
+stat /docs/report
+ls /docs
+rm /docs/report
+lookup /docs/report
+EOF
+
+./bin/sfs_replay $SCRATCH/session.trace $SCRATCH/replay.1000 > $SCRATCH/replay.log 2>&1
+
+echo -n "Testing trace replay in $SCRATCH/replay.1000 ... "
+if grep -q " 0 results differ from the recording$" $SCRATCH/replay.log &&
+   grep -q "^mkdir  *1 " $SCRATCH/replay.log && grep -q "^unlink  *1 " $SCRATCH/replay.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/record.log $SCRATCH/replay.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: a trace that starts on an existing image gets a fresh one formatted alike
+
+cat <<EOF | ./bin/sfssh -t $SCRATCH/mounted.trace $SCRATCH/image.1000 1000 > $SCRATCH/record.log 2>&1
+mount
+mkdir /more
+stat /more
+EOF
+
+./bin/sfs_replay $SCRATCH/mounted.trace $SCRATCH/replay.1000 > $SCRATCH/replay.log 2>&1
+
+echo -n "Testing trace replay on a fresh image in $SCRATCH/replay.1000 ... "
+if grep -q "^5 calls in .* 0 results differ from the recording$" $SCRATCH/replay.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/record.log $SCRATCH/replay.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: small files are kept in their inode or in a shared tail block
+
+echo "a short note" > $SCRATCH/note
+head -c 700 /dev/urandom > $SCRATCH/poem
+head -c 2900 /dev/urandom > $SCRATCH/ode
+head -c 9000 /dev/urandom > $SCRATCH/epic
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/packed.log 2>&1
+format packed
+mount
+mkdir /poems
+copyin $SCRATCH/note /poems/note
+copyin $SCRATCH/poem /poems/poem
+copyin $SCRATCH/ode /poems/ode
+copyin $SCRATCH/epic /poems/epic
+debug
+EOF
+
+echo -n "Testing small files packed in $SCRATCH/image.1000 ... "
+if [ $(grep -c "inline data$" $SCRATCH/packed.log) -eq 1 ] &&
+   [ $(grep -c "tail block: [0-9]*, slots" $SCRATCH/packed.log) -eq 2 ] &&
+   [ $(grep "tail block:" $SCRATCH/packed.log | awk '{print $3}' | sort -u | wc -l) -eq 1 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/packed.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: packed files read back after a remount, and one that outgrows its slots too
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/remount.log 2>&1
+mount
+copyin $SCRATCH/epic /poems/poem
+copyout /poems/note $SCRATCH/note.copy
+copyout /poems/ode $SCRATCH/ode.copy
+copyout /poems/poem $SCRATCH/poem.copy
+EOF
+
+echo -n "Testing packed files after a remount in $SCRATCH/image.1000 ... "
+if cmp -s $SCRATCH/note $SCRATCH/note.copy && cmp -s $SCRATCH/ode $SCRATCH/ode.copy &&
+   cmp -s $SCRATCH/epic $SCRATCH/poem.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/remount.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: text is stored compressed in tail slots, random data as it is
+
+for i in $(seq 1 3000); do
+    echo "line $i: the inode maps its blocks through direct and indirect pointers"
+done > $SCRATCH/text
+head -c 60000 /dev/urandom > $SCRATCH/noise
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/compressed.log 2>&1
+format compressed
+mount
+copyin $SCRATCH/text /text
+copyin $SCRATCH/noise /noise
+stats
+debug
+EOF
+
+echo -n "Testing text compressed in $SCRATCH/image.1000 ... "
+if grep -q "bytes compressed into [0-9]*, ratio" $SCRATCH/compressed.log &&
+   grep -q "direct blocks: [0-9]*:[0-9]* [0-9]*:[0-9]*" $SCRATCH/compressed.log &&
+   grep -q "direct blocks: [0-9]* [0-9]* [0-9]* " $SCRATCH/compressed.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/compressed.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: compressed files read back after a remount, and after being rewritten in part
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/remount.log 2>&1
+mount
+copyout /text $SCRATCH/text.copy
+copyout /noise $SCRATCH/noise.copy
+copyin $SCRATCH/noise /text
+copyout /text $SCRATCH/rewritten.copy
+stats
+EOF
+
+head -c 60000 $SCRATCH/noise > $SCRATCH/rewritten
+tail -c +60001 $SCRATCH/text >> $SCRATCH/rewritten
+
+echo -n "Testing compressed files after a remount in $SCRATCH/image.1000 ... "
+if cmp -s $SCRATCH/text $SCRATCH/text.copy && cmp -s $SCRATCH/noise $SCRATCH/noise.copy &&
+   cmp -s $SCRATCH/rewritten $SCRATCH/rewritten.copy &&
+   grep -q "bytes decompressed at" $SCRATCH/remount.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/remount.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
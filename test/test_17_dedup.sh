@@ -0,0 +1,52 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: a second copy of a file shares the blocks of the first
+
+head -c 60000 /dev/urandom > $SCRATCH/data
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/dedup.log 2>&1
+format dedup
+mount
+copyin $SCRATCH/data /a
+copyin $SCRATCH/data /b
+stats
+debug
+EOF
+
+echo -n "Testing copies sharing blocks in $SCRATCH/image.1000 ... "
+if grep -q "15 shared with blocks already on disk" $SCRATCH/dedup.log &&
+   [ $(grep "indirect data blocks:" $SCRATCH/dedup.log | sort | uniq -d | wc -l) -eq 1 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/dedup.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: removing one copy leaves the other, and the index survives a remount
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/remount.log 2>&1
+mount
+rm /a
+copyout /b $SCRATCH/b.copy
+copyin $SCRATCH/data /c
+copyout /c $SCRATCH/c.copy
+stats
+EOF
+
+echo -n "Testing shared blocks after remove and remount in $SCRATCH/image.1000 ... "
+if cmp -s $SCRATCH/data $SCRATCH/b.copy && cmp -s $SCRATCH/data $SCRATCH/c.copy &&
+   grep -q "15 shared with blocks already on disk" $SCRATCH/remount.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/remount.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
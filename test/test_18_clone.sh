@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: a clone shares the blocks of its source until one of them is written
+
+head -c 60000 /dev/urandom > $SCRATCH/data
+head -c 5000 /dev/urandom > $SCRATCH/patch
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/clone.log 2>&1
+format dedup
+mount
+copyin $SCRATCH/data /a
+clone /a /b
+copyin $SCRATCH/patch /b
+copyout /a $SCRATCH/a.copy
+copyout /b $SCRATCH/b.copy
+EOF
+
+cp $SCRATCH/patch $SCRATCH/patched
+tail -c +5001 $SCRATCH/data >> $SCRATCH/patched
+
+echo -n "Testing clone written in part in $SCRATCH/image.1000 ... "
+if grep -q "cloned inode [0-9]* to inode [0-9]*" $SCRATCH/clone.log &&
+   cmp -s $SCRATCH/data $SCRATCH/a.copy && cmp -s $SCRATCH/patched $SCRATCH/b.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/clone.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: both files survive a remount, and the clone outlives its source
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1000 1000 > $SCRATCH/remount.log 2>&1
+mount
+copyout /a $SCRATCH/a.remount
+rm /a
+copyout /b $SCRATCH/b.remount
+EOF
+
+echo -n "Testing clone after remount and remove in $SCRATCH/image.1000 ... "
+if cmp -s $SCRATCH/data $SCRATCH/a.remount && cmp -s $SCRATCH/patched $SCRATCH/b.remount; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/remount.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
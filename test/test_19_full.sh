@@ -0,0 +1,49 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+# Test: a write past the end of a file on a full disk stores nothing and leaves the size alone
+
+head -c 300000 /dev/urandom > $SCRATCH/data
+head -c 100 /dev/urandom > $SCRATCH/small
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.50 50 > $SCRATCH/full.log 2>&1
+format
+mount
+copyin $SCRATCH/data /fill
+copyin $SCRATCH/small /past 100000
+stat /past
+EOF
+
+echo -n "Testing write past the end on a full disk in $SCRATCH/image.50 ... "
+if grep -q "^0 bytes copied" $SCRATCH/full.log && grep -q "has size 0 bytes" $SCRATCH/full.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/full.log
+    EXIT=$(($EXIT + 1))
+fi
+
+# Test: the failed write leaks no blocks, the space of a removed file can all be used again
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.50 50 > $SCRATCH/reuse.log 2>&1
+mount
+stat /past
+rm /fill
+copyin $SCRATCH/data /again
+EOF
+
+FILLED=$(grep "bytes copied" $SCRATCH/full.log | head -1 | cut -d ' ' -f 1)
+echo -n "Testing free blocks after a full disk in $SCRATCH/image.50 ... "
+if grep -q "has size 0 bytes" $SCRATCH/reuse.log && grep -q "^$FILLED bytes copied" $SCRATCH/reuse.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/reuse.log
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT